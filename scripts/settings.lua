@@ -12,6 +12,11 @@ options = {
     preview_spp = 1,
     preview = true,
     tonemap = "gamma",
+    sampler = "owen",
+    filter = "gaussian",
+    seed = 0,
+    threads = 0,
+    pin_threads = false,
     ray_epsilon = 0.0001
 }
 
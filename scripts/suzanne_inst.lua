@@ -9,14 +9,17 @@ function init()
 
     world = World.new()
 
-    for i = -10,10,2.0 do
-        for j = -10,10,1 do
-            xfm = make_translation(i, j, 0) *
-                  make_scale(0.3, 0.3, 0.3)
+    -- A column of Suzannes, instanced along the x axis
+    column = make_group("column")
+    for j = -10,10,1 do
+        xfm = make_translation(0, j, 0) *
+              make_scale(0.3, 0.3, 0.3)
+
+        column:add_shape(make_instance(shape, xfm, true))
+    end
 
-            inst = make_instance(shape, xfm, true)
-            world:add_shape(inst)
-        end
+    for i = -10,10,2.0 do
+        world:add_shape(make_instance(column, make_translation(i, 0, 0)))
     end
 
     world:preprocess()
@@ -0,0 +1,616 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "accel/bvh_node.h"
+#include "accel/bvh_stats.h"
+#include "math/math.h"
+#include "math/vec3.h"
+#include "math/bbox.h"
+#include "util/stop_watch.h"
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <cassert>
+#include <omp.h>
+
+namespace hop { namespace bvh {
+
+// Binned SAH builder.
+// The item bounds and centroids are fetched once, each node then bins the
+// centroids of its items in a single pass and finds the best split with a
+// prefix/suffix sweep over the bins. The items are partitioned in place in
+// a single index array so no item lists are copied during the build.
+//
+// Nodes with at least MIN_PRIMS_PER_BUILD_TASK items build their children
+// in separate OpenMP tasks, each task writing into its own node buffer.
+// The buffers are stitched together once all the tasks are done so the
+// produced nodes use the same layout as Builder (left child follows its
+// parent) and the leaf callbacks are called in the same depth-first order,
+// from the calling thread. Large nodes also partition their items in
+// parallel chunks.
+//
+// Nodes with more than max_leaf_size items are always split, at the object
+// median when the SAH finds no split, e.g. for the scene BVH whose leaves
+// hold a single instance. Deep nodes are split at the median too so that
+// the tree stays within BVH_MAX_DEPTH.
+template <typename Object, typename Accessor>
+class BinnedBuilder
+{
+public:
+    typedef std::function<void(Node*, const std::vector<Object>&)> LeafCreationCallback;
+
+    static std::vector<Node> build(Accessor* accessor, const std::vector<Object>& items, uint32 min_leaf_size,
+                                   LeafCreationCallback callback, BuildStats* stats = nullptr,
+                                   uint32 max_leaf_size = std::numeric_limits<uint32>::max());
+
+private:
+    static constexpr uint32 num_bins = NUM_SAH_SPLITS;
+    static constexpr Real min_side_length = 1e-3;
+
+    struct Bin
+    {
+        BBoxr bbox;
+        uint32 count;
+    };
+
+    struct BinSet
+    {
+        Bin bins[3][num_bins];
+
+        BinSet()
+        {
+            for (uint8 axis = 0; axis < 3; ++axis)
+                for (uint32 b = 0; b < num_bins; ++b)
+                    bins[axis][b].count = 0;
+        }
+    };
+
+    struct Binning
+    {
+        Vec3r pmin;
+        Vec3r scale; // 0 when the axis is too thin to be split
+
+        uint32 index(const Vec3r& centroid, uint8 axis) const
+        {
+            const uint32 b = (uint32)((centroid[axis] - pmin[axis]) * scale[axis]);
+            return min(b, num_bins - 1);
+        }
+    };
+
+    struct LeafRange
+    {
+        uint32 node;
+        uint32 begin, end;
+    };
+
+    // Part of the tree built by a single task. Subtrees that are split
+    // across tasks only hold their root node and their two children,
+    // the others hold their nodes with indices local to the subtree.
+    struct Subtree
+    {
+        BBoxr bbox;
+        Node node;
+        std::unique_ptr<Subtree> left, right;
+        std::vector<Node> nodes;
+        std::vector<LeafRange> leaves;
+        uint32 max_depth;
+
+        Subtree() : max_depth(0) { }
+    };
+
+    BinnedBuilder()
+        : m_min_leaf_size(0), m_max_leaf_size(0), m_max_depth(0)
+    {
+    }
+
+    void build_task(Subtree* subtree, uint32 begin, uint32 end, uint32 depth);
+    uint32 build_serial(Subtree* subtree, uint32 begin, uint32 end, uint32 depth, BBoxr& node_bbox);
+    bool split(uint32 begin, uint32 end, uint32 depth, BBoxr& node_bbox, uint32* mid, uint8* axis);
+    uint32 median_split(uint32 begin, uint32 end, const BBoxr& centroid_bbox, uint8* axis);
+    template <typename Predicate>
+    uint32 partition(uint32 begin, uint32 end, Predicate is_left);
+    void compute_bounds(uint32 begin, uint32 end, BBoxr* node_bbox, BBoxr* centroid_bbox) const;
+    void compute_bins(uint32 begin, uint32 end, const Binning& binning, BinSet* bin_set) const;
+    uint32 create_leaf(Subtree* subtree, uint32 begin, uint32 end);
+    uint32 stitch(Subtree* subtree);
+    void create_leaves(const std::vector<Object>& items, LeafCreationCallback callback);
+
+    static uint32 num_chunks(uint32 count);
+
+private:
+    std::vector<Node> m_nodes;
+    std::vector<BBoxr> m_bboxes;
+    std::vector<Vec3r> m_centroids;
+    std::vector<uint32> m_indices;
+    std::vector<uint32> m_scratch; // partition buffer of the large nodes
+    std::vector<LeafRange> m_leaves;
+
+    uint32 m_min_leaf_size;
+    uint32 m_max_leaf_size;
+    uint32 m_max_depth;
+};
+
+template <typename Object, typename Accessor>
+std::vector<Node> BinnedBuilder<Object, Accessor>::build(Accessor* accessor,
+        const std::vector<Object>& items, uint32 min_leaf_size, LeafCreationCallback callback, BuildStats* stats,
+        uint32 max_leaf_size)
+{
+    StopWatch stop_watch;
+    stop_watch.start();
+
+    BinnedBuilder builder;
+    builder.m_min_leaf_size = max(1u, min_leaf_size);
+    builder.m_max_leaf_size = max(builder.m_min_leaf_size, max_leaf_size);
+
+    const uint32 num_items = items.size();
+    builder.m_bboxes.resize(num_items);
+    builder.m_centroids.resize(num_items);
+    builder.m_indices.resize(num_items);
+    if (num_items >= 4 * MIN_PRIMS_PER_BUILD_TASK)
+        builder.m_scratch.resize(num_items);
+
+#pragma omp parallel for if (num_items >= MIN_PRIMS_PER_BUILD_TASK)
+    for (uint32 i = 0; i < num_items; ++i)
+    {
+        builder.m_bboxes[i] = accessor->get_bbox(items[i]);
+        builder.m_centroids[i] = accessor->get_centroid(items[i]);
+        builder.m_indices[i] = i;
+    }
+
+    Subtree root;
+    if (num_items > 0)
+    {
+        // Join the current team if we are already running in parallel,
+        // this lets several BVHs be built concurrently
+        if (omp_in_parallel())
+        {
+#pragma omp taskgroup
+            builder.build_task(&root, 0, num_items, 0);
+        }
+        else
+        {
+#pragma omp parallel
+#pragma omp single
+            builder.build_task(&root, 0, num_items, 0);
+        }
+
+        // Worst case is a full binary tree with one item per leaf
+        builder.m_nodes.reserve(2 * num_items - 1);
+        builder.stitch(&root);
+    }
+
+    builder.create_leaves(items, callback);
+
+    stop_watch.stop();
+
+    if (stats)
+    {
+        stats->num_items = num_items;
+        stats->num_nodes = builder.m_nodes.size();
+        stats->num_leaves = builder.m_leaves.size();
+        stats->max_depth = builder.m_max_depth;
+        stats->build_time_ms = stop_watch.get_elapsed_time_ms();
+        stats->sah_cost = compute_sah_cost(builder.m_nodes, root.bbox);
+    }
+
+    return std::move(builder.m_nodes);
+}
+
+template <typename Object, typename Accessor>
+void BinnedBuilder<Object, Accessor>::build_task(Subtree* subtree, uint32 begin, uint32 end, uint32 depth)
+{
+    // Small subtrees are built serially in the subtree's own node buffer
+    if (end - begin < MIN_PRIMS_PER_BUILD_TASK)
+    {
+        build_serial(subtree, begin, end, depth, subtree->bbox);
+        return;
+    }
+
+    uint32 mid;
+    uint8 axis;
+    if (!split(begin, end, depth, subtree->bbox, &mid, &axis))
+    {
+        subtree->max_depth = depth;
+        create_leaf(subtree, begin, end);
+        return;
+    }
+
+    subtree->node.set_split_axis(axis);
+    subtree->left = std::make_unique<Subtree>();
+    subtree->right = std::make_unique<Subtree>();
+
+    Subtree* left = subtree->left.get();
+    Subtree* right = subtree->right.get();
+
+#pragma omp task
+    build_task(left, begin, mid, depth + 1);
+#pragma omp task
+    build_task(right, mid, end, depth + 1);
+}
+
+template <typename Object, typename Accessor>
+uint32 BinnedBuilder<Object, Accessor>::build_serial(
+        Subtree* subtree, uint32 begin, uint32 end, uint32 depth, BBoxr& node_bbox)
+{
+    if (depth > subtree->max_depth)
+        subtree->max_depth = depth;
+
+    uint32 mid;
+    uint8 axis;
+    if (!split(begin, end, depth, node_bbox, &mid, &axis))
+        return create_leaf(subtree, begin, end);
+
+    // Add node to list
+    uint32 node_index = subtree->nodes.size();
+    subtree->nodes.push_back(Node());
+
+    // Partition children and update node indices
+    BBoxr left_bbox, right_bbox;
+    uint32 left_node_index = build_serial(subtree, begin, mid, depth + 1, left_bbox);
+    uint32 right_node_index = build_serial(subtree, mid, end, depth + 1, right_bbox);
+
+    assert(left_node_index == node_index + 1);
+    (void)left_node_index;
+
+    Node& node = subtree->nodes[node_index];
+    node.set_right_child(right_node_index);
+    node.set_left_bbox(left_bbox);
+    node.set_right_bbox(right_bbox);
+    node.set_split_axis(axis);
+
+    return node_index;
+}
+
+// Compute the node bbox and find the best binned SAH split. If splitting
+// is better than creating a leaf, the items are partitioned in place and
+// the index of the first item of the right child is returned in mid.
+template <typename Object, typename Accessor>
+bool BinnedBuilder<Object, Accessor>::split(uint32 begin, uint32 end, uint32 depth, BBoxr& node_bbox,
+                                            uint32* mid, uint8* split_axis)
+{
+    BBoxr centroid_bbox;
+    compute_bounds(begin, end, &node_bbox, &centroid_bbox);
+
+    const uint32 count = end - begin;
+    if (count <= m_min_leaf_size)
+        return false;
+
+    Binning binning;
+    binning.pmin = centroid_bbox.pmin;
+    const Vec3r centroid_side = centroid_bbox.pmax - centroid_bbox.pmin;
+    for (uint8 axis = 0; axis < 3; ++axis)
+        binning.scale[axis] = centroid_side[axis] < min_side_length ? Real(0) : Real(num_bins) * rcp(centroid_side[axis]);
+
+    BinSet bin_set;
+    compute_bins(begin, end, binning, &bin_set);
+
+    // The cost of not splitting the node
+    Real best_score = (Real)count * node_bbox.get_half_area();
+    int best_axis = -1;
+    uint32 best_bin = 0;
+    uint32 best_left_count = 0;
+
+    for (uint8 axis = 0; axis < 3; ++axis)
+    {
+        if (binning.scale[axis] == Real(0))
+            continue;
+
+        const Bin* bins = bin_set.bins[axis];
+
+        // Sweep from the right to get the cost of the right side of each split plane
+        Real right_scores[num_bins];
+        BBoxr right_bbox;
+        uint32 right_count = 0;
+        for (uint32 b = num_bins - 1; b > 0; --b)
+        {
+            right_bbox.merge(bins[b].bbox);
+            right_count += bins[b].count;
+            right_scores[b - 1] = (Real)right_count * right_bbox.get_half_area();
+        }
+
+        // Sweep from the left and evaluate the split after each bin
+        BBoxr left_bbox;
+        uint32 left_count = 0;
+        for (uint32 b = 0; b < num_bins - 1; ++b)
+        {
+            left_bbox.merge(bins[b].bbox);
+            left_count += bins[b].count;
+
+            if (left_count == 0 || left_count == count)
+                continue;
+
+            const Real score = BVH_TRAV_COST * ((Real)left_count * left_bbox.get_half_area() + right_scores[b]);
+            if (score < best_score)
+            {
+                best_score = score;
+                best_axis = axis;
+                best_bin = b;
+                best_left_count = left_count;
+            }
+        }
+    }
+
+    // If we can't find a split that improves the current node score create a leaf
+#ifdef TRIS_SIMD_ISECT
+    if (best_axis < 0 || best_left_count < m_min_leaf_size || count - best_left_count < m_min_leaf_size)
+#else
+    if (best_axis < 0)
+#endif
+    {
+        if (count <= m_max_leaf_size)
+            return false;
+        *mid = median_split(begin, end, centroid_bbox, split_axis);
+        return true;
+    }
+
+    if (must_split_at_median(depth, count))
+    {
+        *mid = median_split(begin, end, centroid_bbox, split_axis);
+        return true;
+    }
+
+    // Partition the items in place
+    const uint8 axis = (uint8)best_axis;
+    const uint32 middle = partition(begin, end, [&](uint32 idx)
+    {
+        return binning.index(m_centroids[idx], axis) <= best_bin;
+    });
+    assert(middle == begin + best_left_count);
+    (void)middle;
+
+    *mid = begin + best_left_count;
+    *split_axis = axis;
+    return true;
+}
+
+// Split the items in two halves along the largest axis of their centroids.
+// Used when the node must be split but the SAH finds no split, the
+// centroids can all be the same, and near BVH_MAX_DEPTH.
+template <typename Object, typename Accessor>
+uint32 BinnedBuilder<Object, Accessor>::median_split(uint32 begin, uint32 end, const BBoxr& centroid_bbox, uint8* axis)
+{
+    const Vec3r side = centroid_bbox.pmax - centroid_bbox.pmin;
+    *axis = side.x > side.y ? (side.x > side.z ? 0 : 2) : (side.y > side.z ? 1 : 2);
+
+    const uint32 mid = begin + (end - begin) / 2;
+    std::nth_element(m_indices.begin() + begin, m_indices.begin() + mid, m_indices.begin() + end,
+                     [&](uint32 a, uint32 b) { return m_centroids[a][*axis] < m_centroids[b][*axis]; });
+    return mid;
+}
+
+// Move the items for which is_left is true before the others and return the
+// index of the first other item. Large nodes count the left items of each
+// chunk, then scatter the chunks to their place in parallel.
+template <typename Object, typename Accessor>
+template <typename Predicate>
+uint32 BinnedBuilder<Object, Accessor>::partition(uint32 begin, uint32 end, Predicate is_left)
+{
+    // The extra pass over the items only pays off with several threads
+    const uint32 chunks = num_chunks(end - begin);
+    if (chunks == 1 || omp_get_num_threads() == 1)
+        return std::partition(m_indices.begin() + begin, m_indices.begin() + end, is_left) - m_indices.begin();
+
+    const uint32 chunk_size = (end - begin + chunks - 1) / chunks;
+    auto chunk_begin = [&](uint32 c) { return min(end, begin + c * chunk_size); };
+
+    std::vector<uint32> left_counts(chunks, 0);
+#pragma omp taskloop shared(left_counts, chunk_begin, is_left)
+    for (uint32 c = 0; c < chunks; ++c)
+    {
+        for (uint32 i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+            left_counts[c] += is_left(m_indices[i]) ? 1 : 0;
+    }
+
+    // Each chunk writes its left items after the left items of the previous
+    // chunks and its right items after all the left items
+    std::vector<uint32> left_offsets(chunks), right_offsets(chunks);
+    uint32 num_left = 0;
+    for (uint32 c = 0; c < chunks; ++c)
+    {
+        left_offsets[c] = begin + num_left;
+        num_left += left_counts[c];
+    }
+    const uint32 mid = begin + num_left;
+    for (uint32 c = 0; c < chunks; ++c)
+        right_offsets[c] = mid + (chunk_begin(c) - begin) - (left_offsets[c] - begin);
+
+    // The scratch ranges of concurrent nodes don't overlap either
+#pragma omp taskloop shared(left_offsets, right_offsets, chunk_begin, is_left)
+    for (uint32 c = 0; c < chunks; ++c)
+    {
+        uint32 left = left_offsets[c];
+        uint32 right = right_offsets[c];
+        for (uint32 i = chunk_begin(c); i < chunk_begin(c + 1); ++i)
+        {
+            const uint32 idx = m_indices[i];
+            m_scratch[is_left(idx) ? left++ : right++] = idx;
+        }
+    }
+
+#pragma omp taskloop shared(chunk_begin)
+    for (uint32 c = 0; c < chunks; ++c)
+        std::copy(m_scratch.begin() + chunk_begin(c), m_scratch.begin() + chunk_begin(c + 1), m_indices.begin() + chunk_begin(c));
+
+    return mid;
+}
+
+// Number of chunks used to process a node's items in parallel
+template <typename Object, typename Accessor>
+uint32 BinnedBuilder<Object, Accessor>::num_chunks(uint32 count)
+{
+    if (count < 4 * MIN_PRIMS_PER_BUILD_TASK)
+        return 1;
+    return min(count / MIN_PRIMS_PER_BUILD_TASK, 4 * (uint32)omp_get_num_threads());
+}
+
+template <typename Object, typename Accessor>
+void BinnedBuilder<Object, Accessor>::compute_bounds(
+        uint32 begin, uint32 end, BBoxr* node_bbox, BBoxr* centroid_bbox) const
+{
+    const uint32 chunks = num_chunks(end - begin);
+    const uint32 chunk_size = (end - begin + chunks - 1) / chunks;
+
+    std::vector<BBoxr> bboxes(chunks), centroid_bboxes(chunks);
+
+    auto bound_chunk = [&](uint32 c)
+    {
+        const uint32 chunk_end = min(end, begin + (c + 1) * chunk_size);
+        for (uint32 i = begin + c * chunk_size; i < chunk_end; ++i)
+        {
+            const uint32 idx = m_indices[i];
+            bboxes[c].merge(m_bboxes[idx]);
+            centroid_bboxes[c].merge(m_centroids[idx]);
+        }
+    };
+
+    if (chunks == 1)
+    {
+        bound_chunk(0);
+    }
+    else
+    {
+#pragma omp taskloop shared(bound_chunk)
+        for (uint32 c = 0; c < chunks; ++c)
+            bound_chunk(c);
+    }
+
+    *node_bbox = BBoxr();
+    *centroid_bbox = BBoxr();
+    for (uint32 c = 0; c < chunks; ++c)
+    {
+        node_bbox->merge(bboxes[c]);
+        centroid_bbox->merge(centroid_bboxes[c]);
+    }
+}
+
+// Bin the items along the three axes in a single pass
+template <typename Object, typename Accessor>
+void BinnedBuilder<Object, Accessor>::compute_bins(
+        uint32 begin, uint32 end, const Binning& binning, BinSet* bin_set) const
+{
+    const uint32 chunks = num_chunks(end - begin);
+    const uint32 chunk_size = (end - begin + chunks - 1) / chunks;
+
+    std::vector<BinSet> chunk_bins(chunks);
+
+    auto bin_chunk = [&](uint32 c)
+    {
+        BinSet& local = chunk_bins[c];
+        const uint32 chunk_end = min(end, begin + (c + 1) * chunk_size);
+        for (uint32 i = begin + c * chunk_size; i < chunk_end; ++i)
+        {
+            const uint32 idx = m_indices[i];
+            for (uint8 axis = 0; axis < 3; ++axis)
+            {
+                if (binning.scale[axis] == Real(0))
+                    continue;
+                Bin& bin = local.bins[axis][binning.index(m_centroids[idx], axis)];
+                bin.bbox.merge(m_bboxes[idx]);
+                ++bin.count;
+            }
+        }
+    };
+
+    if (chunks == 1)
+    {
+        bin_chunk(0);
+    }
+    else
+    {
+#pragma omp taskloop shared(bin_chunk)
+        for (uint32 c = 0; c < chunks; ++c)
+            bin_chunk(c);
+    }
+
+    *bin_set = chunk_bins[0];
+    for (uint32 c = 1; c < chunks; ++c)
+    {
+        for (uint8 axis = 0; axis < 3; ++axis)
+        {
+            for (uint32 b = 0; b < num_bins; ++b)
+            {
+                bin_set->bins[axis][b].bbox.merge(chunk_bins[c].bins[axis][b].bbox);
+                bin_set->bins[axis][b].count += chunk_bins[c].bins[axis][b].count;
+            }
+        }
+    }
+}
+
+template <typename Object, typename Accessor>
+uint32 BinnedBuilder<Object, Accessor>::create_leaf(Subtree* subtree, uint32 begin, uint32 end)
+{
+    uint32 node_index = subtree->nodes.size();
+    subtree->nodes.push_back(Node());
+    subtree->nodes.back().set_type(1);
+    subtree->leaves.push_back({ node_index, begin, end });
+    return node_index;
+}
+
+// Append the subtree nodes to the final node list, depth first, and
+// return the index of the subtree root
+template <typename Object, typename Accessor>
+uint32 BinnedBuilder<Object, Accessor>::stitch(Subtree* subtree)
+{
+    if (!subtree->left)
+    {
+        const uint32 offset = m_nodes.size();
+        for (auto& node : subtree->nodes)
+        {
+            node.offset_child_nodes(offset);
+            m_nodes.push_back(node);
+        }
+        for (const auto& leaf : subtree->leaves)
+            m_leaves.push_back({ leaf.node + offset, leaf.begin, leaf.end });
+
+        m_max_depth = max(m_max_depth, subtree->max_depth);
+
+        // Release the subtree buffers as we go
+        subtree->nodes = std::vector<Node>();
+        subtree->leaves = std::vector<LeafRange>();
+
+        return offset;
+    }
+
+    const uint32 node_index = m_nodes.size();
+    m_nodes.push_back(subtree->node);
+
+    uint32 left_node_index = stitch(subtree->left.get());
+    uint32 right_node_index = stitch(subtree->right.get());
+
+    assert(left_node_index == node_index + 1);
+    (void)left_node_index;
+
+    Node& node = m_nodes[node_index];
+    node.set_right_child(right_node_index);
+    node.set_left_bbox(subtree->left->bbox);
+    node.set_right_bbox(subtree->right->bbox);
+
+    return node_index;
+}
+
+// Hand the leaves to the callback once the tree is complete, in the order
+// they were created
+template <typename Object, typename Accessor>
+void BinnedBuilder<Object, Accessor>::create_leaves(const std::vector<Object>& items, LeafCreationCallback callback)
+{
+    std::vector<Object> leaf_items;
+    for (const auto& leaf : m_leaves)
+    {
+        leaf_items.clear();
+        for (uint32 i = leaf.begin; i < leaf.end; ++i)
+            leaf_items.push_back(items[m_indices[i]]);
+
+        Node* node = &m_nodes[leaf.node];
+        callback(node, leaf_items);
+
+        // Make sure this is a leaf if the callback ignored it
+        if (node->get_type() == 0)
+            node->set_type(1);
+    }
+}
+
+} } // namespace hop::bvh
@@ -3,32 +3,42 @@
 #include "hop.h"
 #include "types.h"
 #include "accel/bvh_node.h"
+#include "accel/bvh_stats.h"
 #include "math/math.h"
 #include "math/vec3.h"
 #include "math/bbox.h"
+#include "util/stop_watch.h"
 
 #include <vector>
 #include <functional>
+#include <algorithm>
+#include <limits>
 #include <cassert>
 
 namespace hop { namespace bvh {
 
+// Nodes with more than max_leaf_size items are always split, at the object
+// median when no split plane improves the SAH. Deep nodes are split at the
+// median too so that the tree stays within BVH_MAX_DEPTH.
 template <typename Object, typename Accessor, typename ScoringStrategy>
 class Builder
 {
 public:
     typedef std::function<void(Node*, const std::vector<Object>&)> LeafCreationCallback;
 
-    static std::vector<Node> build(Accessor* accessor, const std::vector<Object>& items, uint32 min_leaf_size, LeafCreationCallback callback);
+    static std::vector<Node> build(Accessor* accessor, const std::vector<Object>& items, uint32 min_leaf_size,
+                                   LeafCreationCallback callback, BuildStats* stats = nullptr,
+                                   uint32 max_leaf_size = std::numeric_limits<uint32>::max());
 
 private:
     Builder()
-        : m_callback(nullptr), m_min_leaf_size(0), m_num_partitioned_items(0), m_num_total_items(0)
+        : m_callback(nullptr), m_min_leaf_size(0), m_max_leaf_size(0), m_num_partitioned_items(0), m_num_total_items(0)
         , m_num_nodes(0), m_num_leaves(0), m_max_depth(0)
     {
     }
 
     uint32 partition(const std::vector<Object>& items, int depth, BBoxr& node_bbox);
+    uint8 median_split(const std::vector<Object>& items, std::vector<Object>* left_items, std::vector<Object>* right_items);
     uint32 create_leaf(Node* node, const std::vector<Object>& items);
 
 private:
@@ -50,6 +60,7 @@ private:
     Accessor* m_accessor;
 
     uint32 m_min_leaf_size;
+    uint32 m_max_leaf_size;
     uint32 m_num_partitioned_items;
     uint32 m_num_total_items;
     uint32 m_num_nodes;
@@ -59,17 +70,34 @@ private:
 
 template <typename Object, typename Accessor, typename ScoringStrategy>
 std::vector<Node> Builder<Object, Accessor, ScoringStrategy>::build(Accessor* accessor,
-        const std::vector<Object>& items, uint32 min_leaf_size, LeafCreationCallback callback)
+        const std::vector<Object>& items, uint32 min_leaf_size, LeafCreationCallback callback, BuildStats* stats,
+        uint32 max_leaf_size)
 {
+    StopWatch stop_watch;
+    stop_watch.start();
+
     Builder builder;
     builder.m_accessor = accessor;
     builder.m_callback = callback;
     builder.m_min_leaf_size = min_leaf_size;
+    builder.m_max_leaf_size = max(min_leaf_size, max_leaf_size);
     builder.m_num_total_items = items.size();
 
     BBoxr bbox;
     builder.partition(items, 0, bbox);
 
+    stop_watch.stop();
+
+    if (stats)
+    {
+        stats->num_items = builder.m_num_total_items;
+        stats->num_nodes = builder.m_nodes.size();
+        stats->num_leaves = builder.m_num_leaves;
+        stats->max_depth = builder.m_max_depth;
+        stats->build_time_ms = stop_watch.get_elapsed_time_ms();
+        stats->sah_cost = compute_sah_cost(builder.m_nodes, bbox);
+    }
+
     return std::move(builder.m_nodes);
 }
 
@@ -94,7 +122,7 @@ uint32 Builder<Object, Accessor, ScoringStrategy>::partition(
     Real best_score = ScoringStrategy::score_partition(m_accessor, items);
 
     constexpr size_t num_buckets = NUM_SAH_SPLITS;
-    static SplitScore score_list[3 * num_buckets];
+    SplitScore score_list[3 * num_buckets];
     size_t num_scores = 0;
 
     const Vec3r side = node_bbox.pmax - node_bbox.pmin;
@@ -135,26 +163,37 @@ uint32 Builder<Object, Accessor, ScoringStrategy>::partition(
         }
     }
 
-    // If we can't find a split that improves the current node score create a leaf
+    // If we can't find a split that improves the current node score create a
+    // leaf, unless the node has too many items
 #ifdef TRIS_SIMD_ISECT
-    if (best_split == nullptr || best_split->left_count < m_min_leaf_size || best_split->right_count < m_min_leaf_size)
+    const bool no_split = best_split == nullptr || best_split->left_count < m_min_leaf_size || best_split->right_count < m_min_leaf_size;
 #else
-    if (best_split == nullptr)
+    const bool no_split = best_split == nullptr;
 #endif
+    if (no_split && items.size() <= m_max_leaf_size)
         return create_leaf(&node, items);
 
     // Split items list into two sets
     std::vector<Object> left_items, right_items;
-    left_items.reserve(best_split->left_count);
-    right_items.reserve(best_split->right_count);
-
-    for (auto& item : items)
+    uint8 split_axis;
+    if (no_split || must_split_at_median(depth, items.size()))
+    {
+        split_axis = median_split(items, &left_items, &right_items);
+    }
+    else
     {
-        Vec3r center = m_accessor->get_centroid(item);
-        if (center[best_split->axis] < best_split->split_point)
-            left_items.push_back(item);
-        else
-            right_items.push_back(item);
+        split_axis = best_split->axis;
+        left_items.reserve(best_split->left_count);
+        right_items.reserve(best_split->right_count);
+
+        for (auto& item : items)
+        {
+            Vec3r center = m_accessor->get_centroid(item);
+            if (center[best_split->axis] < best_split->split_point)
+                left_items.push_back(item);
+            else
+                right_items.push_back(item);
+        }
     }
 
     // Add node to list
@@ -172,11 +211,36 @@ uint32 Builder<Object, Accessor, ScoringStrategy>::partition(
     m_nodes[node_index].set_right_child(right_node_index);
     m_nodes[node_index].set_left_bbox(left_bbox);
     m_nodes[node_index].set_right_bbox(right_bbox);
-    m_nodes[node_index].set_split_axis(best_split->axis);
+    m_nodes[node_index].set_split_axis(split_axis);
 
     return node_index;
 }
 
+// Split the items in two halves along the largest axis of their centroids,
+// the centroids can all be the same
+template <typename Object, typename Accessor, typename ScoringStrategy>
+uint8 Builder<Object, Accessor, ScoringStrategy>::median_split(
+        const std::vector<Object>& items, std::vector<Object>* left_items, std::vector<Object>* right_items)
+{
+    BBoxr centroid_bbox;
+    for (auto& item : items)
+        centroid_bbox.merge(m_accessor->get_centroid(item));
+
+    const Vec3r side = centroid_bbox.pmax - centroid_bbox.pmin;
+    const uint8 axis = side.x > side.y ? (side.x > side.z ? 0 : 2) : (side.y > side.z ? 1 : 2);
+
+    std::vector<Object> sorted = items;
+    auto mid = sorted.begin() + sorted.size() / 2;
+    std::nth_element(sorted.begin(), mid, sorted.end(), [&](const Object& a, const Object& b)
+    {
+        return m_accessor->get_centroid(a)[axis] < m_accessor->get_centroid(b)[axis];
+    });
+
+    left_items->assign(sorted.begin(), mid);
+    right_items->assign(mid, sorted.end());
+    return axis;
+}
+
 template <typename Object, typename Accessor, typename ScoringStrategy>
 uint32 Builder<Object, Accessor, ScoringStrategy>::create_leaf(Node* node, const std::vector<Object>& items)
 {
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "geometry/hit_info.h"
+#include "math/vec3.h"
+
+namespace hop { namespace bvh {
+
+// Ray of a single ray traversal, saved when it enters an instance along
+// with its reciprocal direction so leaving the instance is only a copy
+struct InstanceRay
+{
+    Vec3r org;
+    Vec3r dir;
+    Vec3r inv_dir;
+    Vec3i dir_is_neg;
+};
+
+// Instances a traversal went down into, at most MAX_INSTANCE_DEPTH levels.
+// Each level keeps the ray of its parent space and the index of the
+// traversal stack its BVH root was pushed at, the level is left when the
+// stack gets back to that index.
+template <typename RayState>
+class InstanceStack
+{
+public:
+    InstanceStack() : m_depth(0) { }
+
+    // Enter an instance whose BVH root is about to be pushed at stack_index.
+    // Returns false if the instance would nest too deep, it must be skipped.
+    bool push(uint32 instance, int stack_index, const RayState& parent_ray)
+    {
+        if (unlikely(m_depth == MAX_INSTANCE_DEPTH))
+            return false;
+
+        m_levels[m_depth].stack_index = stack_index;
+        m_levels[m_depth].parent_ray = parent_ray;
+        m_path[m_depth++] = instance;
+        return true;
+    }
+
+    // Leave the levels whose BVHs are done. Returns false if there are none,
+    // otherwise the ray of the level the traversal is back in is returned.
+    bool pop(int stack_index, RayState* ray)
+    {
+        if (m_depth == 0 || m_levels[m_depth - 1].stack_index != stack_index)
+            return false;
+
+        // Nested BVHs whose roots are leaves end at the same stack index
+        while (m_depth > 0 && m_levels[m_depth - 1].stack_index == stack_index)
+            *ray = m_levels[--m_depth].parent_ray;
+        return true;
+    }
+
+    // Record the instances holding the primitive that was hit
+    void set_hit(HitInfo* hit) const
+    {
+        hit->shape_id = m_path[m_depth - 1];
+        hit->instance_depth = m_depth;
+        for (uint32 i = 0; i < m_depth; ++i)
+            hit->instance_ids[i] = m_path[i];
+    }
+
+private:
+    struct Level
+    {
+        int stack_index;
+        RayState parent_ray;
+    };
+
+    Level m_levels[MAX_INSTANCE_DEPTH];
+    uint32 m_path[MAX_INSTANCE_DEPTH];
+    uint32 m_depth;
+};
+
+} } // namespace hop::bvh
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "accel/bvh_node.h"
+#include "accel/bvh_instance_stack.h"
+#include "geometry/ray.h"
+#include "geometry/hit_info.h"
+#include "math/math.h"
+#include "math/affine_transform.h"
+
+#include <alloca.h>
+#include <cstring>
+
+namespace hop { namespace bvh {
+
+// Rays of a packet stored as SoA so a node can be tested against all
+// of them in one vectorized loop
+template <uint32 P>
+class ALIGN(32) RayPacket
+{
+public:
+    Real org[3][P];
+    Real dir[3][P];
+    Real rcp_dir[3][P];
+    Real tmin[P];
+    Real tmax[P];
+
+    void set(uint32 i, const Ray& ray)
+    {
+        const Vec3r inv_dir = rcp(ray.dir);
+        for (uint32 axis = 0; axis < 3; ++axis)
+        {
+            org[axis][i] = ray.org[axis];
+            dir[axis][i] = ray.dir[axis];
+            rcp_dir[axis][i] = inv_dir[axis];
+        }
+        tmin[i] = ray.tmin;
+        tmax[i] = ray.tmax;
+    }
+};
+
+// Test the two children of an interior node against the rays of the
+// packet, only the rays in mask are considered
+template <uint32 P>
+inline void intersect_node(const Node& node, const RayPacket<P>& packet, uint32 mask,
+                           uint32* left_mask, uint32* right_mask)
+{
+    const Real* b = node.bbox_data;
+    uint8 hit_left[P];
+    uint8 hit_right[P];
+
+#pragma omp simd
+    for (uint32 i = 0; i < P; ++i)
+    {
+        Real near_left = packet.tmin[i], far_left = packet.tmax[i];
+        Real near_right = packet.tmin[i], far_right = packet.tmax[i];
+        for (uint32 axis = 0; axis < 3; ++axis)
+        {
+            const Real o = packet.org[axis][i];
+            const Real r = packet.rcp_dir[axis][i];
+            const Real t0l = (b[axis * 4 + 0] - o) * r;
+            const Real t1l = (b[axis * 4 + 2] - o) * r;
+            const Real t0r = (b[axis * 4 + 1] - o) * r;
+            const Real t1r = (b[axis * 4 + 3] - o) * r;
+            near_left = max(near_left, min(t0l, t1l));
+            far_left = min(far_left, max(t0l, t1l));
+            near_right = max(near_right, min(t0r, t1r));
+            far_right = min(far_right, max(t0r, t1r));
+        }
+        hit_left[i] = near_left <= far_left;
+        hit_right[i] = near_right <= far_right;
+    }
+
+    uint32 l = 0, r = 0;
+    for (uint32 i = 0; i < P; ++i)
+    {
+        l |= (uint32)hit_left[i] << i;
+        r |= (uint32)hit_right[i] << i;
+    }
+    *left_mask = l & mask;
+    *right_mask = r & mask;
+}
+
+// Trace a packet of up to P rays through the two-level BVH. The rays
+// traverse the tree together, each node is fetched once for the whole
+// packet and a mask keeps track of the rays still interested in a subtree.
+// If any_hit is true the rays stop at their first hit. The stack is sized
+// from max_depth, the levels of the BVHs down the deepest path.
+// Returns the mask of the rays that hit something.
+template <uint32 P, bool any_hit, typename Visitor>
+uint32 intersect_packet_two_levels(const Node* nodes, const AffineTransform* inv_transforms, const uint32* bvh_roots,
+                                   uint32 max_depth, const Ray* rays, HitInfo* hits, uint32 num_rays, Visitor& visitor)
+{
+    struct StackEntry
+    {
+        uint32 node;
+        uint32 mask;
+    };
+
+    // Rays of the packet with their reciprocal directions, saved when
+    // they enter an instance so leaving the instance is only a copy
+    struct PacketRays
+    {
+        Real org[3][P];
+        Real dir[3][P];
+        Real rcp_dir[3][P];
+    };
+
+    // Rays in the space of the current BVH, world or instance
+    RayPacket<P> packet;
+    for (uint32 i = 0; i < num_rays; ++i)
+        packet.set(i, rays[i]);
+    for (uint32 i = num_rays; i < P; ++i)
+        packet.set(i, Ray(Vec3r(), Vec3r(1, 1, 1), 1, 0));
+
+    // Each level leaves at most one child on the stack
+    StackEntry* node_stack = static_cast<StackEntry*>(alloca((max_depth + 1) * sizeof(StackEntry)));
+    int stack_index = 0;
+    node_stack[stack_index++] = { 0, (1u << num_rays) - 1 };
+
+    uint32 hit_mask = 0;
+    InstanceStack<PacketRays> instances;
+    PacketRays parent_rays;
+
+    while (stack_index > 0)
+    {
+        // If we exited from instance BVHs, we need to restore the rays of the parent level
+        if (instances.pop(stack_index, &parent_rays))
+        {
+            std::memcpy(packet.org, parent_rays.org, sizeof(packet.org));
+            std::memcpy(packet.dir, parent_rays.dir, sizeof(packet.dir));
+            std::memcpy(packet.rcp_dir, parent_rays.rcp_dir, sizeof(packet.rcp_dir));
+        }
+
+        const StackEntry entry = node_stack[--stack_index];
+        const uint32 mask = any_hit ? entry.mask & ~hit_mask : entry.mask;
+        if (mask == 0)
+            continue;
+
+        const Node& node = nodes[entry.node];
+
+        if (likely(node.is_interior()))
+        {
+            uint32 left_mask, right_mask;
+            intersect_node(node, packet, mask, &left_mask, &right_mask);
+
+            // Visit the near child first, as seen by the first active ray
+            const uint32 first = __builtin_ctz(mask);
+            const bool left_first = packet.rcp_dir[node.get_split_axis()][first] >= 0;
+
+            const StackEntry left = { entry.node + 1, left_mask };
+            const StackEntry right = { node.get_right_child(), right_mask };
+            if (left_first)
+            {
+                if (right_mask) node_stack[stack_index++] = right;
+                if (left_mask) node_stack[stack_index++] = left;
+            }
+            else
+            {
+                if (left_mask) node_stack[stack_index++] = left;
+                if (right_mask) node_stack[stack_index++] = right;
+            }
+        }
+        else if (node.get_num_primitives() == 0)
+        {
+            // This is an instance leaf, of the top level BVH or of a group BVH.
+            // Push the BVH root of the instanced shape to the stack
+            const uint32 instance_idx = node.get_instance_index();
+            std::memcpy(parent_rays.org, packet.org, sizeof(packet.org));
+            std::memcpy(parent_rays.dir, packet.dir, sizeof(packet.dir));
+            std::memcpy(parent_rays.rcp_dir, packet.rcp_dir, sizeof(packet.rcp_dir));
+            if (instances.push(instance_idx, stack_index, parent_rays))
+            {
+                node_stack[stack_index++] = { bvh_roots[instance_idx], mask };
+
+                // Transform the rays to the instance space
+                transform_rays<P>(inv_transforms[instance_idx], packet.org, packet.dir, packet.rcp_dir);
+            }
+        }
+        else
+        {
+            // This is a bottom level BVH leaf, intersect the active rays one by one
+            for (uint32 m = mask; m; m &= m - 1)
+            {
+                const uint32 i = __builtin_ctz(m);
+                const Ray ray(Vec3r(packet.org[0][i], packet.org[1][i], packet.org[2][i]),
+                              Vec3r(packet.dir[0][i], packet.dir[1][i], packet.dir[2][i]),
+                              packet.tmin[i], packet.tmax[i]);
+                const bool got_hit = any_hit ?
+                    visitor.intersect_any(node.get_primitives_offset(), node.get_num_primitives(), ray, &hits[i]) :
+                    visitor.intersect(node.get_primitives_offset(), node.get_num_primitives(), ray, &hits[i]);
+                if (got_hit)
+                {
+                    hit_mask |= 1u << i;
+                    instances.set_hit(&hits[i]);
+                    packet.tmax[i] = hits[i].t;
+                }
+            }
+        }
+    }
+
+    for (uint32 i = 0; i < num_rays; ++i)
+        rays[i].tmax = packet.tmax[i];
+
+    return hit_mask;
+}
+
+} } // namespace hop::bvh
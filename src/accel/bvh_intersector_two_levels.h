@@ -3,37 +3,37 @@
 #include "hop.h"
 #include "types.h"
 #include "accel/bvh_node.h"
+#include "accel/bvh_quantized_node.h"
+#include "accel/bvh_instance_stack.h"
 #include "geometry/ray.h"
 #include "geometry/hit_info.h"
 #include "math/math.h"
-#include "math/transform.h"
+#include "math/affine_transform.h"
 #include "util/log.h"
 
+#include <alloca.h>
 #include <limits>
 #include <immintrin.h>
 
 namespace hop { namespace bvh {
 
+// The traversal stack holds one node per level of the BVHs down the deepest
+// path from the scene BVH root, max_depth levels, and a BVH root.
 template <typename Visitor>
-bool intersect_two_levels(const Node* nodes, const Transformr* inv_transforms, const uint32* bvh_roots,
+bool intersect_two_levels(const Node* nodes, const AffineTransform* inv_transforms, const uint32* bvh_roots, uint32 max_depth,
                           const Ray& r, HitInfo* hit, Visitor& visitor)
 {
-    constexpr uint32 BVH_MAX_STACK_SIZE = 32;
-
     Ray ray(r);
 
-    const Vec3r orig_ray_org = ray.org;
-    const Vec3r orig_ray_dir = ray.dir;
     Vec3r inv_dir = rcp(ray.dir);
     Vec3i dir_is_neg = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
 
-    uint32 node_stack[BVH_MAX_STACK_SIZE];
+    uint32* node_stack = static_cast<uint32*>(alloca((max_depth + 1) * sizeof(uint32)));
     uint32 node_idx = 0;
     const bvh::Node* node_ptr;
     bool got_hit = false;
     int stack_index = 0;
-    uint32 instance_idx = 0;
-    int mesh_bvh_stack_start_index = -1;
+    InstanceStack<InstanceRay> instances;
 
 #ifdef BBOX_SIMD_ISECT
     // Load the ray into SSE registers.
@@ -120,54 +120,50 @@ bool intersect_two_levels(const Node* nodes, const Transformr* inv_transforms, c
         }
         else
         {
-            // This is a top level BVH leaf
+            // This is an instance leaf, of the top level BVH or of a group BVH
             if (node_ptr->get_num_primitives() == 0)
             {
-                // Push bottom level bvh root to the stack
-                instance_idx = node_ptr->get_instance_index();
-                mesh_bvh_stack_start_index = stack_index;
-                node_stack[stack_index++] = bvh_roots[instance_idx];
-
-                // TODO use sse for the transformation
-                // Transform the ray
-                const Transformr& xfm = inv_transforms[instance_idx];
-                ray.org = transform_point(xfm, ray.org);
-                ray.dir = transform_vector(xfm, ray.dir);
-                inv_dir = rcp(ray.dir);
-                dir_is_neg[0] = inv_dir.x < 0;
-                dir_is_neg[1] = inv_dir.y < 0;
-                dir_is_neg[2] = inv_dir.z < 0;
+                // Push the BVH root of the instanced shape to the stack
+                const uint32 instance_idx = node_ptr->get_instance_index();
+                if (instances.push(instance_idx, stack_index, { ray.org, ray.dir, inv_dir, dir_is_neg }))
+                {
+                    node_stack[stack_index++] = bvh_roots[instance_idx];
+
+                    // Transform the ray to the instance space
+                    transform_ray(inv_transforms[instance_idx], &ray.org, &ray.dir, &inv_dir);
+                    dir_is_neg[0] = inv_dir.x < 0;
+                    dir_is_neg[1] = inv_dir.y < 0;
+                    dir_is_neg[2] = inv_dir.z < 0;
 
 #ifdef BBOX_SIMD_ISECT
-                // Load the ray into SSE registers.
-                org_x = _mm_set1_pd(ray.org.x);
-                org_y = _mm_set1_pd(ray.org.y);
-                org_z = _mm_set1_pd(ray.org.z);
-                rcp_dir_x = _mm_set1_pd(inv_dir.x);
-                rcp_dir_y = _mm_set1_pd(inv_dir.y);
-                rcp_dir_z = _mm_set1_pd(inv_dir.z);
-                ray_tmin = _mm_set1_pd(ray.tmin);
+                    // Load the ray into SSE registers.
+                    org_x = _mm_set1_pd(ray.org.x);
+                    org_y = _mm_set1_pd(ray.org.y);
+                    org_z = _mm_set1_pd(ray.org.z);
+                    rcp_dir_x = _mm_set1_pd(inv_dir.x);
+                    rcp_dir_y = _mm_set1_pd(inv_dir.y);
+                    rcp_dir_z = _mm_set1_pd(inv_dir.z);
+                    ray_tmin = _mm_set1_pd(ray.tmin);
 #endif
+                }
             }
             // This is a bottom level BVH leaf
-            else if (visitor.intersect(*node_ptr, ray, hit))
+            else if (visitor.intersect(node_ptr->get_primitives_offset(), node_ptr->get_num_primitives(), ray, hit))
             {
                 got_hit = true;
-                hit->shape_id = instance_idx;
+                instances.set_hit(hit);
                 ray.tmax = hit->t;
             }
         }
 
-        // If we exited from a bottom bvh tree, we need to restore the ray
-        if (stack_index == mesh_bvh_stack_start_index)
+        // If we exited from instance BVHs, we need to restore the ray of the parent level
+        InstanceRay parent_ray;
+        if (instances.pop(stack_index, &parent_ray))
         {
-            ray.org = orig_ray_org;
-            ray.dir = orig_ray_dir;
-            inv_dir = rcp(ray.dir);
-            dir_is_neg[0] = inv_dir.x < 0;
-            dir_is_neg[1] = inv_dir.y < 0;
-            dir_is_neg[2] = inv_dir.z < 0;
-            mesh_bvh_stack_start_index = -1;
+            ray.org = parent_ray.org;
+            ray.dir = parent_ray.dir;
+            inv_dir = parent_ray.inv_dir;
+            dir_is_neg = parent_ray.dir_is_neg;
 
 #ifdef BBOX_SIMD_ISECT
             // Load the ray into SSE registers.
@@ -191,24 +187,19 @@ bool intersect_two_levels(const Node* nodes, const Transformr* inv_transforms, c
 }
 
 template <typename Visitor>
-bool intersect_any_two_levels(const Node* nodes, const Transformr* inv_transforms, const uint32* bvh_roots,
+bool intersect_any_two_levels(const Node* nodes, const AffineTransform* inv_transforms, const uint32* bvh_roots, uint32 max_depth,
                               const Ray& r, HitInfo* hit, Visitor& visitor)
 {
-    constexpr uint32 BVH_MAX_STACK_SIZE = 32;
-
     Ray ray(r);
 
-    const Vec3r orig_ray_org = ray.org;
-    const Vec3r orig_ray_dir = ray.dir;
     Vec3r inv_dir = rcp(ray.dir);
     Vec3i dir_is_neg = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
 
-    uint32 node_stack[BVH_MAX_STACK_SIZE];
+    uint32* node_stack = static_cast<uint32*>(alloca((max_depth + 1) * sizeof(uint32)));
     uint32 node_idx = 0;
     const bvh::Node* node_ptr;
     int stack_index = 0;
-    uint32 instance_idx = 0;
-    int mesh_bvh_stack_start_index = -1;
+    InstanceStack<InstanceRay> instances;
 
 #ifdef BBOX_SIMD_ISECT
     // Load the ray into SSE registers.
@@ -295,54 +286,50 @@ bool intersect_any_two_levels(const Node* nodes, const Transformr* inv_transform
         }
         else
         {
-            // This is a top level BVH leaf
+            // This is an instance leaf, of the top level BVH or of a group BVH
             if (node_ptr->get_num_primitives() == 0)
             {
-                // Push bottom level bvh root to the stack
-                instance_idx = node_ptr->get_instance_index();
-                mesh_bvh_stack_start_index = stack_index;
-                node_stack[stack_index++] = bvh_roots[instance_idx];
-
-                // TODO use sse for the transformation
-                // Transform the ray
-                const Transformr& xfm = inv_transforms[instance_idx];
-                ray.org = transform_point(xfm, ray.org);
-                ray.dir = transform_vector(xfm, ray.dir);
-                inv_dir = rcp(ray.dir);
-                dir_is_neg[0] = inv_dir.x < 0;
-                dir_is_neg[1] = inv_dir.y < 0;
-                dir_is_neg[2] = inv_dir.z < 0;
+                // Push the BVH root of the instanced shape to the stack
+                const uint32 instance_idx = node_ptr->get_instance_index();
+                if (instances.push(instance_idx, stack_index, { ray.org, ray.dir, inv_dir, dir_is_neg }))
+                {
+                    node_stack[stack_index++] = bvh_roots[instance_idx];
+
+                    // Transform the ray to the instance space
+                    transform_ray(inv_transforms[instance_idx], &ray.org, &ray.dir, &inv_dir);
+                    dir_is_neg[0] = inv_dir.x < 0;
+                    dir_is_neg[1] = inv_dir.y < 0;
+                    dir_is_neg[2] = inv_dir.z < 0;
 
 #ifdef BBOX_SIMD_ISECT
-                // Load the ray into SSE registers.
-                org_x = _mm_set1_pd(ray.org.x);
-                org_y = _mm_set1_pd(ray.org.y);
-                org_z = _mm_set1_pd(ray.org.z);
-                rcp_dir_x = _mm_set1_pd(inv_dir.x);
-                rcp_dir_y = _mm_set1_pd(inv_dir.y);
-                rcp_dir_z = _mm_set1_pd(inv_dir.z);
-                ray_tmin = _mm_set1_pd(ray.tmin);
+                    // Load the ray into SSE registers.
+                    org_x = _mm_set1_pd(ray.org.x);
+                    org_y = _mm_set1_pd(ray.org.y);
+                    org_z = _mm_set1_pd(ray.org.z);
+                    rcp_dir_x = _mm_set1_pd(inv_dir.x);
+                    rcp_dir_y = _mm_set1_pd(inv_dir.y);
+                    rcp_dir_z = _mm_set1_pd(inv_dir.z);
+                    ray_tmin = _mm_set1_pd(ray.tmin);
 #endif
+                }
             }
             // This is a bottom level BVH leaf
-            else if (visitor.intersect_any(*node_ptr, ray, hit))
+            else if (visitor.intersect_any(node_ptr->get_primitives_offset(), node_ptr->get_num_primitives(), ray, hit))
             {
-                hit->shape_id = instance_idx;
+                instances.set_hit(hit);
                 ray.tmax = hit->t;
                 return true;
             }
         }
 
-        // If we exited from a bottom bvh tree, we need to restore the ray
-        if (stack_index == mesh_bvh_stack_start_index)
+        // If we exited from instance BVHs, we need to restore the ray of the parent level
+        InstanceRay parent_ray;
+        if (instances.pop(stack_index, &parent_ray))
         {
-            ray.org = orig_ray_org;
-            ray.dir = orig_ray_dir;
-            inv_dir = rcp(ray.dir);
-            dir_is_neg[0] = inv_dir.x < 0;
-            dir_is_neg[1] = inv_dir.y < 0;
-            dir_is_neg[2] = inv_dir.z < 0;
-            mesh_bvh_stack_start_index = -1;
+            ray.org = parent_ray.org;
+            ray.dir = parent_ray.dir;
+            inv_dir = parent_ray.inv_dir;
+            dir_is_neg = parent_ray.dir_is_neg;
 
 #ifdef BBOX_SIMD_ISECT
             // Load the ray into SSE registers.
@@ -365,4 +352,167 @@ bool intersect_any_two_levels(const Node* nodes, const Transformr* inv_transform
     return false;
 }
 
+// Traversal of quantized BVHs. The child bounds are decoded from the bounds
+// of the node, which are kept on the stack along with the node index.
+// scene_bbox is the bbox of the top level root and root_bboxes holds the
+// bbox of the BVH root of the shape of each instance. The stack is sized as
+// for intersect_two_levels.
+template <bool any_hit, typename Q, typename Visitor>
+bool intersect_quantized_two_levels(const QuantizedNode<Q>* nodes, const BBoxr& scene_bbox, const BBoxr* root_bboxes,
+                                    const AffineTransform* inv_transforms, const uint32* bvh_roots, uint32 max_depth,
+                                    const Ray& r, HitInfo* hit, Visitor& visitor)
+{
+    struct StackEntry
+    {
+        uint32 node;
+        BBoxr bbox;
+    };
+
+    Ray ray(r);
+
+    Vec3r inv_dir = rcp(ray.dir);
+    Vec3i dir_is_neg = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
+
+    StackEntry* node_stack = static_cast<StackEntry*>(alloca((max_depth + 1) * sizeof(StackEntry)));
+    uint32 node_idx = 0;
+    BBoxr node_bbox = scene_bbox;
+    const QuantizedNode<Q>* node_ptr;
+    bool got_hit = false;
+    int stack_index = 0;
+    InstanceStack<InstanceRay> instances;
+
+    while (stack_index > -1)
+    {
+        node_ptr = &nodes[node_idx];
+
+        if (likely(node_ptr->is_interior()))
+        {
+            BBoxr left_bbox, right_bbox;
+#ifndef REAL_IS_DOUBLE
+            // Decode and test both children along each axis in one pass,
+            // the lanes hold [left min, right min, left max, right max]
+            __m128 near, far;
+            float decoded[3][4];
+            for (uint32 axis = 0; axis < 3; ++axis)
+            {
+                const __m128 bounds = node_ptr->decode_bounds(axis, node_bbox.pmin[axis]);
+                _mm_storeu_ps(decoded[axis], bounds);
+                const __m128 t = _mm_mul_ps(_mm_sub_ps(bounds, _mm_set1_ps(ray.org[axis])), _mm_set1_ps(inv_dir[axis]));
+                const __m128 t_swapped = _mm_shuffle_ps(t, t, _MM_SHUFFLE(1, 0, 3, 2));
+                const __m128 t_near = _mm_min_ps(t_swapped, t);
+                const __m128 t_far = _mm_max_ps(t_swapped, t);
+                near = axis == 0 ? t_near : _mm_max_ps(t_near, near);
+                far = axis == 0 ? t_far : _mm_min_ps(t_far, far);
+            }
+
+            const int misses = _mm_movemask_ps(
+                _mm_or_ps(_mm_cmplt_ps(far, _mm_set1_ps(ray.tmin)),
+                          _mm_or_ps(_mm_cmpgt_ps(near, far), _mm_cmpge_ps(near, _mm_set1_ps(ray.tmax)))));
+
+            const bool hit_left = (misses & 1) == 0;
+            const bool hit_right = (misses & 2) == 0;
+
+            for (uint32 axis = 0; axis < 3; ++axis)
+            {
+                left_bbox.pmin[axis] = decoded[axis][0];
+                right_bbox.pmin[axis] = decoded[axis][1];
+                left_bbox.pmax[axis] = decoded[axis][2];
+                right_bbox.pmax[axis] = decoded[axis][3];
+            }
+#else
+            node_ptr->get_child_bboxes(node_bbox, &left_bbox, &right_bbox);
+
+            Vec3r tminl = (left_bbox.pmin - ray.org) * inv_dir;
+            Vec3r tminr = (right_bbox.pmin - ray.org) * inv_dir;
+            Vec3r tmaxl = (left_bbox.pmax - ray.org) * inv_dir;
+            Vec3r tmaxr = (right_bbox.pmax - ray.org) * inv_dir;
+            Vec3r rminl = min(tminl, tmaxl);
+            Vec3r rminr = min(tminr, tmaxr);
+            Vec3r rmaxl = max(tminl, tmaxl);
+            Vec3r rmaxr = max(tminr, tmaxr);
+
+            Real farl = min(rmaxl);
+            Real farr = min(rmaxr);
+            Real nearl = max(rminl);
+            Real nearr = max(rminr);
+
+            const bool hit_left = !(farl < ray.tmin || nearl > farl || nearl >= ray.tmax);
+            const bool hit_right = !(farr < ray.tmin || nearr > farr || nearr >= ray.tmax);
+#endif
+
+            if (hit_left && hit_right)
+            {
+                if (dir_is_neg[node_ptr->get_split_axis()])
+                {
+                    node_stack[stack_index++] = { node_idx + 1, left_bbox };
+                    node_idx = node_ptr->get_right_child();
+                    node_bbox = right_bbox;
+                }
+                else
+                {
+                    node_stack[stack_index++] = { node_ptr->get_right_child(), right_bbox };
+                    node_idx = node_idx + 1;
+                    node_bbox = left_bbox;
+                }
+                continue;
+            }
+            else if (hit_left || hit_right)
+            {
+                node_idx = hit_left ? node_idx + 1 : node_ptr->get_right_child();
+                node_bbox = hit_left ? left_bbox : right_bbox;
+                continue;
+            }
+        }
+        else
+        {
+            // This is an instance leaf, of the top level BVH or of a group BVH
+            if (node_ptr->get_num_primitives() == 0)
+            {
+                // Push the BVH root of the instanced shape to the stack
+                const uint32 instance_idx = node_ptr->get_instance_index();
+                if (instances.push(instance_idx, stack_index, { ray.org, ray.dir, inv_dir, dir_is_neg }))
+                {
+                    node_stack[stack_index++] = { bvh_roots[instance_idx], root_bboxes[instance_idx] };
+
+                    // Transform the ray to the instance space
+                    transform_ray(inv_transforms[instance_idx], &ray.org, &ray.dir, &inv_dir);
+                    dir_is_neg[0] = inv_dir.x < 0;
+                    dir_is_neg[1] = inv_dir.y < 0;
+                    dir_is_neg[2] = inv_dir.z < 0;
+                }
+            }
+            // This is a bottom level BVH leaf
+            else if (any_hit ? visitor.intersect_any(node_ptr->get_primitives_offset(), node_ptr->get_num_primitives(), ray, hit)
+                             : visitor.intersect(node_ptr->get_primitives_offset(), node_ptr->get_num_primitives(), ray, hit))
+            {
+                got_hit = true;
+                instances.set_hit(hit);
+                ray.tmax = hit->t;
+                if (any_hit)
+                    return true;
+            }
+        }
+
+        // If we exited from instance BVHs, we need to restore the ray of the parent level
+        InstanceRay parent_ray;
+        if (instances.pop(stack_index, &parent_ray))
+        {
+            ray.org = parent_ray.org;
+            ray.dir = parent_ray.dir;
+            inv_dir = parent_ray.inv_dir;
+            dir_is_neg = parent_ray.dir_is_neg;
+        }
+
+        // Pop the next node off the stack
+        if (--stack_index >= 0)
+        {
+            node_idx = node_stack[stack_index].node;
+            node_bbox = node_stack[stack_index].bbox;
+        }
+    }
+    r.tmax = ray.tmax;
+
+    return got_hit;
+}
+
 } } // namespace hop::bvh
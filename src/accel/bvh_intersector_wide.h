@@ -0,0 +1,209 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "accel/bvh_wide_node.h"
+#include "accel/bvh_instance_stack.h"
+#include "geometry/ray.h"
+#include "geometry/hit_info.h"
+#include "math/math.h"
+#include "math/affine_transform.h"
+
+#include <alloca.h>
+
+namespace hop { namespace bvh {
+
+// Traversal stack entry, the entry distance is kept so that subtrees
+// further than the closest hit found so far can be skipped
+struct WideStackEntry
+{
+    uint32 child;
+    uint16 num_primitives;
+    uint8 type;
+    float dist;
+};
+
+// Push the children hit by the ray on the stack, the farthest first
+// so that the nearest child is popped next
+template <uint32 N>
+inline void push_children(const WideNode<N>& node, uint32 hit_mask, const float* dist,
+                          WideStackEntry* stack, int& stack_index)
+{
+    WideStackEntry entries[N];
+    uint32 num_entries = 0;
+
+    while (hit_mask)
+    {
+        const uint32 i = __builtin_ctz(hit_mask);
+        hit_mask &= hit_mask - 1;
+
+        if (node.type[i] == WideNode<N>::EMPTY)
+            continue;
+
+        // Insertion sort by decreasing distance
+        WideStackEntry entry = { node.child[i], node.num_primitives[i], node.type[i], dist[i] };
+        uint32 j = num_entries++;
+        for (; j > 0 && entries[j - 1].dist < entry.dist; --j)
+            entries[j] = entries[j - 1];
+        entries[j] = entry;
+    }
+
+    for (uint32 i = 0; i < num_entries; ++i)
+        stack[stack_index++] = entries[i];
+}
+
+// Ray of a wide traversal, saved with its splatted registers when it enters
+// an instance so leaving the instance is only a copy
+template <uint32 N>
+struct WideInstanceRay
+{
+    Vec3r org;
+    Vec3r dir;
+    WideRay<N> wide;
+};
+
+// Number of stack entries of the wide traversals. Each level down the
+// deepest path, max_depth levels, leaves at most N - 1 siblings on the stack.
+template <uint32 N>
+inline uint32 get_wide_stack_size(uint32 max_depth)
+{
+    return (N - 1) * max_depth + 1;
+}
+
+template <uint32 N, typename Visitor>
+bool intersect_wide_two_levels(const WideNode<N>* nodes, const AffineTransform* inv_transforms, const uint32* bvh_roots,
+                               uint32 max_depth, const Ray& r, HitInfo* hit, Visitor& visitor)
+{
+    Ray ray(r);
+
+    WideRay<N> wide_ray;
+    wide_ray.set(ray.org, rcp(ray.dir), ray.tmin);
+
+    WideStackEntry* node_stack = static_cast<WideStackEntry*>(alloca(get_wide_stack_size<N>(max_depth) * sizeof(WideStackEntry)));
+    int stack_index = 0;
+    node_stack[stack_index++] = { 0, 0, WideNode<N>::INTERIOR, (float)neg_inf };
+
+    bool got_hit = false;
+    InstanceStack<WideInstanceRay<N>> instances;
+
+    ALIGN(32) float dist[N];
+
+    while (stack_index > 0)
+    {
+        // If we exited from instance BVHs, we need to restore the ray of the parent level
+        WideInstanceRay<N> parent_ray;
+        if (instances.pop(stack_index, &parent_ray))
+        {
+            ray.org = parent_ray.org;
+            ray.dir = parent_ray.dir;
+            wide_ray = parent_ray.wide;
+        }
+
+        // Pop the next node off the stack, skip it if it is behind the closest hit
+        const WideStackEntry entry = node_stack[--stack_index];
+        if (entry.dist > ray.tmax)
+            continue;
+
+        if (likely(entry.type == WideNode<N>::INTERIOR))
+        {
+            const WideNode<N>& node = nodes[entry.child];
+            const uint32 hit_mask = intersect_children(node, wide_ray, ray.tmax, dist);
+            push_children(node, hit_mask, dist, node_stack, stack_index);
+        }
+        else if (entry.type == WideNode<N>::LEAF)
+        {
+            // This is a bottom level BVH leaf
+            if (visitor.intersect(entry.child, entry.num_primitives, ray, hit))
+            {
+                got_hit = true;
+                instances.set_hit(hit);
+                ray.tmax = hit->t;
+            }
+        }
+        else
+        {
+            // This is an instance leaf, of the top level BVH or of a group BVH.
+            // Push the BVH root of the instanced shape to the stack
+            const uint32 instance_idx = entry.child;
+            if (instances.push(instance_idx, stack_index, { ray.org, ray.dir, wide_ray }))
+            {
+                node_stack[stack_index++] = { bvh_roots[instance_idx], 0, WideNode<N>::INTERIOR, entry.dist };
+
+                // Transform the ray to the instance space
+                Vec3r inv_dir;
+                transform_ray(inv_transforms[instance_idx], &ray.org, &ray.dir, &inv_dir);
+                wide_ray.set(ray.org, inv_dir, ray.tmin);
+            }
+        }
+    }
+    r.tmax = ray.tmax;
+
+    return got_hit;
+}
+
+template <uint32 N, typename Visitor>
+bool intersect_any_wide_two_levels(const WideNode<N>* nodes, const AffineTransform* inv_transforms, const uint32* bvh_roots,
+                                   uint32 max_depth, const Ray& r, HitInfo* hit, Visitor& visitor)
+{
+    Ray ray(r);
+
+    WideRay<N> wide_ray;
+    wide_ray.set(ray.org, rcp(ray.dir), ray.tmin);
+
+    WideStackEntry* node_stack = static_cast<WideStackEntry*>(alloca(get_wide_stack_size<N>(max_depth) * sizeof(WideStackEntry)));
+    int stack_index = 0;
+    node_stack[stack_index++] = { 0, 0, WideNode<N>::INTERIOR, (float)neg_inf };
+
+    InstanceStack<WideInstanceRay<N>> instances;
+
+    ALIGN(32) float dist[N];
+
+    while (stack_index > 0)
+    {
+        // If we exited from instance BVHs, we need to restore the ray of the parent level
+        WideInstanceRay<N> parent_ray;
+        if (instances.pop(stack_index, &parent_ray))
+        {
+            ray.org = parent_ray.org;
+            ray.dir = parent_ray.dir;
+            wide_ray = parent_ray.wide;
+        }
+
+        const WideStackEntry entry = node_stack[--stack_index];
+
+        if (likely(entry.type == WideNode<N>::INTERIOR))
+        {
+            const WideNode<N>& node = nodes[entry.child];
+            const uint32 hit_mask = intersect_children(node, wide_ray, ray.tmax, dist);
+            push_children(node, hit_mask, dist, node_stack, stack_index);
+        }
+        else if (entry.type == WideNode<N>::LEAF)
+        {
+            // This is a bottom level BVH leaf
+            if (visitor.intersect_any(entry.child, entry.num_primitives, ray, hit))
+            {
+                instances.set_hit(hit);
+                return true;
+            }
+        }
+        else
+        {
+            // This is an instance leaf, of the top level BVH or of a group BVH.
+            // Push the BVH root of the instanced shape to the stack
+            const uint32 instance_idx = entry.child;
+            if (instances.push(instance_idx, stack_index, { ray.org, ray.dir, wide_ray }))
+            {
+                node_stack[stack_index++] = { bvh_roots[instance_idx], 0, WideNode<N>::INTERIOR, entry.dist };
+
+                // Transform the ray to the instance space
+                Vec3r inv_dir;
+                transform_ray(inv_transforms[instance_idx], &ray.org, &ray.dir, &inv_dir);
+                wide_ray.set(ray.org, inv_dir, ray.tmin);
+            }
+        }
+    }
+
+    return false;
+}
+
+} } // namespace hop::bvh
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "math/math.h"
+#include "math/vec3.h"
+#include "math/bbox.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <immintrin.h>
+
+namespace hop { namespace bvh {
+
+// Binary BVH node with the child bounds quantized to Q (uint8 or uint16).
+// The bounds are steps of 2^exponent[axis] from the min corner of the
+// node's own bounds. The node doesn't store its bounds, the traversal
+// decodes them from the parent node and the roots take the bounds of their
+// tree. The child bounds are rounded outwards, a decoded box always holds
+// the exact one.
+// Leaves don't have child bounds, they keep their number of primitives in
+// their place. The nodes are 20 bytes with uint8 and 32 bytes with uint16.
+template <typename Q>
+class alignas(sizeof(Q) == 1 ? 4 : 32) QuantizedNode
+{
+public:
+    static constexpr uint32 MAX_STEPS = std::numeric_limits<Q>::max();
+
+    union
+    {
+        Q bounds[4 * 3];        // same layout as Node::bbox_data, for interior nodes
+        uint32 num_primitives;  // bottom-level leaves
+    };
+    uint32 offset;              // right child, first primitive or instance index
+    int8 exponent[3];
+    uint8 flags;                // split axis in bits 0-1, leaf in bit 2
+
+    QuantizedNode() : num_primitives(0), offset(0), exponent{0, 0, 0}, flags(0) { }
+
+    bool is_interior() const { return (flags & 4) == 0; }
+    bool is_leaf() const { return (flags & 4) != 0; }
+    uint8 get_split_axis() const { return flags & 3; }
+
+    uint32 get_right_child() const { return offset; }
+    uint32 get_instance_index() const { return offset; }
+    uint32 get_primitives_offset() const { return offset; }
+    uint32 get_num_primitives() const { return is_leaf() ? num_primitives : 0; }
+
+    void set_leaf(uint32 prim_offset, uint32 num);
+    void set_instance(uint32 instance_index);
+
+    // Quantize the child bounds in the bounds of this node. Returns the
+    // decoded child bounds, the children are quantized in them in turn.
+    void set_interior(uint32 right_child, uint8 split_axis, const BBoxr& bbox,
+                      const BBoxr& left_bbox, const BBoxr& right_bbox,
+                      BBoxr* left_frame, BBoxr* right_frame);
+
+    // Decode the child bounds given the bounds of this node
+    void get_child_bboxes(const BBoxr& bbox, BBoxr* left_bbox, BBoxr* right_bbox) const;
+
+#ifndef REAL_IS_DOUBLE
+    // Decode the child bounds along an axis given the min bound of this
+    // node, returns [left min, right min, left max, right max]
+    __m128 decode_bounds(uint32 axis, float base) const;
+#endif
+};
+
+// 2^e for e in [-126, 127], built from the exponent bits
+inline Real exp2_int(int32 e)
+{
+    const uint32 bits = (uint32)(e + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(float));
+    return (Real)f;
+}
+
+template <typename Q>
+inline void QuantizedNode<Q>::set_leaf(uint32 prim_offset, uint32 num)
+{
+    offset = prim_offset;
+    num_primitives = num;
+    flags = 4;
+}
+
+template <typename Q>
+inline void QuantizedNode<Q>::set_instance(uint32 instance_index)
+{
+    offset = instance_index;
+    num_primitives = 0;
+    flags = 4;
+}
+
+template <typename Q>
+inline void QuantizedNode<Q>::set_interior(uint32 right_child, uint8 split_axis, const BBoxr& bbox,
+                                           const BBoxr& left_bbox, const BBoxr& right_bbox,
+                                           BBoxr* left_frame, BBoxr* right_frame)
+{
+    offset = right_child;
+    flags = split_axis & 3;
+
+    for (uint32 axis = 0; axis < 3; ++axis)
+    {
+        // Smallest power of two step that covers the extent in MAX_STEPS steps.
+        // Decoding multiplies by a power of two, which is exact.
+        const double extent = (double)bbox.pmax[axis] - (double)bbox.pmin[axis];
+        int32 e = -126;
+        if (extent > 0.0)
+        {
+            int32 k;
+            const double m = std::frexp(extent / MAX_STEPS, &k);
+            e = clamp(m == 0.5 ? k - 1 : k, -126, 127);
+        }
+        exponent[axis] = (int8)e;
+
+        const Real base = bbox.pmin[axis];
+        const Real step = exp2_int(e);
+        auto decode = [&](int64 q) { return base + (Real)q * step; };
+
+        const Real mins[2] = { left_bbox.pmin[axis], right_bbox.pmin[axis] };
+        const Real maxs[2] = { left_bbox.pmax[axis], right_bbox.pmax[axis] };
+        for (uint32 c = 0; c < 2; ++c)
+        {
+            // Start from the estimate and fix the rounding of the decoding
+            int64 qmin = clamp((int64)std::floor((mins[c] - base) / step), (int64)0, (int64)MAX_STEPS);
+            while (qmin > 0 && decode(qmin) > mins[c])
+                --qmin;
+            while (qmin < MAX_STEPS && decode(qmin + 1) <= mins[c])
+                ++qmin;
+
+            int64 qmax = clamp((int64)std::ceil((maxs[c] - base) / step), qmin, (int64)MAX_STEPS);
+            while (qmax < MAX_STEPS && decode(qmax) < maxs[c])
+                ++qmax;
+            while (qmax > qmin && decode(qmax - 1) >= maxs[c])
+                --qmax;
+
+            bounds[axis * 4 + 0 + c] = (Q)qmin;
+            bounds[axis * 4 + 2 + c] = (Q)qmax;
+        }
+    }
+
+    get_child_bboxes(bbox, left_frame, right_frame);
+}
+
+template <typename Q>
+inline void QuantizedNode<Q>::get_child_bboxes(const BBoxr& bbox, BBoxr* left_bbox, BBoxr* right_bbox) const
+{
+    for (uint32 axis = 0; axis < 3; ++axis)
+    {
+        const Real base = bbox.pmin[axis];
+        const Real step = exp2_int(exponent[axis]);
+        left_bbox->pmin[axis] = base + (Real)bounds[axis * 4 + 0] * step;
+        right_bbox->pmin[axis] = base + (Real)bounds[axis * 4 + 1] * step;
+        left_bbox->pmax[axis] = base + (Real)bounds[axis * 4 + 2] * step;
+        right_bbox->pmax[axis] = base + (Real)bounds[axis * 4 + 3] * step;
+    }
+}
+
+#ifndef REAL_IS_DOUBLE
+inline __m128i load_bounds(const uint8* q)
+{
+    int32 bits;
+    std::memcpy(&bits, q, sizeof(int32));
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero), zero);
+}
+
+inline __m128i load_bounds(const uint16* q)
+{
+    return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)q), _mm_setzero_si128());
+}
+
+template <typename Q>
+inline __m128 QuantizedNode<Q>::decode_bounds(uint32 axis, float base) const
+{
+    const __m128 q = _mm_cvtepi32_ps(load_bounds(&bounds[axis * 4]));
+    return _mm_add_ps(_mm_set1_ps(base), _mm_mul_ps(q, _mm_set1_ps(exp2_int(exponent[axis]))));
+}
+#endif
+
+#ifdef BVH_QUANTIZED_BITS
+#if BVH_QUANTIZED_BITS == 8
+typedef uint8 QuantizedBound;
+#else
+typedef uint16 QuantizedBound;
+#endif
+#endif
+
+} } // namespace hop::bvh
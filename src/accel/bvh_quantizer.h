@@ -0,0 +1,62 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "accel/bvh_node.h"
+#include "accel/bvh_quantized_node.h"
+#include "math/bbox.h"
+
+#include <utility>
+#include <vector>
+
+namespace hop { namespace bvh {
+
+// Quantize a binary BVH, as produced by Builder, into QuantizedNodes. The
+// nodes keep their index, quantized_nodes must be as big as nodes.
+// The children of each node are quantized in the decoded bounds of the node
+// so the traversal decodes exactly the same boxes, starting from root_bbox.
+template <typename Q>
+class Quantizer
+{
+public:
+    // Quantize the binary tree rooted at root. root_bbox is the bbox of the
+    // binary root, which the binary nodes don't store.
+    static void quantize(const std::vector<Node>& nodes, uint32 root, const BBoxr& root_bbox,
+                         std::vector<QuantizedNode<Q>>* quantized_nodes);
+};
+
+template <typename Q>
+void Quantizer<Q>::quantize(const std::vector<Node>& nodes, uint32 root, const BBoxr& root_bbox,
+                            std::vector<QuantizedNode<Q>>* quantized_nodes)
+{
+    std::vector<std::pair<uint32, BBoxr>> stack;
+    stack.emplace_back(root, root_bbox);
+
+    while (!stack.empty())
+    {
+        const uint32 index = stack.back().first;
+        const BBoxr bbox = stack.back().second;
+        stack.pop_back();
+
+        const Node& node = nodes[index];
+        QuantizedNode<Q>& qnode = (*quantized_nodes)[index];
+
+        if (node.is_leaf())
+        {
+            if (node.get_num_primitives() == 0)
+                qnode.set_instance(node.get_instance_index());
+            else
+                qnode.set_leaf(node.get_primitives_offset(), node.get_num_primitives());
+            continue;
+        }
+
+        BBoxr left_frame, right_frame;
+        qnode.set_interior(node.get_right_child(), node.get_split_axis(), bbox,
+                           node.get_left_bbox(), node.get_right_bbox(), &left_frame, &right_frame);
+
+        stack.emplace_back(index + 1, left_frame);
+        stack.emplace_back(node.get_right_child(), right_frame);
+    }
+}
+
+} } // namespace hop::bvh
@@ -0,0 +1,569 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "accel/bvh_node.h"
+#include "accel/bvh_stats.h"
+#include "math/math.h"
+#include "math/vec3.h"
+#include "math/bbox.h"
+#include "util/stop_watch.h"
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cassert>
+
+namespace hop { namespace bvh {
+
+// Spatial split SAH builder (SBVH).
+// Each node evaluates the binned object splits, which partition the items by
+// centroid, and when the children of the best object split overlap, the
+// binned spatial splits, which cut the items straddling the split plane in
+// two. A cut item is referenced by both children, each with the bounds of
+// its part on that side, so large and elongated items don't make the child
+// bounds overlap. A straddling item is kept on a single side instead when
+// that is cheaper ("unsplitting").
+// The spatial splits stop once the references exceed the item count by
+// SBVH_MAX_DUPLICATION, the remaining nodes use object splits only.
+//
+// On top of get_bbox, the accessor provides the bounds of the parts of an
+// item on each side of a split plane, clipped to the bounds of a reference:
+//   void split_bbox(const Object& item, uint8 axis, Real position, const BBoxr& bbox,
+//                   BBoxr* left, BBoxr* right) const;
+// An item can end up in several leaves, the leaf callbacks are called once
+// per leaf in depth-first order, like Builder.
+template <typename Object, typename Accessor>
+class SpatialSplitBuilder
+{
+public:
+    typedef std::function<void(Node*, const std::vector<Object>&)> LeafCreationCallback;
+
+    static std::vector<Node> build(Accessor* accessor, const std::vector<Object>& items, uint32 min_leaf_size,
+                                   LeafCreationCallback callback, BuildStats* stats = nullptr);
+
+private:
+    static constexpr uint32 num_bins = NUM_SAH_SPLITS;
+    static constexpr Real min_side_length = 1e-3;
+
+    struct Reference
+    {
+        BBoxr bbox;
+        uint32 item;
+    };
+
+    struct Split
+    {
+        Real score;
+        int axis;
+        uint32 bin;
+        uint32 left_count, right_count;
+        BBoxr left_bbox, right_bbox;
+
+        Split() : score(pos_inf), axis(-1), bin(0), left_count(0), right_count(0) { }
+    };
+
+    struct Binning
+    {
+        Vec3r pmin;
+        Vec3r side;
+        Vec3r scale; // 0 when the axis is too thin to be split
+
+        void init(const BBoxr& bbox)
+        {
+            pmin = bbox.pmin;
+            side = bbox.pmax - bbox.pmin;
+            for (uint8 axis = 0; axis < 3; ++axis)
+                scale[axis] = side[axis] < min_side_length ? Real(0) : Real(num_bins) * rcp(side[axis]);
+        }
+
+        uint32 index(Real position, uint8 axis) const
+        {
+            const Real b = max(Real(0), (position - pmin[axis]) * scale[axis]);
+            return min((uint32)b, num_bins - 1);
+        }
+
+        // Position of the plane between bin b and bin b + 1
+        Real plane(uint32 b, uint8 axis) const
+        {
+            return pmin[axis] + side[axis] * (Real(b + 1) / Real(num_bins));
+        }
+    };
+
+    SpatialSplitBuilder()
+        : m_items(nullptr), m_accessor(nullptr), m_min_leaf_size(0), m_num_references(0), m_max_references(0)
+        , m_num_leaves(0), m_max_depth(0), m_min_overlap(0)
+    {
+    }
+
+    uint32 partition(std::vector<Reference>& refs, uint32 depth, BBoxr& node_bbox);
+    Split find_object_split(const std::vector<Reference>& refs, const BBoxr& centroid_bbox) const;
+    Split find_spatial_split(const std::vector<Reference>& refs, const BBoxr& node_bbox) const;
+    void split_objects(std::vector<Reference>& refs, const BBoxr& centroid_bbox, const Split& split,
+                       std::vector<Reference>* left, std::vector<Reference>* right) const;
+    void split_spatial(std::vector<Reference>& refs, const BBoxr& node_bbox, const Split& split,
+                       std::vector<Reference>* left, std::vector<Reference>* right) const;
+    uint8 split_median(std::vector<Reference>& refs, const BBoxr& centroid_bbox,
+                       std::vector<Reference>* left, std::vector<Reference>* right) const;
+    uint32 create_leaf(const std::vector<Reference>& refs);
+
+private:
+    std::vector<Node> m_nodes;
+    const std::vector<Object>* m_items;
+    std::vector<Object> m_leaf_items;
+
+    LeafCreationCallback m_callback;
+    Accessor* m_accessor;
+
+    uint32 m_min_leaf_size;
+    uint32 m_num_references;
+    uint32 m_max_references;
+    uint32 m_num_leaves;
+    uint32 m_max_depth;
+    Real m_min_overlap;
+};
+
+template <typename Object, typename Accessor>
+std::vector<Node> SpatialSplitBuilder<Object, Accessor>::build(Accessor* accessor,
+        const std::vector<Object>& items, uint32 min_leaf_size, LeafCreationCallback callback, BuildStats* stats)
+{
+    StopWatch stop_watch;
+    stop_watch.start();
+
+    SpatialSplitBuilder builder;
+    builder.m_accessor = accessor;
+    builder.m_items = &items;
+    builder.m_callback = callback;
+    builder.m_min_leaf_size = max(1u, min_leaf_size);
+
+    const uint32 num_items = items.size();
+    builder.m_num_references = num_items;
+    builder.m_max_references = num_items + (uint32)(Real(num_items) * SBVH_MAX_DUPLICATION);
+
+    std::vector<Reference> refs(num_items);
+    BBoxr root_bbox;
+    for (uint32 i = 0; i < num_items; ++i)
+    {
+        refs[i].bbox = accessor->get_bbox(items[i]);
+        refs[i].item = i;
+        root_bbox.merge(refs[i].bbox);
+    }
+    builder.m_min_overlap = SBVH_MIN_OVERLAP * root_bbox.get_half_area();
+
+    BBoxr bbox;
+    if (num_items > 0)
+        builder.partition(refs, 0, bbox);
+
+    stop_watch.stop();
+
+    if (stats)
+    {
+        stats->num_items = num_items;
+        stats->num_references = builder.m_num_references;
+        stats->num_nodes = builder.m_nodes.size();
+        stats->num_leaves = builder.m_num_leaves;
+        stats->max_depth = builder.m_max_depth;
+        stats->build_time_ms = stop_watch.get_elapsed_time_ms();
+        stats->sah_cost = compute_sah_cost(builder.m_nodes, bbox);
+    }
+
+    return std::move(builder.m_nodes);
+}
+
+// Build the subtree of a list of references, the list is released before
+// the children are built.
+template <typename Object, typename Accessor>
+uint32 SpatialSplitBuilder<Object, Accessor>::partition(std::vector<Reference>& refs, uint32 depth, BBoxr& node_bbox)
+{
+    if (depth > m_max_depth)
+        m_max_depth = depth;
+
+    node_bbox = BBoxr();
+    BBoxr centroid_bbox;
+    for (const auto& ref : refs)
+    {
+        node_bbox.merge(ref.bbox);
+        centroid_bbox.merge(ref.bbox.get_centroid());
+    }
+
+    const uint32 count = refs.size();
+    if (count <= m_min_leaf_size)
+        return create_leaf(refs);
+
+    Split object_split = find_object_split(refs, centroid_bbox);
+
+    // Deep nodes are split at the median to stay within BVH_MAX_DEPTH,
+    // spatial splits could keep cutting the same items
+    const bool median = must_split_at_median(depth, count);
+
+    // Only look for a spatial split when the object split children overlap
+    // and the reference budget is not spent
+    Split spatial_split;
+    if (!median && m_num_references < m_max_references &&
+        (object_split.axis < 0 || intersect(object_split.left_bbox, object_split.right_bbox).get_half_area() > m_min_overlap))
+    {
+        spatial_split = find_spatial_split(refs, node_bbox);
+        if (spatial_split.axis >= 0 &&
+            m_num_references + spatial_split.left_count + spatial_split.right_count - count > m_max_references)
+            spatial_split = Split();
+    }
+
+#ifdef TRIS_SIMD_ISECT
+    auto is_valid = [&](const Split& split)
+    {
+        return split.axis >= 0 && split.left_count >= m_min_leaf_size && split.right_count >= m_min_leaf_size;
+    };
+#else
+    auto is_valid = [&](const Split& split) { return split.axis >= 0; };
+#endif
+
+    // The cost of not splitting the node
+    const Real leaf_score = (Real)count * node_bbox.get_half_area();
+    const bool use_object = is_valid(object_split) && object_split.score < leaf_score;
+    const bool use_spatial = is_valid(spatial_split) && spatial_split.score < leaf_score &&
+                             (!use_object || spatial_split.score < object_split.score);
+
+    std::vector<Reference> left, right;
+    uint8 axis = 0;
+    if (use_spatial)
+    {
+        split_spatial(refs, node_bbox, spatial_split, &left, &right);
+        axis = spatial_split.axis;
+
+        // The parts of the straddling items can all end up on one side
+        if (left.empty() || right.empty())
+        {
+            left.clear();
+            right.clear();
+        }
+    }
+    if (left.empty())
+    {
+        if (!use_object)
+            return create_leaf(refs);
+        if (median)
+        {
+            axis = split_median(refs, centroid_bbox, &left, &right);
+        }
+        else
+        {
+            split_objects(refs, centroid_bbox, object_split, &left, &right);
+            axis = object_split.axis;
+        }
+    }
+
+    m_num_references += left.size() + right.size() - count;
+    std::vector<Reference>().swap(refs);
+
+    // Add node to list
+    const uint32 node_index = m_nodes.size();
+    m_nodes.push_back(Node());
+
+    // Partition children and update node indices
+    BBoxr left_bbox, right_bbox;
+    uint32 left_node_index = partition(left, depth + 1, left_bbox);
+    uint32 right_node_index = partition(right, depth + 1, right_bbox);
+
+    assert(left_node_index == node_index + 1);
+    (void)left_node_index;
+
+    Node& node = m_nodes[node_index];
+    node.set_right_child(right_node_index);
+    node.set_left_bbox(left_bbox);
+    node.set_right_bbox(right_bbox);
+    node.set_split_axis(axis);
+
+    return node_index;
+}
+
+// Binned SAH over the reference centroids, same as BinnedBuilder
+template <typename Object, typename Accessor>
+typename SpatialSplitBuilder<Object, Accessor>::Split SpatialSplitBuilder<Object, Accessor>::find_object_split(
+        const std::vector<Reference>& refs, const BBoxr& centroid_bbox) const
+{
+    Binning binning;
+    binning.init(centroid_bbox);
+
+    BBoxr bins[3][num_bins];
+    uint32 counts[3][num_bins] = {};
+    for (const auto& ref : refs)
+    {
+        const Vec3r centroid = ref.bbox.get_centroid();
+        for (uint8 axis = 0; axis < 3; ++axis)
+        {
+            const uint32 b = binning.index(centroid[axis], axis);
+            bins[axis][b].merge(ref.bbox);
+            ++counts[axis][b];
+        }
+    }
+
+    Split best;
+    const uint32 count = refs.size();
+    for (uint8 axis = 0; axis < 3; ++axis)
+    {
+        if (binning.scale[axis] == Real(0))
+            continue;
+
+        // Sweep from the right to get the right side of each split plane
+        BBoxr right_bboxes[num_bins];
+        uint32 right_counts[num_bins];
+        BBoxr right_bbox;
+        uint32 right_count = 0;
+        for (uint32 b = num_bins - 1; b > 0; --b)
+        {
+            right_bbox.merge(bins[axis][b]);
+            right_count += counts[axis][b];
+            right_bboxes[b - 1] = right_bbox;
+            right_counts[b - 1] = right_count;
+        }
+
+        // Sweep from the left and evaluate the split after each bin
+        BBoxr left_bbox;
+        uint32 left_count = 0;
+        for (uint32 b = 0; b < num_bins - 1; ++b)
+        {
+            left_bbox.merge(bins[axis][b]);
+            left_count += counts[axis][b];
+
+            if (left_count == 0 || left_count == count)
+                continue;
+
+            const Real score = BVH_TRAV_COST * ((Real)left_count * left_bbox.get_half_area() +
+                                                (Real)right_counts[b] * right_bboxes[b].get_half_area());
+            if (score < best.score)
+            {
+                best.score = score;
+                best.axis = axis;
+                best.bin = b;
+                best.left_count = left_count;
+                best.right_count = right_counts[b];
+                best.left_bbox = left_bbox;
+                best.right_bbox = right_bboxes[b];
+            }
+        }
+    }
+
+    return best;
+}
+
+// Binned SAH over the node bounds. Each reference is cut at the planes
+// between its first and its last bin, the parts are added to the bins they
+// fall in. A reference enters the split planes in its first bin and leaves
+// them in its last one.
+template <typename Object, typename Accessor>
+typename SpatialSplitBuilder<Object, Accessor>::Split SpatialSplitBuilder<Object, Accessor>::find_spatial_split(
+        const std::vector<Reference>& refs, const BBoxr& node_bbox) const
+{
+    Binning binning;
+    binning.init(node_bbox);
+
+    Split best;
+    for (uint8 axis = 0; axis < 3; ++axis)
+    {
+        if (binning.scale[axis] == Real(0))
+            continue;
+
+        BBoxr bins[num_bins];
+        uint32 entries[num_bins] = {};
+        uint32 exits[num_bins] = {};
+
+        for (const auto& ref : refs)
+        {
+            const uint32 first = binning.index(ref.bbox.pmin[axis], axis);
+            const uint32 last = binning.index(ref.bbox.pmax[axis], axis);
+
+            BBoxr rest = ref.bbox;
+            for (uint32 b = first; b < last; ++b)
+            {
+                BBoxr left, right;
+                m_accessor->split_bbox((*m_items)[ref.item], axis, binning.plane(b, axis), rest, &left, &right);
+                bins[b].merge(left);
+                rest = right;
+            }
+            bins[last].merge(rest);
+
+            ++entries[first];
+            ++exits[last];
+        }
+
+        BBoxr right_bboxes[num_bins];
+        uint32 right_counts[num_bins];
+        BBoxr right_bbox;
+        uint32 right_count = 0;
+        for (uint32 b = num_bins - 1; b > 0; --b)
+        {
+            right_bbox.merge(bins[b]);
+            right_count += exits[b];
+            right_bboxes[b - 1] = right_bbox;
+            right_counts[b - 1] = right_count;
+        }
+
+        BBoxr left_bbox;
+        uint32 left_count = 0;
+        for (uint32 b = 0; b < num_bins - 1; ++b)
+        {
+            left_bbox.merge(bins[b]);
+            left_count += entries[b];
+
+            if (left_count == 0 || right_counts[b] == 0)
+                continue;
+
+            const Real score = BVH_TRAV_COST * ((Real)left_count * left_bbox.get_half_area() +
+                                                (Real)right_counts[b] * right_bboxes[b].get_half_area());
+            if (score < best.score)
+            {
+                best.score = score;
+                best.axis = axis;
+                best.bin = b;
+                best.left_count = left_count;
+                best.right_count = right_counts[b];
+                best.left_bbox = left_bbox;
+                best.right_bbox = right_bboxes[b];
+            }
+        }
+    }
+
+    return best;
+}
+
+template <typename Object, typename Accessor>
+void SpatialSplitBuilder<Object, Accessor>::split_objects(std::vector<Reference>& refs, const BBoxr& centroid_bbox,
+        const Split& split, std::vector<Reference>* left, std::vector<Reference>* right) const
+{
+    Binning binning;
+    binning.init(centroid_bbox);
+
+    const uint8 axis = split.axis;
+    left->reserve(split.left_count);
+    right->reserve(split.right_count);
+    for (const auto& ref : refs)
+    {
+        if (binning.index(ref.bbox.get_centroid()[axis], axis) <= split.bin)
+            left->push_back(ref);
+        else
+            right->push_back(ref);
+    }
+}
+
+// Split the references in two halves along the largest axis of their centroids
+template <typename Object, typename Accessor>
+uint8 SpatialSplitBuilder<Object, Accessor>::split_median(std::vector<Reference>& refs, const BBoxr& centroid_bbox,
+        std::vector<Reference>* left, std::vector<Reference>* right) const
+{
+    const Vec3r side = centroid_bbox.pmax - centroid_bbox.pmin;
+    const uint8 axis = side.x > side.y ? (side.x > side.z ? 0 : 2) : (side.y > side.z ? 1 : 2);
+
+    const auto mid = refs.begin() + refs.size() / 2;
+    std::nth_element(refs.begin(), mid, refs.end(), [axis](const Reference& a, const Reference& b)
+    {
+        return a.bbox.get_centroid()[axis] < b.bbox.get_centroid()[axis];
+    });
+    left->assign(refs.begin(), mid);
+    right->assign(mid, refs.end());
+    return axis;
+}
+
+template <typename Object, typename Accessor>
+void SpatialSplitBuilder<Object, Accessor>::split_spatial(std::vector<Reference>& refs, const BBoxr& node_bbox,
+        const Split& split, std::vector<Reference>* left, std::vector<Reference>* right) const
+{
+    Binning binning;
+    binning.init(node_bbox);
+
+    const uint8 axis = split.axis;
+    const Real position = binning.plane(split.bin, axis);
+
+    BBoxr left_bbox = split.left_bbox;
+    BBoxr right_bbox = split.right_bbox;
+    uint32 left_count = split.left_count;
+    uint32 right_count = split.right_count;
+
+    left->reserve(left_count);
+    right->reserve(right_count);
+    for (const auto& ref : refs)
+    {
+        const uint32 first = binning.index(ref.bbox.pmin[axis], axis);
+        const uint32 last = binning.index(ref.bbox.pmax[axis], axis);
+
+        if (last <= split.bin)
+        {
+            left->push_back(ref);
+            continue;
+        }
+        if (first > split.bin)
+        {
+            right->push_back(ref);
+            continue;
+        }
+
+        Reference left_ref = ref, right_ref = ref;
+        m_accessor->split_bbox((*m_items)[ref.item], axis, position, ref.bbox, &left_ref.bbox, &right_ref.bbox);
+
+        // The item only touches the plane
+        if (left_ref.bbox.empty())
+        {
+            right->push_back(right_ref);
+            --left_count;
+            continue;
+        }
+        if (right_ref.bbox.empty())
+        {
+            left->push_back(left_ref);
+            --right_count;
+            continue;
+        }
+
+        // Compare the cost of the split with the cost of keeping the whole
+        // reference on either side
+        const BBoxr unsplit_left = merge(left_bbox, ref.bbox);
+        const BBoxr unsplit_right = merge(right_bbox, ref.bbox);
+        const Real split_cost = left_bbox.get_half_area() * (Real)left_count +
+                                right_bbox.get_half_area() * (Real)right_count;
+        const Real left_cost = unsplit_left.get_half_area() * (Real)left_count +
+                               right_bbox.get_half_area() * (Real)(right_count - 1);
+        const Real right_cost = left_bbox.get_half_area() * (Real)(left_count - 1) +
+                                unsplit_right.get_half_area() * (Real)right_count;
+
+        if (left_cost < split_cost && left_cost <= right_cost)
+        {
+            left->push_back(ref);
+            left_bbox = unsplit_left;
+            --right_count;
+        }
+        else if (right_cost < split_cost)
+        {
+            right->push_back(ref);
+            right_bbox = unsplit_right;
+            --left_count;
+        }
+        else
+        {
+            left->push_back(left_ref);
+            right->push_back(right_ref);
+        }
+    }
+}
+
+template <typename Object, typename Accessor>
+uint32 SpatialSplitBuilder<Object, Accessor>::create_leaf(const std::vector<Reference>& refs)
+{
+    m_leaf_items.clear();
+    for (const auto& ref : refs)
+        m_leaf_items.push_back((*m_items)[ref.item]);
+
+    const uint32 node_index = m_nodes.size();
+    m_nodes.push_back(Node());
+
+    Node* node = &m_nodes[node_index];
+    m_callback(node, m_leaf_items);
+
+    // Make sure this is a leaf if the callback ignored it
+    if (node->get_type() == 0)
+        node->set_type(1);
+
+    ++m_num_leaves;
+
+    return node_index;
+}
+
+} } // namespace hop::bvh
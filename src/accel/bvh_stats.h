@@ -0,0 +1,95 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "accel/bvh_node.h"
+#include "math/math.h"
+#include "math/bbox.h"
+
+#include <vector>
+#include <ostream>
+
+namespace hop { namespace bvh {
+
+// Statistics gathered by the BVH builders, used to compare the build
+// strategies with each other
+struct BuildStats
+{
+    uint32 num_items;
+    uint32 num_references; // items referenced by the leaves, more than num_items with spatial splits
+    uint32 num_nodes;
+    uint32 num_leaves;
+    uint32 max_depth;
+    double build_time_ms;
+    Real sah_cost;
+
+    BuildStats()
+        : num_items(0), num_references(0), num_nodes(0), num_leaves(0), max_depth(0)
+        , build_time_ms(0), sah_cost(0)
+    {
+    }
+};
+
+// True if a node of count items at depth must be split at the median for
+// its subtree to stay within BVH_MAX_DEPTH. Median splits halve the items,
+// the subtree is then at most ceil(log2(count)) levels deep.
+inline bool must_split_at_median(uint32 depth, uint32 count)
+{
+    const uint32 levels = count > 1 ? 32 - __builtin_clz(count - 1) : 0;
+    return depth + levels >= BVH_MAX_DEPTH;
+}
+
+// Compute the SAH cost of a BVH, normalized by the area of the root node:
+// sum(interior area) * traversal cost + sum(leaf area * leaf primitives).
+// Top level leaves have no primitives and count for one primitive.
+inline Real compute_sah_cost(const std::vector<Node>& nodes, const BBoxr& root_bbox)
+{
+    const Real root_area = root_bbox.get_half_area();
+    if (nodes.empty() || root_area <= Real(0))
+        return Real(0);
+
+    struct Entry
+    {
+        uint32 node;
+        Real area;
+    };
+
+    Real cost = 0;
+    std::vector<Entry> stack;
+    stack.push_back({ 0, root_area });
+
+    while (!stack.empty())
+    {
+        const Entry entry = stack.back();
+        stack.pop_back();
+
+        const Node& node = nodes[entry.node];
+        if (node.is_leaf())
+        {
+            cost += entry.area * (Real)max(1u, node.get_num_primitives());
+        }
+        else
+        {
+            cost += entry.area * BVH_TRAV_COST;
+            stack.push_back({ entry.node + 1, node.get_left_bbox().get_half_area() });
+            stack.push_back({ node.get_right_child(), node.get_right_bbox().get_half_area() });
+        }
+    }
+
+    return cost / root_area;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const BuildStats& stats)
+{
+    os << stats.num_items << " items, ";
+    if (stats.num_references > stats.num_items)
+        os << stats.num_references << " references, ";
+    os << stats.num_nodes << " nodes, "
+       << stats.num_leaves << " leaves, "
+       << "depth " << stats.max_depth << ", "
+       << "SAH cost " << stats.sah_cost << ", "
+       << "built in " << stats.build_time_ms << " ms";
+    return os;
+}
+
+} } // namespace hop::bvh
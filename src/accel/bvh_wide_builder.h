@@ -0,0 +1,124 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "accel/bvh_node.h"
+#include "accel/bvh_wide_node.h"
+#include "math/bbox.h"
+
+#include <vector>
+
+namespace hop { namespace bvh {
+
+// Collapse a binary BVH, as produced by Builder, into a BVH with N children
+// per node. Each wide node pulls up the binary nodes below it, always
+// opening the child with the largest surface area first, until it has N
+// children or only leaves are left.
+// The binary leaves become LEAF children, or INSTANCE children if they
+// reference an instance (top level leaves without primitives).
+template <uint32 N>
+class WideCollapser
+{
+public:
+    // Collapse the binary tree rooted at root and append its nodes to wide_nodes.
+    // root_bbox is the bbox of the binary root, which the binary nodes don't store.
+    // Returns the index of the wide root node.
+    static uint32 collapse(const std::vector<Node>& nodes, uint32 root, const BBoxr& root_bbox,
+                           std::vector<WideNode<N>>* wide_nodes, uint32* max_depth = nullptr);
+
+private:
+    struct Child
+    {
+        uint32 node;
+        BBoxr bbox;
+    };
+
+    static uint32 collapse_node(const std::vector<Node>& nodes, uint32 node_index, const BBoxr& bbox,
+                                std::vector<WideNode<N>>* wide_nodes, uint32 depth, uint32* max_depth);
+};
+
+template <uint32 N>
+uint32 WideCollapser<N>::collapse(const std::vector<Node>& nodes, uint32 root, const BBoxr& root_bbox,
+                                  std::vector<WideNode<N>>* wide_nodes, uint32* max_depth)
+{
+    uint32 depth = 0;
+    uint32 wide_root = collapse_node(nodes, root, root_bbox, wide_nodes, 0, &depth);
+    if (max_depth)
+        *max_depth = depth;
+    return wide_root;
+}
+
+template <uint32 N>
+uint32 WideCollapser<N>::collapse_node(const std::vector<Node>& nodes, uint32 node_index, const BBoxr& bbox,
+                                       std::vector<WideNode<N>>* wide_nodes, uint32 depth, uint32* max_depth)
+{
+    if (depth > *max_depth)
+        *max_depth = depth;
+
+    Child children[N];
+    uint32 num_children = 0;
+
+    const Node& node = nodes[node_index];
+    if (node.is_leaf())
+    {
+        // Only happens at the root of tiny trees
+        children[num_children++] = { node_index, bbox };
+    }
+    else
+    {
+        children[num_children++] = { node_index + 1, node.get_left_bbox() };
+        children[num_children++] = { node.get_right_child(), node.get_right_bbox() };
+
+        while (num_children < N)
+        {
+            // Open the interior child with the largest area
+            int best = -1;
+            Real best_area = neg_inf;
+            for (uint32 i = 0; i < num_children; ++i)
+            {
+                if (nodes[children[i].node].is_leaf())
+                    continue;
+                const Real area = children[i].bbox.get_half_area();
+                if (area > best_area)
+                {
+                    best_area = area;
+                    best = i;
+                }
+            }
+
+            if (best < 0)
+                break;
+
+            const Node& opened = nodes[children[best].node];
+            children[num_children++] = { opened.get_right_child(), opened.get_right_bbox() };
+            children[best] = { children[best].node + 1, opened.get_left_bbox() };
+        }
+    }
+
+    const uint32 wide_index = wide_nodes->size();
+    wide_nodes->push_back(WideNode<N>());
+
+    for (uint32 i = 0; i < num_children; ++i)
+    {
+        const Node& child = nodes[children[i].node];
+
+        // Don't keep a reference on the wide node, the vector can grow while recursing
+        if (child.is_leaf())
+        {
+            if (child.get_num_primitives() == 0)
+                (*wide_nodes)[wide_index].set_instance(i, child.get_instance_index());
+            else
+                (*wide_nodes)[wide_index].set_leaf(i, child.get_primitives_offset(), child.get_num_primitives());
+        }
+        else
+        {
+            uint32 child_index = collapse_node(nodes, children[i].node, children[i].bbox, wide_nodes, depth + 1, max_depth);
+            (*wide_nodes)[wide_index].set_interior(i, child_index);
+        }
+        (*wide_nodes)[wide_index].set_child_bbox(i, children[i].bbox);
+    }
+
+    return wide_index;
+}
+
+} } // namespace hop::bvh
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "math/math.h"
+#include "math/vec3.h"
+#include "math/bbox.h"
+
+#include <immintrin.h>
+
+namespace hop { namespace bvh {
+
+// Wide BVH node with N children. The child bounds are stored as SoA so
+// all the children can be tested against a ray in one SIMD pass.
+// The bounds are always stored as floats, they are rounded outwards
+// when the geometry uses doubles.
+template <uint32 N>
+class ALIGN(64) WideNode
+{
+public:
+    enum ChildType
+    {
+        EMPTY = 0,
+        INTERIOR,   // child is a wide node
+        LEAF,       // child is a range of primitives (bottom level leaf)
+        INSTANCE    // child is an instance (top level leaf)
+    };
+
+    float bounds[3][2][N]; // [axis][min/max][child]
+
+    uint32 child[N];          // node index, first primitive or instance index
+    uint16 num_primitives[N]; // for LEAF children
+    uint8 type[N];
+
+    WideNode()
+    {
+        for (uint32 i = 0; i < N; ++i)
+        {
+            for (uint32 axis = 0; axis < 3; ++axis)
+            {
+                bounds[axis][0][i] = pos_inf;
+                bounds[axis][1][i] = neg_inf;
+            }
+            child[i] = 0;
+            num_primitives[i] = 0;
+            type[i] = EMPTY;
+        }
+    }
+
+    void set_child_bbox(uint32 i, const BBoxr& bbox);
+    BBoxr get_child_bbox(uint32 i) const;
+
+    void set_interior(uint32 i, uint32 node_index);
+    void set_leaf(uint32 i, uint32 prim_offset, uint32 num);
+    void set_instance(uint32 i, uint32 instance_index);
+};
+
+inline float round_down(float x) { return x; }
+inline float round_up(float x) { return x; }
+
+inline float round_down(double x)
+{
+    const float f = (float)x;
+    return (double)f > x ? nextafter(f, (float)neg_inf) : f;
+}
+
+inline float round_up(double x)
+{
+    const float f = (float)x;
+    return (double)f < x ? nextafter(f, (float)pos_inf) : f;
+}
+
+template <uint32 N>
+inline void WideNode<N>::set_child_bbox(uint32 i, const BBoxr& bbox)
+{
+    for (uint32 axis = 0; axis < 3; ++axis)
+    {
+        bounds[axis][0][i] = round_down(bbox.pmin[axis]);
+        bounds[axis][1][i] = round_up(bbox.pmax[axis]);
+    }
+}
+
+template <uint32 N>
+inline BBoxr WideNode<N>::get_child_bbox(uint32 i) const
+{
+    BBoxr bbox;
+    for (uint32 axis = 0; axis < 3; ++axis)
+    {
+        bbox.pmin[axis] = bounds[axis][0][i];
+        bbox.pmax[axis] = bounds[axis][1][i];
+    }
+    return bbox;
+}
+
+template <uint32 N>
+inline void WideNode<N>::set_interior(uint32 i, uint32 node_index)
+{
+    child[i] = node_index;
+    num_primitives[i] = 0;
+    type[i] = INTERIOR;
+}
+
+template <uint32 N>
+inline void WideNode<N>::set_leaf(uint32 i, uint32 prim_offset, uint32 num)
+{
+    child[i] = prim_offset;
+    num_primitives[i] = num;
+    type[i] = LEAF;
+}
+
+template <uint32 N>
+inline void WideNode<N>::set_instance(uint32 i, uint32 instance_index)
+{
+    child[i] = instance_index;
+    num_primitives[i] = 0;
+    type[i] = INSTANCE;
+}
+
+// Ray data splatted in SIMD registers for the wide node tests
+template <uint32 N>
+class WideRay;
+
+template <>
+class WideRay<4>
+{
+public:
+    __m128 org[3];
+    __m128 rcp_dir[3];
+    __m128 tmin;
+    uint32 near[3]; // index of the near plane (0: min, 1: max) for each axis
+
+    void set(const Vec3r& o, const Vec3r& inv_dir, Real t)
+    {
+        for (uint32 axis = 0; axis < 3; ++axis)
+        {
+            org[axis] = _mm_set1_ps((float)o[axis]);
+            rcp_dir[axis] = _mm_set1_ps((float)inv_dir[axis]);
+            near[axis] = inv_dir[axis] < 0 ? 1 : 0;
+        }
+        tmin = _mm_set1_ps((float)t);
+    }
+};
+
+// Intersect the ray with the children bounds. Returns the mask of the
+// children hit before tmax and stores their entry distances in dist.
+inline uint32 intersect_children(const WideNode<4>& node, const WideRay<4>& ray, Real tmax, float* dist)
+{
+    const __m128 tnear_x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[0][    ray.near[0]]), ray.org[0]), ray.rcp_dir[0]);
+    const __m128 tfar_x  = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[0][1 - ray.near[0]]), ray.org[0]), ray.rcp_dir[0]);
+    const __m128 tnear_y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1][    ray.near[1]]), ray.org[1]), ray.rcp_dir[1]);
+    const __m128 tfar_y  = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1][1 - ray.near[1]]), ray.org[1]), ray.rcp_dir[1]);
+    const __m128 tnear_z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[2][    ray.near[2]]), ray.org[2]), ray.rcp_dir[2]);
+    const __m128 tfar_z  = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[2][1 - ray.near[2]]), ray.org[2]), ray.rcp_dir[2]);
+
+    const __m128 tnear = _mm_max_ps(_mm_max_ps(tnear_x, tnear_y), _mm_max_ps(tnear_z, ray.tmin));
+    const __m128 tfar = _mm_min_ps(_mm_min_ps(tfar_x, tfar_y), _mm_min_ps(tfar_z, _mm_set1_ps((float)tmax)));
+
+    _mm_storeu_ps(dist, tnear);
+    return (uint32)_mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+}
+
+#ifdef __AVX__
+
+template <>
+class WideRay<8>
+{
+public:
+    __m256 org[3];
+    __m256 rcp_dir[3];
+    __m256 tmin;
+    uint32 near[3]; // index of the near plane (0: min, 1: max) for each axis
+
+    void set(const Vec3r& o, const Vec3r& inv_dir, Real t)
+    {
+        for (uint32 axis = 0; axis < 3; ++axis)
+        {
+            org[axis] = _mm256_set1_ps((float)o[axis]);
+            rcp_dir[axis] = _mm256_set1_ps((float)inv_dir[axis]);
+            near[axis] = inv_dir[axis] < 0 ? 1 : 0;
+        }
+        tmin = _mm256_set1_ps((float)t);
+    }
+};
+
+inline uint32 intersect_children(const WideNode<8>& node, const WideRay<8>& ray, Real tmax, float* dist)
+{
+    const __m256 tnear_x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[0][    ray.near[0]]), ray.org[0]), ray.rcp_dir[0]);
+    const __m256 tfar_x  = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[0][1 - ray.near[0]]), ray.org[0]), ray.rcp_dir[0]);
+    const __m256 tnear_y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1][    ray.near[1]]), ray.org[1]), ray.rcp_dir[1]);
+    const __m256 tfar_y  = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1][1 - ray.near[1]]), ray.org[1]), ray.rcp_dir[1]);
+    const __m256 tnear_z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[2][    ray.near[2]]), ray.org[2]), ray.rcp_dir[2]);
+    const __m256 tfar_z  = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[2][1 - ray.near[2]]), ray.org[2]), ray.rcp_dir[2]);
+
+    const __m256 tnear = _mm256_max_ps(_mm256_max_ps(tnear_x, tnear_y), _mm256_max_ps(tnear_z, ray.tmin));
+    const __m256 tfar = _mm256_min_ps(_mm256_min_ps(tfar_x, tfar_y), _mm256_min_ps(tfar_z, _mm256_set1_ps((float)tmax)));
+
+    _mm256_storeu_ps(dist, tnear);
+    return (uint32)_mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+}
+
+#endif
+
+} } // namespace hop::bvh
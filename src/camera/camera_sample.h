@@ -1,6 +1,7 @@
 #pragma once
 
 #include "math/vec2.h"
+#include "sampler/sampler.h"
 
 namespace hop {
 
@@ -11,4 +12,17 @@ public:
     Vec2r lens_point;
 };
 
+// Draw the film and lens positions of a camera sample, the sampler must
+// already be started on the pixel sample
+inline CameraSample get_camera_sample(Sampler& sampler, const Vec2u& pixel)
+{
+    const Vec2f film = sampler.get_2d();
+    const Vec2f lens = sampler.get_2d();
+
+    CameraSample sample;
+    sample.film_point = Vec2r(pixel.x + 0.5 + film.x, pixel.y + 0.5 + film.y);
+    sample.lens_point = Vec2r(lens.x - 0.5, lens.y - 0.5);
+    return sample;
+}
+
 } // namespace hop
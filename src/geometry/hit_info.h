@@ -1,5 +1,6 @@
 #pragma once
 
+#include "hop.h"
 #include "types.h"
 #include "math/vec3.h"
 
@@ -13,7 +14,9 @@ public:
     Real b1;
     Real b2;
     int32 primitive_id;
-    int32 shape_id;
+    int32 shape_id;                             // innermost instance
+    uint32 instance_depth;                      // number of instances from the world down to the primitive
+    uint32 instance_ids[MAX_INSTANCE_DEPTH];    // the instances, outermost first
 };
 
 } // namespace hop
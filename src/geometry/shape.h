@@ -12,7 +12,8 @@ namespace hop {
 
 enum ShapeType
 {
-    TRIANGLE_MESH
+    TRIANGLE_MESH,
+    SHAPE_GROUP
 };
 
 class Ray;
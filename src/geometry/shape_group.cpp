@@ -0,0 +1,94 @@
+#include "geometry/shape_group.h"
+#include "geometry/shape_instance.h"
+#include "geometry/shape_manager.h"
+#include "math/math.h"
+#include "util/log.h"
+
+namespace hop {
+
+ShapeGroup::ShapeGroup(const std::string& name)
+    : m_name(name), m_num_primitives(0), m_depth(0)
+{
+}
+
+// Instance levels below a shape, one per nested group
+static uint32 get_shape_depth(const Shape* shape)
+{
+    if (shape->get_type() == SHAPE_GROUP)
+        return static_cast<const ShapeGroup*>(shape)->get_depth();
+    return 0;
+}
+
+bool ShapeGroup::add_shape(ShapeID id)
+{
+    Shape* shape = ShapeManager::get<Shape>(id);
+    Shape* instanced = shape->is_instance() ? static_cast<ShapeInstance*>(shape)->get_shape() : shape;
+
+    // The depth and the bbox of the group are copied by its instances and
+    // by the groups it is nested in, they can't change anymore
+    if (get_num_instances() > 0)
+    {
+        Log("group") << ERROR << "cannot add " << shape->get_name() << " to " << m_name
+                     << ", the group is already instanced";
+        return false;
+    }
+
+    // The world instances the group once more
+    const uint32 depth = get_shape_depth(instanced) + 1;
+    if (depth + 1 > MAX_INSTANCE_DEPTH)
+    {
+        Log("group") << ERROR << "cannot add " << shape->get_name() << " to " << m_name
+                     << ", instances can't be nested more than " << MAX_INSTANCE_DEPTH << " levels";
+        return false;
+    }
+    if (instanced->get_type() == SHAPE_GROUP && instanced->get_num_primitives() == 0)
+    {
+        Log("group") << ERROR << "cannot add " << shape->get_name() << " to " << m_name << ", the group is empty";
+        return false;
+    }
+    if (instanced->get_type() == SHAPE_GROUP &&
+        (instanced == this || static_cast<ShapeGroup*>(instanced)->contains(this)))
+    {
+        Log("group") << ERROR << "cannot add " << shape->get_name() << " to " << m_name << ", it contains the group";
+        return false;
+    }
+
+    if (!shape->is_instance())
+        id = ShapeManager::create<ShapeInstance>(id, Transformr(), false);
+
+    ShapeInstance* instance = ShapeManager::get<ShapeInstance>(id);
+    m_instances.push_back(instance);
+
+    m_bbox.merge(instance->get_bbox());
+    m_centroid = m_bbox.get_centroid();
+    m_num_primitives += instance->get_num_primitives();
+    m_depth = max(m_depth, depth);
+
+    return true;
+}
+
+BBoxr ShapeGroup::get_bbox(const Transformr& xfm, bool compute_tight_bbox) const
+{
+    if (!compute_tight_bbox)
+        return transform_bbox(xfm, m_bbox);
+
+    BBoxr bbox;
+    for (auto inst : m_instances)
+        bbox.merge(inst->get_shape()->get_bbox(xfm * inst->get_transform(), true));
+    return bbox;
+}
+
+bool ShapeGroup::contains(const ShapeGroup* group) const
+{
+    for (auto inst : m_instances)
+    {
+        const Shape* shape = inst->get_shape();
+        if (shape == group)
+            return true;
+        if (shape->get_type() == SHAPE_GROUP && static_cast<const ShapeGroup*>(shape)->contains(group))
+            return true;
+    }
+    return false;
+}
+
+} // namespace hop
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "types.h"
+#include "geometry/shape.h"
+#include "math/bbox.h"
+#include "math/vec3.h"
+#include "math/transform.h"
+
+#include <string>
+#include <vector>
+
+namespace hop {
+
+class ShapeInstance;
+
+// Shape made of instances of other shapes, meshes or groups. Instancing a
+// group instances all its shapes while the world stores them, and the BVH
+// over them, once per group. The shapes must be added before the group is
+// instanced or nested in another group.
+class ShapeGroup : public Shape
+{
+public:
+    explicit ShapeGroup(const std::string& name);
+
+    const std::string& get_name() const override { return m_name; }
+    ShapeType get_type() const override { return SHAPE_GROUP; }
+    uint64 get_num_primitives() const override { return m_num_primitives; }
+    bool is_instance() const override { return false; }
+
+    const BBoxr& get_bbox() const override { return m_bbox; }
+    const Vec3r& get_centroid() const override { return m_centroid; }
+
+    // The tight bbox merges the bboxes of the shapes transformed along
+    BBoxr get_bbox(const Transformr& xfm, bool compute_tight_bbox) const override;
+
+    // Add a shape, wrapped in an instance with the identity transform if it
+    // isn't one. Returns false if the group is already instanced, or if the
+    // shape would nest deeper than MAX_INSTANCE_DEPTH or make the group
+    // contain itself.
+    bool add_shape(ShapeID id);
+
+    const std::vector<ShapeInstance*>& get_instances() const { return m_instances; }
+
+    // Number of instance levels below the group, 1 for a group of mesh instances
+    uint32 get_depth() const { return m_depth; }
+
+private:
+    bool contains(const ShapeGroup* group) const;
+
+    std::string m_name;
+    std::vector<ShapeInstance*> m_instances;
+    BBoxr m_bbox;
+    Vec3r m_centroid;
+    uint64 m_num_primitives;
+    uint32 m_depth;
+};
+
+} // namespace hop
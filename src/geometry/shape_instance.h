@@ -26,6 +26,10 @@ public:
 
     const Transformr& get_transform() const { return m_transform; }
 
+    // Move the instance. The bbox is tight if it was asked for at creation and
+    // the mesh still has its vertices, the transformed mesh bbox otherwise
+    void set_transform(const Transformr& xfm);
+
     bool transform_swaps_handedness() const { return m_transform_swaps_handedness; }
 
 private:
@@ -35,6 +39,7 @@ private:
     BBoxr m_bbox;
     Vec3r m_centroid;
     std::string m_name;
+    bool m_compute_tight_bbox;
     bool m_transform_swaps_handedness;
 };
 
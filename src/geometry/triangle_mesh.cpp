@@ -8,25 +8,45 @@
 
 namespace hop {
 
-TriangleMesh::TriangleMesh(const std::string& name,
-                           std::vector<Triangle>& triangles)
-    : m_name(name), m_triangles(std::move(triangles))
+TriangleMesh::TriangleMesh(const std::string& name, std::vector<Vec3f>& vertices, std::vector<Vec3f>& normals,
+                           std::vector<Vec2f>& uvs, std::vector<uint32>& indices, std::vector<MaterialID>& materials)
+    : m_name(name), m_vertices(std::move(vertices)), m_normals(std::move(normals)), m_uvs(std::move(uvs))
+    , m_indices(std::move(indices)), m_materials(std::move(materials)), m_source_hash(0)
 {
-    m_bbox = BBoxr();
-    for (auto& tri : m_triangles)
+    m_num_primitives = m_materials.size();
+    m_num_vertices = m_vertices.size();
+
+    m_bboxes.resize(m_num_primitives);
+    for (size_t i = 0; i < m_num_primitives; ++i)
     {
-        const BBoxr bbox = tri.get_bbox();
-        m_bboxes.push_back(bbox);
-        m_bbox.merge(bbox);
+        m_bboxes[i] = BBoxr(Vec3r(m_vertices[m_indices[3 * i + 0]]),
+                            Vec3r(m_vertices[m_indices[3 * i + 1]]),
+                            Vec3r(m_vertices[m_indices[3 * i + 2]]));
     }
+
+    m_bbox = BBoxr();
+    for (auto& v : m_vertices)
+        m_bbox.merge(Vec3r(v));
     m_centroid = m_bbox.get_centroid();
-    m_num_primitives = m_triangles.size();
+}
+
+TriangleMesh::TriangleMesh(const std::string& name, std::shared_ptr<MeshCache> cache)
+    : m_name(name), m_cache(std::move(cache)), m_source_hash(0)
+{
+    m_bbox = m_cache->get_bbox();
+    m_centroid = m_bbox.get_centroid();
+    m_num_primitives = m_cache->get_num_triangles();
+    m_num_vertices = m_cache->get_num_vertices();
 }
 
 void TriangleMesh::clear_triangles()
 {
-    // Release the vector and its associated memory
-    m_triangles = std::vector<Triangle>();
+    // Release the vectors and their associated memory
+    m_vertices = std::vector<Vec3f>();
+    m_normals = std::vector<Vec3f>();
+    m_uvs = std::vector<Vec2f>();
+    m_indices = std::vector<uint32>();
+    m_materials = std::vector<MaterialID>();
 }
 
 void TriangleMesh::clear_bboxes()
@@ -37,17 +57,13 @@ void TriangleMesh::clear_bboxes()
 
 BBoxr TriangleMesh::get_bbox(const Transformr& xfm, bool compute_tight_bbox) const
 {
-    if (m_triangles.empty() || !compute_tight_bbox)
+    const Vec3f* vertices = m_cache ? m_cache->get_vertices() : m_vertices.data();
+    if (!compute_tight_bbox || (!m_cache && m_vertices.empty()))
         return transform_bbox(xfm, m_bbox);
 
     BBoxr bbox;
-    for (auto& tri : m_triangles)
-    {
-        Vec3r v0 = transform_point(xfm, Vec3r(tri.vertices[0]));
-        Vec3r v1 = transform_point(xfm, Vec3r(tri.vertices[1]));
-        Vec3r v2 = transform_point(xfm, Vec3r(tri.vertices[2]));
-        bbox.merge(BBoxr(v0, v1, v2));
-    }
+    for (uint64 i = 0; i < m_num_vertices; ++i)
+        bbox.merge(transform_point(xfm, Vec3r(vertices[i])));
     return bbox;
 }
 
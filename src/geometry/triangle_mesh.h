@@ -6,6 +6,7 @@
 #include "math/vec2.h"
 #include "math/vec3.h"
 #include "material/material.h"
+#include "loaders/mesh_cache.h"
 
 #include <string>
 #include <vector>
@@ -13,24 +14,19 @@
 
 namespace hop {
 
-class Triangle
-{
-public:
-    Vec3f vertices[3];
-    Vec3f normals[3];
-    Vec2f uvs[3];
-    MaterialID material_id;
-
-    Triangle() : material_id(0) { }
-
-    BBoxr get_bbox() const { return BBoxr(Vec3r(vertices[0]), Vec3r(vertices[1]), Vec3r(vertices[2])); }
-    Vec3r get_centroid() const { return get_bbox().get_centroid(); }
-};
-
 class TriangleMesh : public Shape
 {
 public:
-    TriangleMesh(const std::string& name, std::vector<Triangle>& triangles);
+    // The vertex attributes are indexed by the 3 vertex indices of each
+    // triangle, the materials have one entry per triangle. A zero normal
+    // or uv on all the vertices of a triangle means the triangle has none,
+    // it gets its face normal and the default uvs when it is shaded.
+    TriangleMesh(const std::string& name, std::vector<Vec3f>& vertices, std::vector<Vec3f>& normals,
+                 std::vector<Vec2f>& uvs, std::vector<uint32>& indices, std::vector<MaterialID>& materials);
+
+    // A mesh loaded from its cache has no vertices, the world copies the
+    // vertices and the BVH of the cache instead of building them
+    TriangleMesh(const std::string& name, std::shared_ptr<MeshCache> cache);
 
     const std::string& get_name() const override { return m_name; }
     ShapeType get_type() const override { return TRIANGLE_MESH; }
@@ -42,19 +38,46 @@ public:
 
     BBoxr get_bbox(const Transformr& xfm, bool compute_tight_bbox) const override;
 
-    const std::vector<Triangle>& get_triangles() const { return m_triangles; }
+    const std::vector<Vec3f>& get_vertices() const { return m_vertices; }
+    const std::vector<Vec3f>& get_normals() const { return m_normals; }
+    const std::vector<Vec2f>& get_uvs() const { return m_uvs; }
+    const std::vector<uint32>& get_indices() const { return m_indices; }
+    const std::vector<MaterialID>& get_materials() const { return m_materials; }
     const std::vector<BBoxr>& get_triangles_bboxes() const { return m_bboxes; }
 
+    uint64 get_num_vertices() const { return m_num_vertices; }
+
     void clear_triangles();
     void clear_bboxes();
 
+    const std::shared_ptr<MeshCache>& get_cache() const { return m_cache; }
+    void clear_cache() { m_cache.reset(); }
+
+    // Write the cache of the mesh to this file once its BVH is built,
+    // source_hash is the hash of the file the mesh was loaded from
+    void set_cache_file(const std::string& cache_file, uint64 source_hash)
+    {
+        m_cache_file = cache_file;
+        m_source_hash = source_hash;
+    }
+    const std::string& get_cache_file() const { return m_cache_file; }
+    uint64 get_source_hash() const { return m_source_hash; }
+
 private:
     std::string m_name;
-    std::vector<Triangle> m_triangles;
+    std::vector<Vec3f> m_vertices;
+    std::vector<Vec3f> m_normals;
+    std::vector<Vec2f> m_uvs;
+    std::vector<uint32> m_indices;
+    std::vector<MaterialID> m_materials;
     std::vector<BBoxr> m_bboxes;
+    std::shared_ptr<MeshCache> m_cache;
+    std::string m_cache_file;
+    uint64 m_source_hash;
     BBoxr m_bbox;
     Vec3r m_centroid;
     uint64 m_num_primitives;
+    uint64 m_num_vertices;
 };
 
 typedef std::shared_ptr<TriangleMesh> TriangleMeshPtr;
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "math/vec3.h"
+#include "geometry/ray.h"
+#include "geometry/hit_info.h"
+#include "geometry/intersect_triangle.h"
+
+#include <immintrin.h>
+
+namespace hop {
+
+// N triangles stored as SoA so they can be tested against a ray in one
+// SIMD pass. The edges are precomputed, unused lanes have null edges
+// which makes their determinant zero so they never report a hit.
+template <uint32 N>
+class ALIGN(4 * N) TrianglePacket
+{
+public:
+    float v0[3][N];
+    float e1[3][N];
+    float e2[3][N];
+    uint32 primitive_id[N];
+
+    TrianglePacket()
+    {
+        for (uint32 i = 0; i < N; ++i)
+        {
+            for (uint32 axis = 0; axis < 3; ++axis)
+                v0[axis][i] = e1[axis][i] = e2[axis][i] = 0.0f;
+            primitive_id[i] = 0;
+        }
+    }
+
+    void set(uint32 lane, const Vec3f& a, const Vec3f& b, const Vec3f& c, uint32 id)
+    {
+        for (uint32 axis = 0; axis < 3; ++axis)
+        {
+            v0[axis][lane] = a[axis];
+            e1[axis][lane] = b[axis] - a[axis];
+            e2[axis][lane] = c[axis] - a[axis];
+        }
+        primitive_id[lane] = id;
+    }
+};
+
+// Find the closest lane of the packet hit by the ray, if any, from the
+// hit distances of the valid lanes. Fills the hit and shortens the ray.
+inline int closest_lane(uint32 mask, const float* t, const float* b1, const float* b2, const Ray& ray, HitInfo* hit)
+{
+    if (mask == 0)
+        return -1;
+
+    int lane = __builtin_ctz(mask);
+    for (uint32 m = mask & (mask - 1); m; m &= m - 1)
+    {
+        const uint32 i = __builtin_ctz(m);
+        if (t[i] < t[lane])
+            lane = i;
+    }
+
+    hit->t = t[lane];
+    hit->b1 = b1[lane];
+    hit->b2 = b2[lane];
+    ray.tmax = hit->t;
+    return lane;
+}
+
+// Moller-Trumbore test of the 4 triangles of a packet with SSE.
+// Returns the closest lane hit or -1.
+inline int intersect_triangles(const TrianglePacket<4>& packet, const Ray& ray, HitInfo* hit)
+{
+    const __m128 eps = _mm_set1_ps((float)RAY_EPSILON);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    const __m128 dir_x = _mm_set1_ps((float)ray.dir.x);
+    const __m128 dir_y = _mm_set1_ps((float)ray.dir.y);
+    const __m128 dir_z = _mm_set1_ps((float)ray.dir.z);
+
+    const __m128 e1_x = _mm_load_ps(packet.e1[0]);
+    const __m128 e1_y = _mm_load_ps(packet.e1[1]);
+    const __m128 e1_z = _mm_load_ps(packet.e1[2]);
+    const __m128 e2_x = _mm_load_ps(packet.e2[0]);
+    const __m128 e2_y = _mm_load_ps(packet.e2[1]);
+    const __m128 e2_z = _mm_load_ps(packet.e2[2]);
+
+    // s1 = cross(dir, e2)
+    const __m128 s1_x = _mm_sub_ps(_mm_mul_ps(dir_y, e2_z), _mm_mul_ps(dir_z, e2_y));
+    const __m128 s1_y = _mm_sub_ps(_mm_mul_ps(dir_z, e2_x), _mm_mul_ps(dir_x, e2_z));
+    const __m128 s1_z = _mm_sub_ps(_mm_mul_ps(dir_x, e2_y), _mm_mul_ps(dir_y, e2_x));
+
+    const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s1_x, e1_x), _mm_mul_ps(s1_y, e1_y)), _mm_mul_ps(s1_z, e1_z));
+    __m128 valid = _mm_or_ps(_mm_cmple_ps(det, _mm_sub_ps(zero, eps)), _mm_cmpge_ps(det, eps));
+    const __m128 inv_det = _mm_div_ps(one, det);
+
+    // First barycentric coordinate
+    const __m128 d_x = _mm_sub_ps(_mm_set1_ps((float)ray.org.x), _mm_load_ps(packet.v0[0]));
+    const __m128 d_y = _mm_sub_ps(_mm_set1_ps((float)ray.org.y), _mm_load_ps(packet.v0[1]));
+    const __m128 d_z = _mm_sub_ps(_mm_set1_ps((float)ray.org.z), _mm_load_ps(packet.v0[2]));
+    const __m128 b1 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d_x, s1_x), _mm_mul_ps(d_y, s1_y)), _mm_mul_ps(d_z, s1_z)), inv_det);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(b1, _mm_sub_ps(zero, eps)), _mm_cmple_ps(b1, _mm_add_ps(one, eps))));
+
+    // Second barycentric coordinate, s2 = cross(d, e1)
+    const __m128 s2_x = _mm_sub_ps(_mm_mul_ps(d_y, e1_z), _mm_mul_ps(d_z, e1_y));
+    const __m128 s2_y = _mm_sub_ps(_mm_mul_ps(d_z, e1_x), _mm_mul_ps(d_x, e1_z));
+    const __m128 s2_z = _mm_sub_ps(_mm_mul_ps(d_x, e1_y), _mm_mul_ps(d_y, e1_x));
+    const __m128 b2 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dir_x, s2_x), _mm_mul_ps(dir_y, s2_y)), _mm_mul_ps(dir_z, s2_z)), inv_det);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(b2, _mm_sub_ps(zero, eps)), _mm_cmple_ps(_mm_add_ps(b1, b2), _mm_add_ps(one, eps))));
+
+    // Distance to the intersection point
+    const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2_x, s2_x), _mm_mul_ps(e2_y, s2_y)), _mm_mul_ps(e2_z, s2_z)), inv_det);
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps((float)ray.tmin)), _mm_cmple_ps(t, _mm_set1_ps((float)ray.tmax))));
+
+    const uint32 mask = (uint32)_mm_movemask_ps(valid);
+    if (mask == 0)
+        return -1;
+
+    ALIGN(16) float t_lanes[4], b1_lanes[4], b2_lanes[4];
+    _mm_store_ps(t_lanes, t);
+    _mm_store_ps(b1_lanes, b1);
+    _mm_store_ps(b2_lanes, b2);
+    return closest_lane(mask, t_lanes, b1_lanes, b2_lanes, ray, hit);
+}
+
+#ifdef __AVX__
+
+// Moller-Trumbore test of the 8 triangles of a packet with AVX.
+// Returns the closest lane hit or -1.
+inline int intersect_triangles(const TrianglePacket<8>& packet, const Ray& ray, HitInfo* hit)
+{
+    const __m256 eps = _mm256_set1_ps((float)RAY_EPSILON);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    const __m256 dir_x = _mm256_set1_ps((float)ray.dir.x);
+    const __m256 dir_y = _mm256_set1_ps((float)ray.dir.y);
+    const __m256 dir_z = _mm256_set1_ps((float)ray.dir.z);
+
+    const __m256 e1_x = _mm256_load_ps(packet.e1[0]);
+    const __m256 e1_y = _mm256_load_ps(packet.e1[1]);
+    const __m256 e1_z = _mm256_load_ps(packet.e1[2]);
+    const __m256 e2_x = _mm256_load_ps(packet.e2[0]);
+    const __m256 e2_y = _mm256_load_ps(packet.e2[1]);
+    const __m256 e2_z = _mm256_load_ps(packet.e2[2]);
+
+    // s1 = cross(dir, e2)
+    const __m256 s1_x = _mm256_sub_ps(_mm256_mul_ps(dir_y, e2_z), _mm256_mul_ps(dir_z, e2_y));
+    const __m256 s1_y = _mm256_sub_ps(_mm256_mul_ps(dir_z, e2_x), _mm256_mul_ps(dir_x, e2_z));
+    const __m256 s1_z = _mm256_sub_ps(_mm256_mul_ps(dir_x, e2_y), _mm256_mul_ps(dir_y, e2_x));
+
+    const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s1_x, e1_x), _mm256_mul_ps(s1_y, e1_y)), _mm256_mul_ps(s1_z, e1_z));
+    __m256 valid = _mm256_or_ps(_mm256_cmp_ps(det, _mm256_sub_ps(zero, eps), _CMP_LE_OQ), _mm256_cmp_ps(det, eps, _CMP_GE_OQ));
+    const __m256 inv_det = _mm256_div_ps(one, det);
+
+    // First barycentric coordinate
+    const __m256 d_x = _mm256_sub_ps(_mm256_set1_ps((float)ray.org.x), _mm256_load_ps(packet.v0[0]));
+    const __m256 d_y = _mm256_sub_ps(_mm256_set1_ps((float)ray.org.y), _mm256_load_ps(packet.v0[1]));
+    const __m256 d_z = _mm256_sub_ps(_mm256_set1_ps((float)ray.org.z), _mm256_load_ps(packet.v0[2]));
+    const __m256 b1 = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d_x, s1_x), _mm256_mul_ps(d_y, s1_y)), _mm256_mul_ps(d_z, s1_z)), inv_det);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(b1, _mm256_sub_ps(zero, eps), _CMP_GE_OQ),
+                                               _mm256_cmp_ps(b1, _mm256_add_ps(one, eps), _CMP_LE_OQ)));
+
+    // Second barycentric coordinate, s2 = cross(d, e1)
+    const __m256 s2_x = _mm256_sub_ps(_mm256_mul_ps(d_y, e1_z), _mm256_mul_ps(d_z, e1_y));
+    const __m256 s2_y = _mm256_sub_ps(_mm256_mul_ps(d_z, e1_x), _mm256_mul_ps(d_x, e1_z));
+    const __m256 s2_z = _mm256_sub_ps(_mm256_mul_ps(d_x, e1_y), _mm256_mul_ps(d_y, e1_x));
+    const __m256 b2 = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dir_x, s2_x), _mm256_mul_ps(dir_y, s2_y)), _mm256_mul_ps(dir_z, s2_z)), inv_det);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(b2, _mm256_sub_ps(zero, eps), _CMP_GE_OQ),
+                                               _mm256_cmp_ps(_mm256_add_ps(b1, b2), _mm256_add_ps(one, eps), _CMP_LE_OQ)));
+
+    // Distance to the intersection point
+    const __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2_x, s2_x), _mm256_mul_ps(e2_y, s2_y)), _mm256_mul_ps(e2_z, s2_z)), inv_det);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps((float)ray.tmin), _CMP_GE_OQ),
+                                               _mm256_cmp_ps(t, _mm256_set1_ps((float)ray.tmax), _CMP_LE_OQ)));
+
+    const uint32 mask = (uint32)_mm256_movemask_ps(valid);
+    if (mask == 0)
+        return -1;
+
+    ALIGN(32) float t_lanes[8], b1_lanes[8], b2_lanes[8];
+    _mm256_store_ps(t_lanes, t);
+    _mm256_store_ps(b1_lanes, b1);
+    _mm256_store_ps(b2_lanes, b2);
+    return closest_lane(mask, t_lanes, b1_lanes, b2_lanes, ray, hit);
+}
+
+#endif
+
+} // namespace hop
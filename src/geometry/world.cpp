@@ -2,25 +2,37 @@
 #include "geometry/world.h"
 #include "geometry/shape.h"
 #include "geometry/shape_instance.h"
+#include "geometry/shape_group.h"
 #include "geometry/triangle_mesh.h"
 #include "geometry/ray.h"
 #include "geometry/hit_info.h"
 #include "geometry/interaction.h"
 #include "geometry/intersect_triangle.h"
 #include "material/material_manager.h"
+#include "loaders/mesh_cache.h"
 #include "math/math.h"
 #include "math/bbox.h"
 #include "math/vec3.h"
 #include "math/transform.h"
 #include "accel/bvh_node.h"
 #include "accel/bvh_builder.h"
+#include "accel/bvh_binned_builder.h"
+#include "accel/bvh_spatial_split_builder.h"
+#include "accel/bvh_stats.h"
 #include "accel/bvh_intersector_two_levels.h"
+#include "accel/bvh_wide_builder.h"
+#include "accel/bvh_quantizer.h"
+#include "accel/bvh_intersector_wide.h"
+#include "accel/bvh_intersector_packet.h"
 #include "util/stop_watch.h"
 #include "util/log.h"
 
 #include <memory>
 #include <vector>
 #include <map>
+#include <utility>
+#include <algorithm>
+#include <functional>
 #include <cassert>
 
 namespace hop {
@@ -28,10 +40,19 @@ namespace hop {
 void World::add_shape(ShapeID id)
 {
     Shape* shape = ShapeManager::get<Shape>(id);
+    if (shape->get_type() == SHAPE_GROUP && shape->get_num_primitives() == 0)
+    {
+        Log("world") << ERROR << "cannot add " << shape->get_name() << ", the group is empty";
+        return;
+    }
+
     if (!shape->is_instance())
         id = ShapeManager::create<ShapeInstance>(id, Transformr(), false);
 
+    // Drop the group instances of a previous preprocess, they follow the world instances
     ShapeInstance* instance = ShapeManager::get<ShapeInstance>(id);
+    m_instance_ptrs.resize(m_num_world_instances);
+    m_instance_indices[id] = m_num_world_instances++;
     m_instance_ptrs.push_back(instance);
 
     m_dirty = true;
@@ -46,37 +67,62 @@ BBoxr World::get_bbox()
     if (m_dirty)
     {
         m_bbox = BBoxr();
-        for (auto inst : m_instance_ptrs)
-            m_bbox.merge(inst->get_bbox());
+        for (uint32 i = 0; i < m_num_world_instances; ++i)
+            m_bbox.merge(m_instance_ptrs[i]->get_bbox());
         m_dirty = false;
     }
     return m_bbox;
 }
 
+static bool is_zero(const Vec2r& v)
+{
+    return v.x == Real(0) && v.y == Real(0);
+}
+
+static bool is_zero(const Vec3r& v)
+{
+    return v.x == Real(0) && v.y == Real(0) && v.z == Real(0);
+}
+
 void World::get_surface_interaction(const HitInfo& hit, SurfaceInteraction* interaction)
 {
     Real b0 = Real(1.0) - hit.b1 - hit.b2;
 
-    const Vec3r& p0 = Vec3r(m_vertices[hit.primitive_id * 3 + 0]);
-    const Vec3r& p1 = Vec3r(m_vertices[hit.primitive_id * 3 + 1]);
-    const Vec3r& p2 = Vec3r(m_vertices[hit.primitive_id * 3 + 2]);
+    const uint32 i0 = m_indices[hit.primitive_id * 3 + 0];
+    const uint32 i1 = m_indices[hit.primitive_id * 3 + 1];
+    const uint32 i2 = m_indices[hit.primitive_id * 3 + 2];
+
+    const Vec3r& p0 = Vec3r(m_vertices[i0]);
+    const Vec3r& p1 = Vec3r(m_vertices[i1]);
+    const Vec3r& p2 = Vec3r(m_vertices[i2]);
     Vec3r pos = b0 * p0 + hit.b1 * p1 + hit.b2 * p2;
 
-    const Vec2r& uv0 = Vec2r(m_uvs[hit.primitive_id * 3 + 0]);
-    const Vec2r& uv1 = Vec2r(m_uvs[hit.primitive_id * 3 + 1]);
-    const Vec2r& uv2 = Vec2r(m_uvs[hit.primitive_id * 3 + 2]);
+    // A triangle without uvs gets the default ones
+    Vec2r uv0 = Vec2r(m_uvs[i0]);
+    Vec2r uv1 = Vec2r(m_uvs[i1]);
+    Vec2r uv2 = Vec2r(m_uvs[i2]);
+    if (is_zero(uv0) && is_zero(uv1) && is_zero(uv2))
+    {
+        uv1 = Vec2r(1, 0);
+        uv2 = Vec2r(1, 1);
+    }
     Vec2r uv = b0 * uv0 + hit.b1 * uv1 + hit.b2 * uv2;
 
-    const Vec3r& n0 = Vec3r(m_normals[hit.primitive_id * 3 + 0]);
-    const Vec3r& n1 = Vec3r(m_normals[hit.primitive_id * 3 + 1]);
-    const Vec3r& n2 = Vec3r(m_normals[hit.primitive_id * 3 + 2]);
-    Vec3r ns = b0 * n0 + hit.b1 * n1 + hit.b2 * n2;
+    const Vec3r dp02 = p0 - p2;
+    const Vec3r dp12 = p1 - p2;
+    const Vec3r normal = normalize(cross(dp02, dp12));
+
+    // A triangle without normals is flat shaded
+    const Vec3r& n0 = Vec3r(m_normals[i0]);
+    const Vec3r& n1 = Vec3r(m_normals[i1]);
+    const Vec3r& n2 = Vec3r(m_normals[i2]);
+    Vec3r ns = normal;
+    if (!is_zero(n0) || !is_zero(n1) || !is_zero(n2))
+        ns = b0 * n0 + hit.b1 * n1 + hit.b2 * n2;
 
     Vec3r dpdu, dpdv;
     const Vec2r duv02 = uv0 - uv2;
     const Vec2r duv12 = uv1 - uv2;
-    const Vec3r dp02 = p0 - p2;
-    const Vec3r dp12 = p1 - p2;
     const Real inv_det = rcp(duv02.x * duv12.y - duv02.y * duv12.x);
     dpdu = ( duv12.y * dp02 - duv02.y * dp12) * inv_det;
     dpdv = (-duv12.x * dp02 + duv02.x * dp12) * inv_det;
@@ -94,17 +140,33 @@ void World::get_surface_interaction(const HitInfo& hit, SurfaceInteraction* inte
     }
     ns = normalize(cross(ss, ts));
 
-    const Transformr xfm = inverse(m_instance_inv_xfm[hit.shape_id]);
+    // Compose the transforms of the instances from the world down to the
+    // triangle, there is only one for the instances of the world
+    const AffineTransform* xfm = &m_instance_xfms[hit.instance_ids[0]];
+    const AffineTransform* inv_xfm = &m_instance_inv_xfms[hit.instance_ids[0]];
+    AffineTransform nested_xfm, nested_inv_xfm;
+    if (hit.instance_depth > 1)
+    {
+        nested_xfm = *xfm;
+        nested_inv_xfm = *inv_xfm;
+        for (uint32 i = 1; i < hit.instance_depth; ++i)
+        {
+            nested_xfm = nested_xfm * m_instance_xfms[hit.instance_ids[i]];
+            nested_inv_xfm = m_instance_inv_xfms[hit.instance_ids[i]] * nested_inv_xfm;
+        }
+        xfm = &nested_xfm;
+        inv_xfm = &nested_inv_xfm;
+    }
 
-    interaction->position = transform_point(xfm, pos);
-    interaction->wo = transform_vector(xfm, -hit.ray_dir);
+    interaction->position = transform_point(*xfm, pos);
+    interaction->wo = transform_vector(*xfm, -hit.ray_dir);
     interaction->uv = uv;
-    interaction->normal = transform_normal(xfm, normalize(cross(dp02, dp12)));
-    interaction->dpdu = transform_vector(xfm, dpdu);
-    interaction->dpdv = transform_vector(xfm, dpdv);
-    interaction->shading_normal = transform_normal(xfm, ns);
-    interaction->shading_dpdu = transform_vector(xfm, ss);
-    interaction->shading_dpdv = transform_vector(xfm, ts);
+    interaction->normal = transform_normal(*inv_xfm, normal);
+    interaction->dpdu = transform_vector(*xfm, dpdu);
+    interaction->dpdv = transform_vector(*xfm, dpdv);
+    interaction->shading_normal = transform_normal(*inv_xfm, ns);
+    interaction->shading_dpdu = transform_vector(*xfm, ss);
+    interaction->shading_dpdv = transform_vector(*xfm, ts);
     interaction->shape = m_instance_ptrs[hit.shape_id];
     interaction->material = m_materials[hit.primitive_id];
 }
@@ -115,61 +177,288 @@ void World::preprocess()
     stop_watch.start();
     Log("world") << INFO << "preprocessing scene";
 
+    flatten_groups();
     partition_instances();
+    partition_groups();
     partition_meshes();
+    compute_max_depth();
+#ifdef TRIS_SIMD_ISECT
+    pack_triangles();
+#endif
+#ifdef BVH_WIDTH
+    collapse_bvhs();
+#endif
+#ifdef BVH_QUANTIZED_BITS
+    quantize_bvhs();
+#endif
 
     stop_watch.stop();
     Log("world") << INFO << "preprocessed scene in " << stop_watch.get_elapsed_time_ms() << " ms";
 
     uint64 total = 0;
-    for (auto inst : m_instance_ptrs)
-        total += inst->get_num_primitives();
+    for (uint32 i = 0; i < m_num_world_instances; ++i)
+        total += m_instance_ptrs[i]->get_num_primitives();
 
-    Log("world") << INFO << m_vertices.size() / 3 << " unique triangles, "
+    Log("world") << INFO << m_indices.size() / 3 << " unique triangles, "
+                         << m_vertices.size() << " vertices, "
                          << m_instance_ptrs.size() << " instances, "
+                         << m_groups.size() << " groups, "
                          << total << " instanced triangles";
 }
 
-// Partition mesh instances so that each instance ends up in its own BVH leaf.
-void World::partition_instances()
+// Append the instances of the groups to the instances of the world. A group
+// adds its instances once, however many times it is instanced, the
+// instances of the groups nested in it are appended in turn.
+void World::flatten_groups()
 {
-    Log("world") << INFO << "building scene BVH tree (" << m_instance_ptrs.size() << " instanced meshes)";
+    m_instance_ptrs.resize(m_num_world_instances);
+    m_groups.clear();
 
+    std::map<ShapeGroup*, uint32> first_instances;
+    for (size_t i = 0; i < m_instance_ptrs.size(); ++i)
+    {
+        if (m_instance_ptrs[i]->get_type() != SHAPE_GROUP)
+            continue;
+
+        ShapeGroup* group = static_cast<ShapeGroup*>(m_instance_ptrs[i]->get_shape());
+        if (first_instances.count(group))
+            continue;
+
+        first_instances[group] = m_instance_ptrs.size();
+        m_groups.emplace_back(group, m_instance_ptrs.size());
+        m_instance_ptrs.insert(m_instance_ptrs.end(), group->get_instances().begin(), group->get_instances().end());
+    }
+}
+
+// Partition the world instances so that each instance ends up in its own BVH leaf.
+void World::partition_instances()
+{
     m_instance_bvh_roots.resize(m_instance_ptrs.size());
-    m_instance_inv_xfm.resize(m_instance_ptrs.size());
+    m_instance_bvh_depths.resize(m_instance_ptrs.size());
+    m_instance_xfms.resize(m_instance_ptrs.size());
+    m_instance_inv_xfms.resize(m_instance_ptrs.size());
 
     for (size_t i = 0; i < m_instance_ptrs.size(); ++i)
-        m_instance_inv_xfm[i] = inverse(m_instance_ptrs[i]->get_transform());
+    {
+        const Transformr& xfm = m_instance_ptrs[i]->get_transform();
+        m_instance_xfms[i] = AffineTransform(xfm.m);
+        m_instance_inv_xfms[i] = AffineTransform(xfm.inv);
+    }
+
+    m_bvh_nodes = build_instance_bvh();
+    m_num_instance_nodes = m_bvh_nodes.size();
+}
+
+// Build the scene BVH over the current bounds of the world instances
+std::vector<bvh::Node> World::build_instance_bvh()
+{
+    Log("world") << INFO << "building scene BVH tree (" << m_num_world_instances << " instances)";
+
+    bvh::BuildStats stats;
+    std::vector<bvh::Node> nodes = build_instance_bvh(0, m_num_world_instances, &stats);
+    m_instance_bvh_sah_cost = stats.sah_cost;
+    m_instance_bvh_depth = stats.max_depth;
+
+    Log("world") << INFO << "scene BVH: " << stats;
 
-    auto inst_leaf_cb = [&](bvh::Node* leaf, const std::vector<ShapeInstance*>& instances)
+    return nodes;
+}
+
+// Build a BVH over count instances starting at first, each leaf holds one instance
+std::vector<bvh::Node> World::build_instance_bvh(uint32 first, uint32 count, bvh::BuildStats* stats) const
+{
+    // The builder partitions instance indices, each leaf holds one instance
+    auto inst_leaf_cb = [&](bvh::Node* leaf, const std::vector<uint32>& instances)
     {
-        ShapeInstance* inst = instances[0];
-        for (size_t i = 0; i < m_instance_ptrs.size(); ++i)
-        {
-            if (m_instance_ptrs[i] == inst)
-            {
-                leaf->set_instance_index(i);
-                break;
-            }
-        }
+        assert(instances.size() == 1);
+        leaf->set_instance_index(instances[0]);
     };
 
     class InstAccessor
     {
     public:
-        const BBoxr& get_bbox(ShapeInstance* ptr) const { return ptr->get_bbox(); }
-        const Vec3r& get_centroid(ShapeInstance* ptr) const { return ptr->get_centroid(); }
+        explicit InstAccessor(const std::vector<ShapeInstance*>& instances) : m_instances(instances) { }
+        const BBoxr& get_bbox(uint32 index) const { return m_instances[index]->get_bbox(); }
+        const Vec3r& get_centroid(uint32 index) const { return m_instances[index]->get_centroid(); }
+    private:
+        const std::vector<ShapeInstance*>& m_instances;
     };
 
-    InstAccessor accessor;
+    InstAccessor accessor(m_instance_ptrs);
+
+    std::vector<uint32> instances(count);
+    for (uint32 i = 0; i < count; ++i)
+        instances[i] = first + i;
+
+#ifdef BVH_BINNED_BUILDER
+    typedef bvh::BinnedBuilder<uint32, InstAccessor> InstBuilder;
+#else
+    typedef bvh::Builder<uint32, InstAccessor, bvh::SAHStrategy<uint32, InstAccessor>> InstBuilder;
+#endif
+
+    return InstBuilder::build(&accessor, instances, 1, inst_leaf_cb, stats, 1);
+}
+
+// Build the BVH of each group over its instances, in the group space. The
+// instances of a group reference its BVH as the instances of a mesh
+// reference the mesh BVH.
+void World::partition_groups()
+{
+    std::map<ShapeGroup*, std::pair<uint32, uint32>> group_roots;
+    for (const auto& group : m_groups)
+    {
+        bvh::BuildStats stats;
+        std::vector<bvh::Node> nodes = build_instance_bvh(group.second, group.first->get_instances().size(), &stats);
+        Log("world") << INFO << group.first->get_name() << " BVH: " << stats;
+
+        const uint32 offset = m_bvh_nodes.size();
+        for (auto& node : nodes)
+        {
+            node.offset_child_nodes(offset);
+            m_bvh_nodes.push_back(node);
+        }
+        group_roots[group.first] = { offset, stats.max_depth };
+    }
+
+    for (size_t i = 0; i < m_instance_ptrs.size(); ++i)
+    {
+        if (m_instance_ptrs[i]->get_type() != SHAPE_GROUP)
+            continue;
+        const auto& root = group_roots[static_cast<ShapeGroup*>(m_instance_ptrs[i]->get_shape())];
+        m_instance_bvh_roots[i] = root.first;
+        m_instance_bvh_depths[i] = root.second;
+    }
+}
+
+void World::set_instance_transform(ShapeID instance, const Transformr& xfm)
+{
+    auto it = m_instance_indices.find(instance);
+    if (it == m_instance_indices.end())
+    {
+        Log("world") << WARNING << "shape " << instance << " is not an instance of this world";
+        return;
+    }
+    m_moved_instances.emplace_back(it->second, xfm);
+}
+
+// Apply the moved instance transforms and refit the scene BVH. The mesh BVHs
+// don't change, only the scene BVH and the nodes derived from it are updated.
+void World::update_instances()
+{
+    if (m_moved_instances.empty())
+        return;
+
+    // Wait for the render threads to leave the world
+    std::unique_lock<SharedMutex> lock(m_mutex);
+
+    StopWatch stop_watch;
+    stop_watch.start();
+
+    for (const auto& moved : m_moved_instances)
+    {
+        m_instance_ptrs[moved.first]->set_transform(moved.second);
+        if (moved.first < m_instance_xfms.size())
+        {
+            m_instance_xfms[moved.first] = AffineTransform(moved.second.m);
+            m_instance_inv_xfms[moved.first] = AffineTransform(moved.second.inv);
+        }
+    }
+    m_moved_instances.clear();
+    m_dirty = true;
+
+    // Nothing to refit before the world is preprocessed
+    if (m_num_instance_nodes == 0)
+        return;
+
+    refit_instance_bvh();
+
+    // Refitting keeps the tree topology, rebuild the tree once its quality
+    // dropped too much
+    const Real sah_cost = bvh::compute_sah_cost(m_bvh_nodes, get_bbox());
+    const bool rebuild = sah_cost > BVH_REBUILD_SAH_RATIO * m_instance_bvh_sah_cost;
+#if defined(BVH_WIDTH) || defined(BVH_QUANTIZED_BITS)
+    bool resized = false;
+#endif
+    if (rebuild)
+    {
+        Log("world") << INFO << "scene BVH SAH cost went from " << m_instance_bvh_sah_cost
+                     << " to " << sah_cost << ", rebuilding it";
+
+        std::vector<bvh::Node> nodes = build_instance_bvh();
+        const uint32 num_nodes = nodes.size();
+#if defined(BVH_WIDTH) || defined(BVH_QUANTIZED_BITS)
+        resized = num_nodes != m_num_instance_nodes;
+#endif
+
+        // The mesh BVHs follow the scene BVH, shift them if its size changed.
+        // The offset wraps around when the scene BVH shrinks.
+        const uint32 shift = num_nodes - m_num_instance_nodes;
+        nodes.reserve(m_bvh_nodes.size() + shift);
+        for (size_t i = m_num_instance_nodes; i < m_bvh_nodes.size(); ++i)
+        {
+            nodes.push_back(m_bvh_nodes[i]);
+            nodes.back().offset_child_nodes(shift);
+        }
+        for (auto& root : m_instance_bvh_roots)
+            root += shift;
+
+        m_bvh_nodes.swap(nodes);
+        m_num_instance_nodes = num_nodes;
+        compute_max_depth();
+    }
+
+#ifdef BVH_WIDTH
+    // The mesh wide BVHs follow the scene wide BVH, they only need to be
+    // collapsed again when the scene wide BVH changes size
+    std::vector<bvh::WideNode<BVH_WIDTH>> wide_nodes;
+    if (!resized)
+        bvh::WideCollapser<BVH_WIDTH>::collapse(m_bvh_nodes, 0, get_bbox(), &wide_nodes);
+    if (!resized && wide_nodes.size() == m_num_instance_wide_nodes)
+        std::copy(wide_nodes.begin(), wide_nodes.end(), m_wide_nodes.begin());
+    else
+        collapse_bvhs();
+#endif
+#ifdef BVH_QUANTIZED_BITS
+    if (!resized)
+        bvh::Quantizer<bvh::QuantizedBound>::quantize(m_bvh_nodes, 0, get_bbox(), &m_quantized_nodes);
+    else
+        quantize_bvhs();
+#endif
 
-    m_bvh_nodes = bvh::Builder<ShapeInstance*, InstAccessor,
-        bvh::SAHStrategy<ShapeInstance*, InstAccessor>>::build(
-            &accessor, m_instance_ptrs, 1, inst_leaf_cb);
+    stop_watch.stop();
+    Log("world") << DEBUG << (rebuild ? "rebuilt" : "refitted") << " scene BVH in "
+                 << stop_watch.get_elapsed_time_ms() << " ms";
+}
+
+// Recompute the bounds of the scene BVH nodes bottom up. The children of a
+// node come after it so the nodes are visited in reverse order.
+void World::refit_instance_bvh()
+{
+    std::vector<BBoxr> bboxes(m_num_instance_nodes);
+    for (uint32 i = m_num_instance_nodes; i-- > 0;)
+    {
+        bvh::Node& node = m_bvh_nodes[i];
+        if (node.is_leaf())
+        {
+            bboxes[i] = m_instance_ptrs[node.get_instance_index()]->get_bbox();
+            continue;
+        }
+
+        const BBoxr& left_bbox = bboxes[i + 1];
+        const BBoxr& right_bbox = bboxes[node.get_right_child()];
+        node.set_left_bbox(left_bbox);
+        node.set_right_bbox(right_bbox);
+        bboxes[i] = merge(left_bbox, right_bbox);
+    }
 }
 
 // Partition each mesh into its own BVH. Update all instances to point
 // to this mesh BVH.
+// The meshes are built concurrently, each build returns the vertex indices
+// of its triangles in leaf order. With spatial splits a triangle can be
+// referenced by several leaves so the triangle offsets of the meshes are
+// only known once all the builds are done. The meshes loaded from their
+// cache copy the cached BVH instead of building it.
 void World::partition_meshes()
 {
     // Generate a map of meshes to lists of instance indices
@@ -181,119 +470,469 @@ void World::partition_meshes()
             mesh_to_instance_map[reinterpret_cast<TriangleMesh*>(inst->get_shape())].push_back(i);
     }
 
-    // Scan all unique meshes and calculate the total number of vertices for preallocation
-    uint32 total_vertices = 0;
-    for (const auto& kv : mesh_to_instance_map)
-        total_vertices += 3 * kv.first->get_triangles().size();
+    std::vector<std::pair<TriangleMesh*, std::vector<uint32>>> meshes(
+        mesh_to_instance_map.begin(), mesh_to_instance_map.end());
+    const size_t num_meshes = meshes.size();
+
+    // Prefix sum of the vertex counts gives the first vertex of each mesh
+    std::vector<uint32> vertex_offsets(num_meshes + 1, 0);
+    for (size_t m = 0; m < num_meshes; ++m)
+        vertex_offsets[m + 1] = vertex_offsets[m] + meshes[m].first->get_num_vertices();
 
+    const uint32 total_vertices = vertex_offsets[num_meshes];
     m_vertices.resize(total_vertices);
     m_normals.resize(total_vertices);
     m_uvs.resize(total_vertices);
-    m_materials.resize(total_vertices / 3);
 
-    uint32 vertex_offset = 0;
-    uint32 triangle_offset = 0;
+    // Start with the biggest meshes so they don't end up alone at the end
+    std::vector<size_t> build_order(num_meshes);
+    for (size_t m = 0; m < num_meshes; ++m)
+        build_order[m] = m;
+    std::sort(build_order.begin(), build_order.end(), [&](size_t a, size_t b)
+    {
+        return meshes[a].first->get_num_primitives() > meshes[b].first->get_num_primitives();
+    });
+
+    std::vector<std::vector<bvh::Node>> mesh_nodes(num_meshes);
+    std::vector<std::vector<uint32>> mesh_indices(num_meshes);
+    std::vector<std::vector<Material*>> mesh_materials(num_meshes);
+    std::vector<uint32> mesh_depths(num_meshes);
+
+#pragma omp parallel
+#pragma omp single
+    for (size_t i = 0; i < num_meshes; ++i)
+    {
+        const size_t m = build_order[i];
+#pragma omp task
+        {
+            if (meshes[m].first->get_cache())
+                mesh_nodes[m] = copy_mesh_cache(meshes[m].first, vertex_offsets[m],
+                                                &mesh_indices[m], &mesh_materials[m], &mesh_depths[m]);
+            else
+                mesh_nodes[m] = partition_mesh(meshes[m].first, meshes[m].second.size(), vertex_offsets[m],
+                                               &mesh_indices[m], &mesh_materials[m], &mesh_depths[m]);
+        }
+    }
 
-    for (const auto& kv : mesh_to_instance_map)
+    // Prefix sums of the triangle and node counts give the first triangle
+    // and the root of each mesh BVH
+    std::vector<uint32> triangle_offsets(num_meshes + 1, 0);
+    std::vector<uint32> node_offsets(num_meshes + 1, m_bvh_nodes.size());
+    for (size_t m = 0; m < num_meshes; ++m)
     {
-        TriangleMesh* mesh = kv.first;
+        triangle_offsets[m + 1] = triangle_offsets[m] + mesh_materials[m].size();
+        node_offsets[m + 1] = node_offsets[m] + mesh_nodes[m].size();
+    }
 
-        Log("world") << INFO << "building BVH tree for " << mesh->get_name()
-                             << " (" << mesh->get_num_primitives() << " triangles, "
-                             << kv.second.size() << " instances)";
+    const uint32 total_triangles = triangle_offsets[num_meshes];
+    m_indices.resize(3 * total_triangles);
+    m_materials.resize(total_triangles);
+    m_bvh_nodes.resize(node_offsets[num_meshes]);
 
-        uint32 num_bvh2_leaves = 0;
+#pragma omp parallel for schedule(dynamic)
+    for (size_t m = 0; m < num_meshes; ++m)
+    {
+        // For all instances that point to this mesh, set their bvh_root to this mesh
+        const uint32 offset = node_offsets[m];
+        for (auto inst : meshes[m].second)
+        {
+            m_instance_bvh_roots[inst] = offset;
+            m_instance_bvh_depths[inst] = mesh_depths[m];
+        }
 
-        auto tri_leaf_cb = [&](bvh::Node* leaf, const std::vector<size_t>& tri_indices)
-            //const std::vector<Triangle>& triangles)
+        // Update the nodes indices and copy them at their place in the bvh node list
+        const uint32 triangle_offset = triangle_offsets[m];
+        std::vector<bvh::Node>& nodes = mesh_nodes[m];
+        for (size_t i = 0; i < nodes.size(); ++i)
         {
-            leaf->set_primitives(triangle_offset, tri_indices.size());
-            ++num_bvh2_leaves;
+            nodes[i].offset_child_nodes(offset);
+            if (nodes[i].is_leaf())
+                nodes[i].set_primitives(nodes[i].get_primitives_offset() + triangle_offset, nodes[i].get_num_primitives());
+            m_bvh_nodes[offset + i] = nodes[i];
+        }
+        nodes = std::vector<bvh::Node>();
 
-            // Copy triangles to flat array
-            for (auto i : tri_indices)
-            {
-                const Triangle& tri = mesh->get_triangles()[i];
+        // Copy the triangles at their place in the triangle arrays
+        const uint32 vertex_offset = vertex_offsets[m];
+        const std::vector<uint32>& indices = mesh_indices[m];
+        for (size_t i = 0; i < indices.size(); ++i)
+            m_indices[3 * triangle_offset + i] = indices[i] + vertex_offset;
+        std::copy(mesh_materials[m].begin(), mesh_materials[m].end(), m_materials.begin() + triangle_offset);
 
-                m_vertices[vertex_offset + 0] = tri.vertices[0];
-                m_vertices[vertex_offset + 1] = tri.vertices[1];
-                m_vertices[vertex_offset + 2] = tri.vertices[2];
+        mesh_indices[m] = std::vector<uint32>();
+        mesh_materials[m] = std::vector<Material*>();
+    }
+}
 
-                m_normals[vertex_offset + 0] = tri.normals[0];
-                m_normals[vertex_offset + 1] = tri.normals[1];
-                m_normals[vertex_offset + 2] = tri.normals[2];
+// Build the BVH of a mesh and copy its vertices to the vertex arrays starting
+// at vertex_offset. The vertex indices and the materials of its triangles
+// are returned in leaf order, the leaves and the vertex indices are relative
+// to the mesh.
+std::vector<bvh::Node> World::partition_mesh(TriangleMesh* mesh, size_t num_instances, uint32 vertex_offset,
+                                             std::vector<uint32>* leaf_indices, std::vector<Material*>* leaf_materials,
+                                             uint32* max_depth)
+{
+    Log("world") << INFO << "building BVH tree for " << mesh->get_name()
+                         << " (" << mesh->get_num_primitives() << " triangles, "
+                         << num_instances << " instances)";
 
-                m_uvs[vertex_offset + 0] = tri.uvs[0];
-                m_uvs[vertex_offset + 1] = tri.uvs[1];
-                m_uvs[vertex_offset + 2] = tri.uvs[2];
+    const std::vector<uint32>& indices = mesh->get_indices();
+    const std::vector<MaterialID>& materials = mesh->get_materials();
 
-                m_materials[triangle_offset] = MaterialManager::get(tri.material_id);
+    std::copy(mesh->get_vertices().begin(), mesh->get_vertices().end(), m_vertices.begin() + vertex_offset);
+    std::copy(mesh->get_normals().begin(), mesh->get_normals().end(), m_normals.begin() + vertex_offset);
+    std::copy(mesh->get_uvs().begin(), mesh->get_uvs().end(), m_uvs.begin() + vertex_offset);
+
+    const uint32 num_tris = mesh->get_num_primitives();
+    leaf_indices->reserve(3 * num_tris);
+    leaf_materials->reserve(num_tris);
+
+    auto tri_leaf_cb = [&](bvh::Node* leaf, const std::vector<size_t>& tri_indices)
+    {
+        leaf->set_primitives(leaf_materials->size(), tri_indices.size());
 
-                vertex_offset += 3;
-                ++triangle_offset;
+        // Copy the vertex indices of the triangles in leaf order
+        for (auto i : tri_indices)
+        {
+            leaf_indices->push_back(indices[3 * i + 0]);
+            leaf_indices->push_back(indices[3 * i + 1]);
+            leaf_indices->push_back(indices[3 * i + 2]);
+            leaf_materials->push_back(MaterialManager::get(materials[i]));
+        }
+    };
+
+    class TriAccessor
+    {
+    public:
+        TriAccessor(const TriangleMesh* mesh)
+            : bboxes(mesh->get_triangles_bboxes()), vertices(mesh->get_vertices()), indices(mesh->get_indices()) { }
+
+        const BBoxr& get_bbox(size_t i) const { return bboxes[i]; }
+        Vec3r get_centroid(size_t i) const { return bboxes[i].get_centroid(); }
+
+        // Bounds of the parts of a triangle on each side of a plane, clipped
+        // to the bounds of the part being split
+        void split_bbox(size_t i, uint8 axis, Real position, const BBoxr& bbox, BBoxr* left, BBoxr* right) const
+        {
+            *left = BBoxr();
+            *right = BBoxr();
+
+            Vec3r v0 = Vec3r(vertices[indices[3 * i + 2]]);
+            for (uint32 k = 0; k < 3; ++k)
+            {
+                const Vec3r v1 = Vec3r(vertices[indices[3 * i + k]]);
+                if (v0[axis] <= position)
+                    left->merge(v0);
+                if (v0[axis] >= position)
+                    right->merge(v0);
+
+                // The edge crosses the plane
+                if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position))
+                {
+                    const Real t = clamp((position - v0[axis]) / (v1[axis] - v0[axis]), Real(0), Real(1));
+                    Vec3r p = v0 + (v1 - v0) * t;
+                    p[axis] = position;
+                    left->merge(p);
+                    right->merge(p);
+                }
+                v0 = v1;
             }
-        };
 
-        class TriAccessor
+            left->pmax[axis] = position;
+            right->pmin[axis] = position;
+            *left = hop::intersect(*left, bbox);
+            *right = hop::intersect(*right, bbox);
+        }
+
+        const std::vector<BBoxr>& bboxes;
+        const std::vector<Vec3f>& vertices;
+        const std::vector<uint32>& indices;
+    };
+
+    TriAccessor accessor(mesh);
+    std::vector<size_t> tri_indices;
+    for (size_t i = 0; i < num_tris; ++i)
+        tri_indices.push_back(i);
+
+#if defined(BVH_SPATIAL_SPLITS)
+    typedef bvh::SpatialSplitBuilder<size_t, TriAccessor> TriBuilder;
+#elif defined(BVH_BINNED_BUILDER)
+    typedef bvh::BinnedBuilder<size_t, TriAccessor> TriBuilder;
+#else
+    typedef bvh::Builder<size_t, TriAccessor, bvh::SAHStrategy<size_t, TriAccessor>> TriBuilder;
+#endif
+
+    bvh::BuildStats stats;
+    auto bvh_nodes = TriBuilder::build(&accessor, tri_indices, MIN_PRIMS_PER_LEAF, tri_leaf_cb, &stats);
+
+    Log("world") << INFO << mesh->get_name() << " BVH: " << stats;
+    *max_depth = stats.max_depth;
+
+    if (!mesh->get_cache_file().empty())
+    {
+        MeshCache::write(mesh->get_cache_file(), mesh->get_source_hash(), mesh->get_bbox(), bvh_nodes, stats.max_depth,
+                         leaf_materials->size(), mesh->get_num_vertices(),
+                         &m_vertices[vertex_offset], &m_normals[vertex_offset], &m_uvs[vertex_offset],
+                         leaf_indices->data(), leaf_materials->data());
+    }
+
+    mesh->clear_bboxes();
+    mesh->clear_triangles();
+
+    return bvh_nodes;
+}
+
+// Copy the vertices, the triangles and the BVH of a mesh loaded from its
+// cache, the same way partition_mesh returns them.
+std::vector<bvh::Node> World::copy_mesh_cache(TriangleMesh* mesh, uint32 vertex_offset,
+                                              std::vector<uint32>* leaf_indices, std::vector<Material*>* leaf_materials,
+                                              uint32* max_depth)
+{
+    const MeshCache& cache = *mesh->get_cache();
+    const uint32 num_tris = cache.get_num_triangles();
+    const uint32 num_vertices = cache.get_num_vertices();
+
+    Log("world") << INFO << "using cached BVH tree for " << mesh->get_name()
+                         << " (" << num_tris << " triangles, " << cache.get_num_nodes() << " nodes)";
+
+    std::copy_n(cache.get_vertices(), num_vertices, &m_vertices[vertex_offset]);
+    std::copy_n(cache.get_normals(), num_vertices, &m_normals[vertex_offset]);
+    std::copy_n(cache.get_uvs(), num_vertices, &m_uvs[vertex_offset]);
+    leaf_indices->assign(cache.get_indices(), cache.get_indices() + 3 * num_tris);
+    leaf_materials->resize(num_tris);
+    for (uint32 i = 0; i < num_tris; ++i)
+        (*leaf_materials)[i] = cache.get_material(i);
+
+    std::vector<bvh::Node> bvh_nodes(cache.get_nodes(), cache.get_nodes() + cache.get_num_nodes());
+    *max_depth = cache.get_max_depth();
+
+    // Unmap the cache file
+    mesh->clear_cache();
+
+    return bvh_nodes;
+}
+
+// Find the deepest path from the scene BVH root down to a mesh BVH leaf. The
+// traversals push at most one node per level of the BVHs along the path, or
+// one per child for the wide BVHs, which are no deeper than the binary ones.
+void World::compute_max_depth()
+{
+    // Depth below the leaves of each group BVH, computed once per group
+    const std::map<const ShapeGroup*, uint32> first_instances(m_groups.begin(), m_groups.end());
+    std::map<const ShapeGroup*, uint32> group_depths;
+    std::function<uint32(uint32)> get_instance_depth = [&](uint32 instance) -> uint32
+    {
+        const uint32 depth = m_instance_bvh_depths[instance];
+        if (m_instance_ptrs[instance]->get_type() != SHAPE_GROUP)
+            return depth;
+
+        const ShapeGroup* group = static_cast<const ShapeGroup*>(m_instance_ptrs[instance]->get_shape());
+        auto it = group_depths.find(group);
+        if (it == group_depths.end())
         {
-        public:
-            TriAccessor(const TriangleMesh* mesh) : bboxes(mesh->get_triangles_bboxes()) { }
+            const uint32 first = first_instances.at(group);
+            uint32 below = 0;
+            for (uint32 i = first; i < first + group->get_instances().size(); ++i)
+                below = max(below, get_instance_depth(i));
+            it = group_depths.emplace(group, below).first;
+        }
+        return depth + it->second;
+    };
 
-            const BBoxr& get_bbox(size_t i) const { return bboxes[i]; }
-            Vec3r get_centroid(size_t i) const { return bboxes[i].get_centroid(); }
+    uint32 below = 0;
+    for (uint32 i = 0; i < m_num_world_instances; ++i)
+        below = max(below, get_instance_depth(i));
+    m_max_depth = m_instance_bvh_depth + below;
 
-            const std::vector<BBoxr>& bboxes;
-        };
+    Log("world") << INFO << "deepest BVH path " << m_max_depth << " nodes";
+}
 
-        TriAccessor accessor(mesh);
-        std::vector<size_t> tri_indices;
-        size_t num_tris = mesh->get_triangles().size();
-        for (size_t i = 0; i < num_tris; ++i)
-            tri_indices.push_back(i);
+#ifdef TRIS_SIMD_ISECT
+// Group the triangles of each bottom level leaf in SoA packets. The leaves
+// then reference a range of packets instead of a range of triangles, the
+// indexed vertices are kept for the surface interactions.
+void World::pack_triangles()
+{
+    const uint32 packet_size = TRIS_SIMD_WIDTH;
 
-        auto bvh_nodes = bvh::Builder<size_t, TriAccessor,
-             bvh::SAHStrategy<size_t, TriAccessor>>::build(
-                &accessor, tri_indices, MIN_PRIMS_PER_LEAF, tri_leaf_cb);
+    // Prefix sum of the packet counts gives the first packet of each leaf
+    std::vector<uint32> leaves;
+    std::vector<uint32> packet_offsets(1, 0);
+    for (size_t i = 0; i < m_bvh_nodes.size(); ++i)
+    {
+        const bvh::Node& node = m_bvh_nodes[i];
+        if (node.is_leaf() && node.get_num_primitives() > 0)
+        {
+            leaves.push_back(i);
+            packet_offsets.push_back(packet_offsets.back() + (node.get_num_primitives() + packet_size - 1) / packet_size);
+        }
+    }
 
-        mesh->clear_bboxes();
-        mesh->clear_triangles();
+    m_triangle_packets.clear();
+    m_triangle_packets.resize(packet_offsets.back());
 
-        // For all instances that point to this mesh, set their bvh_root to this mesh
-        const std::vector<uint32>& instances = kv.second;
-        int32 offset = (int32)m_bvh_nodes.size();
-        for (size_t i = 0; i < instances.size(); ++i)
-            m_instance_bvh_roots[instances[i]] = uint32(offset);
-
-        // Update the nodes indices and push them at the end of the bvh node list
-        for (size_t i = 0; i < bvh_nodes.size(); ++i)
-            bvh_nodes[i].offset_child_nodes(offset);
-        m_bvh_nodes.insert(m_bvh_nodes.end(), bvh_nodes.begin(), bvh_nodes.end());
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (size_t l = 0; l < leaves.size(); ++l)
+    {
+        bvh::Node& leaf = m_bvh_nodes[leaves[l]];
+        const uint32 first = leaf.get_primitives_offset();
+        const uint32 num = leaf.get_num_primitives();
+
+        for (uint32 i = 0; i < num; ++i)
+        {
+            const uint32 tri = first + i;
+            m_triangle_packets[packet_offsets[l] + i / packet_size].set(i % packet_size,
+                m_vertices[m_indices[3 * tri + 0]], m_vertices[m_indices[3 * tri + 1]], m_vertices[m_indices[3 * tri + 2]], tri);
+        }
+
+        leaf.set_primitives(packet_offsets[l], packet_offsets[l + 1] - packet_offsets[l]);
     }
+
+    Log("world") << INFO << "packed " << m_indices.size() / 3 << " triangles into "
+                 << m_triangle_packets.size() << " packets of " << packet_size;
 }
+#endif
+
+#ifdef BVH_WIDTH
+// Collapse the top level BVH and the mesh BVHs into wide BVHs. The triangle
+// arrays are not touched, the wide leaves reference the same triangle ranges.
+void World::collapse_bvhs()
+{
+    typedef bvh::WideCollapser<BVH_WIDTH> Collapser;
 
+    StopWatch stop_watch;
+    stop_watch.start();
+
+    m_wide_nodes.clear();
+    m_instance_wide_roots.resize(m_instance_bvh_roots.size());
+
+    uint32 max_depth = 0;
+    Collapser::collapse(m_bvh_nodes, 0, get_bbox(), &m_wide_nodes, &max_depth);
+    m_num_instance_wide_nodes = m_wide_nodes.size();
+    Log("world") << INFO << "scene wide BVH depth " << max_depth;
+
+    // Instances of the same mesh share their wide BVH
+    std::map<uint32, uint32> binary_to_wide_root;
+    for (size_t i = 0; i < m_instance_bvh_roots.size(); ++i)
+    {
+        const uint32 root = m_instance_bvh_roots[i];
+        auto it = binary_to_wide_root.find(root);
+        if (it == binary_to_wide_root.end())
+        {
+            const BBoxr& bbox = m_instance_ptrs[i]->get_shape()->get_bbox();
+            it = binary_to_wide_root.emplace(root, Collapser::collapse(m_bvh_nodes, root, bbox, &m_wide_nodes)).first;
+        }
+        m_instance_wide_roots[i] = it->second;
+    }
+
+    stop_watch.stop();
+    Log("world") << INFO << "collapsed " << m_bvh_nodes.size() << " BVH nodes into "
+                 << m_wide_nodes.size() << " " << BVH_WIDTH << "-wide nodes in "
+                 << stop_watch.get_elapsed_time_ms() << " ms";
+}
+#endif
+
+#ifdef BVH_QUANTIZED_BITS
+// Quantize the top level BVH and the mesh BVHs. The quantized nodes keep
+// the indices of the binary nodes, which are kept for the stream traversal.
+void World::quantize_bvhs()
+{
+    typedef bvh::Quantizer<bvh::QuantizedBound> Quantizer;
+
+    m_quantized_nodes.clear();
+    m_quantized_nodes.resize(m_bvh_nodes.size());
+    m_instance_root_bboxes.resize(m_instance_bvh_roots.size());
+
+    Quantizer::quantize(m_bvh_nodes, 0, get_bbox(), &m_quantized_nodes);
+
+    // Instances of the same mesh share their BVH
+    std::map<uint32, BBoxr> quantized_roots;
+    for (size_t i = 0; i < m_instance_bvh_roots.size(); ++i)
+    {
+        const uint32 root = m_instance_bvh_roots[i];
+        auto it = quantized_roots.find(root);
+        if (it == quantized_roots.end())
+        {
+            const BBoxr& bbox = m_instance_ptrs[i]->get_shape()->get_bbox();
+            Quantizer::quantize(m_bvh_nodes, root, bbox, &m_quantized_nodes);
+            it = quantized_roots.emplace(root, bbox).first;
+        }
+        m_instance_root_bboxes[i] = it->second;
+    }
+
+    Log("world") << INFO << "quantized " << m_quantized_nodes.size() << " BVH nodes to "
+                 << BVH_QUANTIZED_BITS << " bits, " << sizeof(bvh::QuantizedNode<bvh::QuantizedBound>) << " bytes per node";
+}
+#endif
+
+// Leaf visitor, the leaves reference a range of triangle packets with
+// TRIS_SIMD_ISECT and a range of triangles otherwise
 class Visitor
 {
 public:
-    Visitor(const Vec3r* vertices) : m_vertices(vertices) { }
+#ifdef TRIS_SIMD_ISECT
+    typedef TrianglePacket<TRIS_SIMD_WIDTH> Packet;
 
-    bool intersect(const bvh::Node& node, const Ray& ray, HitInfo* hit) const;
-    bool intersect_any(const bvh::Node& node, const Ray& ray, HitInfo* hit) const;
+    Visitor(const Packet* packets) : m_packets(packets) { }
+#else
+    Visitor(const Vec3f* vertices, const uint32* indices) : m_vertices(vertices), m_indices(indices) { }
+#endif
 
-    const Vec3r* m_vertices;
+    bool intersect(uint32 first, uint32 num, const Ray& ray, HitInfo* hit) const;
+    bool intersect_any(uint32 first, uint32 num, const Ray& ray, HitInfo* hit) const;
+
+#ifdef TRIS_SIMD_ISECT
+    const Packet* m_packets;
+#else
+    const Vec3f* m_vertices;
+    const uint32* m_indices;
+#endif
 };
 
-inline bool Visitor::intersect(const bvh::Node& node, const Ray& ray, HitInfo* hit) const
+#ifdef TRIS_SIMD_ISECT
+
+inline bool Visitor::intersect(uint32 first, uint32 num, const Ray& ray, HitInfo* hit) const
 {
     bool got_hit = false;
-    uint32 num_primitives = node.get_num_primitives();
-    uint32 tri_idx = node.get_primitives_offset();
+    for (uint32 i = first; i < first + num; ++i)
+    {
+        const int lane = intersect_triangles(m_packets[i], ray, hit);
+        if (lane >= 0)
+        {
+            got_hit = true;
+            hit->primitive_id = m_packets[i].primitive_id[lane];
+            hit->ray_dir = ray.dir;
+        }
+    }
+    return got_hit;
+}
+
+inline bool Visitor::intersect_any(uint32 first, uint32 num, const Ray& ray, HitInfo* hit) const
+{
+    for (uint32 i = first; i < first + num; ++i)
+    {
+        const int lane = intersect_triangles(m_packets[i], ray, hit);
+        if (lane >= 0)
+        {
+            hit->primitive_id = m_packets[i].primitive_id[lane];
+            hit->ray_dir = ray.dir;
+            return true;
+        }
+    }
+    return false;
+}
+
+#else
 
-    uint32 vert_index = tri_idx * 3;
-    for (; vert_index < (tri_idx + num_primitives) * 3; vert_index += 3)
+inline bool Visitor::intersect(uint32 first, uint32 num, const Ray& ray, HitInfo* hit) const
+{
+    bool got_hit = false;
+    uint32 vert_index = first * 3;
+    for (; vert_index < (first + num) * 3; vert_index += 3)
     {
-        const Vec3r& v0 = Vec3r(m_vertices[vert_index + 0]);
-        const Vec3r& v1 = Vec3r(m_vertices[vert_index + 1]);
-        const Vec3r& v2 = Vec3r(m_vertices[vert_index + 2]);
+        const Vec3r& v0 = Vec3r(m_vertices[m_indices[vert_index + 0]]);
+        const Vec3r& v1 = Vec3r(m_vertices[m_indices[vert_index + 1]]);
+        const Vec3r& v2 = Vec3r(m_vertices[m_indices[vert_index + 2]]);
         const Vec3r e1 = v1 - v0;
         const Vec3r e2 = v2 - v0;
         if (intersect_triangle(v0, e1, e2, ray, hit))
@@ -306,35 +945,110 @@ inline bool Visitor::intersect(const bvh::Node& node, const Ray& ray, HitInfo* h
     return got_hit;
 }
 
-inline bool Visitor::intersect_any(const bvh::Node& node, const Ray& ray, HitInfo* hit) const
+inline bool Visitor::intersect_any(uint32 first, uint32 num, const Ray& ray, HitInfo* hit) const
 {
-    uint32 num_primitives = node.get_num_primitives();
-    uint32 tri_idx = node.get_primitives_offset();
-
-    uint32 vert_index = tri_idx * 3;
-    for (; vert_index < (tri_idx + num_primitives) * 3; vert_index += 3)
+    uint32 vert_index = first * 3;
+    for (; vert_index < (first + num) * 3; vert_index += 3)
     {
-        const Vec3r& v0 = Vec3r(m_vertices[vert_index + 0]);
-        const Vec3r& v1 = Vec3r(m_vertices[vert_index + 1]);
-        const Vec3r& v2 = Vec3r(m_vertices[vert_index + 2]);
+        const Vec3r& v0 = Vec3r(m_vertices[m_indices[vert_index + 0]]);
+        const Vec3r& v1 = Vec3r(m_vertices[m_indices[vert_index + 1]]);
+        const Vec3r& v2 = Vec3r(m_vertices[m_indices[vert_index + 2]]);
         const Vec3r e1 = v1 - v0;
         const Vec3r e2 = v2 - v0;
         if (intersect_triangle(v0, e1, e2, ray, hit))
+        {
+            hit->primitive_id = vert_index / 3;
+            hit->ray_dir = ray.dir;
             return true;
+        }
     }
     return false;
 }
 
+#endif
+
 bool World::intersect(const Ray& r, HitInfo* hit) const
 {
-    Visitor visitor(&m_vertices[0]);
-    return bvh::intersect_two_levels(&m_bvh_nodes[0], &m_instance_inv_xfm[0], &m_instance_bvh_roots[0], r, hit, visitor);
+#ifdef TRIS_SIMD_ISECT
+    Visitor visitor(&m_triangle_packets[0]);
+#else
+    Visitor visitor(&m_vertices[0], &m_indices[0]);
+#endif
+#if defined(BVH_WIDTH)
+    return bvh::intersect_wide_two_levels(&m_wide_nodes[0], &m_instance_inv_xfms[0], &m_instance_wide_roots[0], m_max_depth,
+                                          r, hit, visitor);
+#elif defined(BVH_QUANTIZED_BITS)
+    return bvh::intersect_quantized_two_levels<false>(&m_quantized_nodes[0], m_bbox, &m_instance_root_bboxes[0],
+                                                      &m_instance_inv_xfms[0], &m_instance_bvh_roots[0], m_max_depth,
+                                                      r, hit, visitor);
+#else
+    return bvh::intersect_two_levels(&m_bvh_nodes[0], &m_instance_inv_xfms[0], &m_instance_bvh_roots[0], m_max_depth,
+                                     r, hit, visitor);
+#endif
 }
 
 bool World::intersect_any(const Ray& r, HitInfo* hit) const
 {
-    Visitor visitor(&m_vertices[0]);
-    return bvh::intersect_any_two_levels(&m_bvh_nodes[0], &m_instance_inv_xfm[0], &m_instance_bvh_roots[0], r, hit, visitor);
+#ifdef TRIS_SIMD_ISECT
+    Visitor visitor(&m_triangle_packets[0]);
+#else
+    Visitor visitor(&m_vertices[0], &m_indices[0]);
+#endif
+#if defined(BVH_WIDTH)
+    return bvh::intersect_any_wide_two_levels(&m_wide_nodes[0], &m_instance_inv_xfms[0], &m_instance_wide_roots[0], m_max_depth,
+                                              r, hit, visitor);
+#elif defined(BVH_QUANTIZED_BITS)
+    return bvh::intersect_quantized_two_levels<true>(&m_quantized_nodes[0], m_bbox, &m_instance_root_bboxes[0],
+                                                     &m_instance_inv_xfms[0], &m_instance_bvh_roots[0], m_max_depth,
+                                                     r, hit, visitor);
+#else
+    return bvh::intersect_any_two_levels(&m_bvh_nodes[0], &m_instance_inv_xfms[0], &m_instance_bvh_roots[0], m_max_depth,
+                                         r, hit, visitor);
+#endif
+}
+
+template <bool any_hit>
+static size_t intersect_stream(const bvh::Node* nodes, const AffineTransform* inv_transforms, const uint32* bvh_roots,
+                               uint32 max_depth, const Ray* rays, HitInfo* hits, size_t n, Visitor& visitor)
+{
+    size_t num_hits = 0;
+    for (size_t first = 0; first < n; first += RAY_PACKET_SIZE)
+    {
+        const uint32 num_rays = (uint32)min(n - first, (size_t)RAY_PACKET_SIZE);
+        const uint32 hit_mask = bvh::intersect_packet_two_levels<RAY_PACKET_SIZE, any_hit>(
+            nodes, inv_transforms, bvh_roots, max_depth, rays + first, hits + first, num_rays, visitor);
+
+        for (uint32 i = 0; i < num_rays; ++i)
+        {
+            if (hit_mask & (1u << i))
+                ++num_hits;
+            else
+                hits[first + i].primitive_id = -1;
+        }
+    }
+    return num_hits;
+}
+
+size_t World::intersect_stream(const Ray* rays, HitInfo* hits, size_t n) const
+{
+#ifdef TRIS_SIMD_ISECT
+    Visitor visitor(&m_triangle_packets[0]);
+#else
+    Visitor visitor(&m_vertices[0], &m_indices[0]);
+#endif
+    return hop::intersect_stream<false>(&m_bvh_nodes[0], &m_instance_inv_xfms[0], &m_instance_bvh_roots[0], m_max_depth,
+                                        rays, hits, n, visitor);
+}
+
+size_t World::intersect_any_stream(const Ray* rays, HitInfo* hits, size_t n) const
+{
+#ifdef TRIS_SIMD_ISECT
+    Visitor visitor(&m_triangle_packets[0]);
+#else
+    Visitor visitor(&m_vertices[0], &m_indices[0]);
+#endif
+    return hop::intersect_stream<true>(&m_bvh_nodes[0], &m_instance_inv_xfms[0], &m_instance_bvh_roots[0], m_max_depth,
+                                       rays, hits, n, visitor);
 }
 
 } // namespace hop
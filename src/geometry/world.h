@@ -1,14 +1,23 @@
 #pragma once
 
+#include "hop.h"
 #include "types.h"
 #include "accel/bvh_node.h"
+#include "accel/bvh_stats.h"
+#include "accel/bvh_wide_node.h"
+#include "accel/bvh_quantized_node.h"
+#include "geometry/triangle_packet.h"
 #include "math/bbox.h"
 #include "math/vec2.h"
 #include "math/vec3.h"
 #include "math/transform.h"
+#include "math/affine_transform.h"
 #include "util/log.h"
+#include "util/thread_util.h"
 
+#include <map>
 #include <memory>
+#include <utility>
 #include <vector>
 
 namespace hop {
@@ -17,12 +26,22 @@ class Ray;
 class HitInfo;
 class SurfaceInteraction;
 class ShapeInstance;
+class ShapeGroup;
+class TriangleMesh;
 class Material;
 
 class World
 {
 public:
+    World()
+        : m_num_world_instances(0), m_num_instance_nodes(0), m_instance_bvh_sah_cost(0), m_instance_bvh_depth(0)
+        , m_max_depth(0), m_dirty(true)
+    {
+    }
     ~World() { Log("world") << DEBUG << "world deleted"; }
+
+    // Add a shape, wrapped in an instance with the identity transform if it
+    // isn't one. Instances of groups bring in the shapes of the groups.
     void add_shape(ShapeID shape_id);
 
     void preprocess();
@@ -30,6 +49,12 @@ public:
     bool intersect(const Ray& r, HitInfo* hit) const;
     bool intersect_any(const Ray& r, HitInfo* hit) const;
 
+    // Intersect n rays, they traverse the BVH in packets of RAY_PACKET_SIZE
+    // rays so they should be coherent. The rays that hit nothing get a
+    // primitive_id of -1. Returns the number of rays that hit something.
+    size_t intersect_stream(const Ray* rays, HitInfo* hits, size_t n) const;
+    size_t intersect_any_stream(const Ray* rays, HitInfo* hits, size_t n) const;
+
     void get_surface_interaction(const HitInfo& hit, SurfaceInteraction* info);
 
     BBoxr get_bbox();
@@ -37,23 +62,86 @@ public:
     // This will trigger a BBox recalculation when needed
     void set_dirty() { m_dirty = true; }
 
-    bool empty() const { return m_instance_ptrs.empty(); }
+    bool empty() const { return m_num_world_instances == 0; }
+
+    // Move an instance added to the world, the move is applied by update_instances
+    void set_instance_transform(ShapeID instance, const Transformr& xfm);
+
+    // Apply the instance moves and refit the scene BVH to them, the mesh BVHs
+    // are kept as they are. The scene BVH is rebuilt once refitting made its
+    // SAH cost grow past BVH_REBUILD_SAH_RATIO times its cost when it was built.
+    // Waits for the render threads to leave the world.
+    void update_instances();
+
+    // The render threads hold this lock shared while they render a tile,
+    // update_instances holds it exclusively
+    SharedMutex& get_mutex() const { return m_mutex; }
 
 private:
+    void flatten_groups();
     void partition_instances();
+    std::vector<bvh::Node> build_instance_bvh();
+    std::vector<bvh::Node> build_instance_bvh(uint32 first, uint32 count, bvh::BuildStats* stats) const;
+    void refit_instance_bvh();
+    void partition_groups();
     void partition_meshes();
+    std::vector<bvh::Node> partition_mesh(TriangleMesh* mesh, size_t num_instances, uint32 vertex_offset,
+                                          std::vector<uint32>* leaf_indices, std::vector<Material*>* leaf_materials,
+                                          uint32* max_depth);
+    std::vector<bvh::Node> copy_mesh_cache(TriangleMesh* mesh, uint32 vertex_offset,
+                                           std::vector<uint32>* leaf_indices, std::vector<Material*>* leaf_materials,
+                                           uint32* max_depth);
+    void compute_max_depth();
+#ifdef TRIS_SIMD_ISECT
+    void pack_triangles();
+#endif
+#ifdef BVH_WIDTH
+    void collapse_bvhs();
+#endif
+#ifdef BVH_QUANTIZED_BITS
+    void quantize_bvhs();
+#endif
 
 private:
+    // The instances added to the world come first, then the instances of
+    // each group, once per group however many times it is instanced
     std::vector<ShapeInstance*> m_instance_ptrs;
+    uint32 m_num_world_instances;
+    std::vector<std::pair<ShapeGroup*, uint32>> m_groups; // first instance of each group
+    std::map<ShapeID, uint32> m_instance_indices;
+    std::vector<std::pair<uint32, Transformr>> m_moved_instances;
     std::vector<Material*> m_materials;
     std::vector<bvh::Node> m_bvh_nodes;
-    std::vector<Transformr> m_instance_inv_xfm;
+    // Transforms of the instances to their parent space and back, the
+    // traversals only read the inverse ones
+    std::vector<AffineTransform> m_instance_xfms;
+    std::vector<AffineTransform> m_instance_inv_xfms;
     std::vector<uint32> m_instance_bvh_roots;
+    std::vector<uint32> m_instance_bvh_depths;
+    uint32 m_num_instance_nodes; // the scene BVH comes first, then the group BVHs and the mesh BVHs
+    Real m_instance_bvh_sah_cost;
+    uint32 m_instance_bvh_depth;
+    uint32 m_max_depth; // deepest path down the scene BVH and the BVHs of the instances, sizes the traversal stacks
+#ifdef BVH_WIDTH
+    std::vector<bvh::WideNode<BVH_WIDTH>> m_wide_nodes;
+    std::vector<uint32> m_instance_wide_roots;
+    uint32 m_num_instance_wide_nodes;
+#endif
+#ifdef BVH_QUANTIZED_BITS
+    std::vector<bvh::QuantizedNode<bvh::QuantizedBound>> m_quantized_nodes;
+    std::vector<BBoxr> m_instance_root_bboxes;
+#endif
+    // Vertices of all the meshes, the triangles index them 3 indices per triangle
     std::vector<Vec3f> m_vertices;
     std::vector<Vec3f> m_normals;
     std::vector<Vec2f> m_uvs;
+    std::vector<uint32> m_indices;
+#ifdef TRIS_SIMD_ISECT
+    std::vector<TrianglePacket<TRIS_SIMD_WIDTH>> m_triangle_packets;
+#endif
     bool m_dirty;
     BBoxr m_bbox;
+    mutable SharedMutex m_mutex;
 };
 
 } // namespace hop
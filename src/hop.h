@@ -7,17 +7,88 @@
 
 #ifdef REAL_IS_DOUBLE
     #define BBOX_SIMD_ISECT
+#else
+    // Intersect the leaf triangles in SoA packets of this many
+    // triangles, 4 uses SSE and 8 uses AVX
+    #define TRIS_SIMD_ISECT
+    #define TRIS_SIMD_WIDTH 4
 #endif
 
-#define RAND_HARDWARE
-
-#define MIN_PRIMS_PER_LEAF 8
+// Leaves hold at least one full triangle packet
+#ifdef TRIS_SIMD_ISECT
+    #define MIN_PRIMS_PER_LEAF TRIS_SIMD_WIDTH
+#else
+    #define MIN_PRIMS_PER_LEAF 8
+#endif
 #define NUM_SAH_SPLITS 16
 #define BVH_TRAV_COST Real(0.25)
+// The BVH builders switch to median splits where a subtree could get deeper
+// than this, which bounds the traversal stacks
+#define BVH_MAX_DEPTH 64
+
+// Use the binned SAH builder instead of evaluating each split plane separately
+#define BVH_BINNED_BUILDER
+// BVH nodes with at least this many items build their children in parallel tasks
+#define MIN_PRIMS_PER_BUILD_TASK 4096
+// Build the mesh BVHs with spatial splits (SBVH), the triangles straddling
+// a split plane are referenced by both children. Helps scenes with large
+// or elongated triangles. The scene BVH still partitions the instances
+//#define BVH_SPATIAL_SPLITS
+// The spatial splits add at most this fraction of the triangles as references
+#define SBVH_MAX_DUPLICATION Real(0.3)
+// Only try spatial splits when the children of the best object split overlap
+// by more than this fraction of the mesh bounds area
+#define SBVH_MIN_OVERLAP Real(1e-5)
+// Moving instances refits the scene BVH, it is rebuilt once its SAH cost
+// grows past this many times its cost when it was built
+#define BVH_REBUILD_SAH_RATIO Real(1.5)
+// Levels of nested instancing the traversals support. An instance of a mesh
+// is one level, an instance of a group of mesh instances two
+#define MAX_INSTANCE_DEPTH 4
+// Collapse the binary BVHs into BVHs with this many children per node for
+// traversal, 4 uses SSE and 8 uses AVX. Undefine to traverse the binary BVHs
+#define BVH_WIDTH 4
+
+// Quantize the child bounds of the binary BVH nodes to this many bits, 8 or
+// 16, relative to the bounds of the node. The nodes shrink from 64 bytes to
+// 20 or 32 bytes. Only used by the binary BVH traversal
+//#define BVH_QUANTIZED_BITS 8
+
+#if BVH_MAX_DEPTH < 32
+    #error "BVH_MAX_DEPTH must be at least 32 to split any number of items"
+#endif
+
+#if defined(BVH_QUANTIZED_BITS) && defined(BVH_WIDTH)
+    #error "BVH_QUANTIZED_BITS requires the binary BVH traversal, undefine BVH_WIDTH"
+#endif
+
+#if defined(BVH_QUANTIZED_BITS) && BVH_QUANTIZED_BITS != 8 && BVH_QUANTIZED_BITS != 16
+    #error "BVH_QUANTIZED_BITS must be 8 or 16"
+#endif
+
+#if defined(BVH_WIDTH) && BVH_WIDTH == 8 && !defined(__AVX__)
+    #error "BVH_WIDTH 8 requires AVX"
+#endif
+
+#if defined(TRIS_SIMD_ISECT) && TRIS_SIMD_WIDTH == 8 && !defined(__AVX__)
+    #error "TRIS_SIMD_WIDTH 8 requires AVX"
+#endif
+
+// Number of rays traversing the BVH together in the stream intersection functions
+#define RAY_PACKET_SIZE 8
+
 #define NUM_AO_RAYS 5
 
 #define TILES_SPIRAL
 
+// The interactive display is refreshed at most this many times per second
+#define MAX_DISPLAY_FPS 30
+
+// Number of entries of the tabulated pixel filter profiles
+#define FILTER_TABLE_SIZE 64
+// Largest footprint of a pixel filter, in pixels
+#define MAX_FILTER_RADIUS 4.0f
+
 #define AO_BACKGROUND Spectrum(0.0f, 0.0f, 0.0f)
 
 #define likely(x) __builtin_expect(!!(x),1)
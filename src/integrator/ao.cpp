@@ -8,6 +8,7 @@
 #include "geometry/interaction.h"
 #include "geometry/world.h"
 #include "sampler/sampling.h"
+#include "sampler/sampler.h"
 
 namespace hop {
 
@@ -16,7 +17,7 @@ AmbientOcclusionIntegrator::AmbientOcclusionIntegrator(std::shared_ptr<World> wo
 {
 }
 
-Spectrum AmbientOcclusionIntegrator::Li(const Ray& ray) const
+Spectrum AmbientOcclusionIntegrator::Li(const Ray& ray, Sampler& sampler) const
 {
     SurfaceInteraction isect;
     HitInfo hit;
@@ -26,24 +27,26 @@ Spectrum AmbientOcclusionIntegrator::Li(const Ray& ray) const
     m_world->get_surface_interaction(hit, &isect);
     Vec3f n = isect.normal;
 
-    float occlusion_amount = 1.0f;
-    const float occlusion_step = 1.0f / (float)NUM_AO_RAYS;
-
+    // The occlusion rays share their origin, trace them together
+    Ray occlusion_rays[NUM_AO_RAYS];
+    HitInfo occlusion_hits[NUM_AO_RAYS];
     for (int i = 0; i < NUM_AO_RAYS; ++i)
     {
-        Vec3f random_dir = sample::uniform_sample_hemisphere(random<float>(), random<float>());
+        const Vec2f u = sampler.get_2d();
+        Vec3f random_dir = sample::uniform_sample_hemisphere(u.x, u.y);
         if (dot(random_dir, n) < 0.0f)
             random_dir = -random_dir;
 
-        Ray occlusion_ray;
+        Ray& occlusion_ray = occlusion_rays[i];
         occlusion_ray.dir = normalize(Vec3r(random_dir));
         occlusion_ray.org = isect.position;
         occlusion_ray.tmin = m_ray_epsilon;
         occlusion_ray.tmax = RAY_TFAR;
-        HitInfo occlusion_hit;
-        if (m_world->intersect_any(occlusion_ray, &occlusion_hit))
-            occlusion_amount -= occlusion_step;
     }
+
+    const size_t num_occluded = m_world->intersect_any_stream(occlusion_rays, occlusion_hits, NUM_AO_RAYS);
+    const float occlusion_amount = 1.0f - (float)num_occluded / (float)NUM_AO_RAYS;
+
     return Spectrum(1.0f) * occlusion_amount;
 }
 
@@ -8,7 +8,7 @@ class AmbientOcclusionIntegrator : public Integrator
 {
 public:
     AmbientOcclusionIntegrator(std::shared_ptr<World> world, float ray_eps);
-    Spectrum Li(const Ray& ray) const override;
+    Spectrum Li(const Ray& ray, Sampler& sampler) const override;
 };
 
 } // namespace hop
@@ -11,7 +11,7 @@ DebugIntegrator::DebugIntegrator(std::shared_ptr<World> world, float ray_eps, Ty
 {
 }
 
-Spectrum DebugIntegrator::Li(const Ray& ray) const
+Spectrum DebugIntegrator::Li(const Ray& ray, Sampler&) const
 {
     HitInfo hit;
     SurfaceInteraction isect;
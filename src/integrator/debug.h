@@ -15,7 +15,7 @@ public:
     };
 
     DebugIntegrator(std::shared_ptr<World> world, float ray_eps, Type type);
-    Spectrum Li(const Ray& ray) const override;
+    Spectrum Li(const Ray& ray, Sampler& sampler) const override;
 
 private:
     Type m_type;
@@ -1,5 +1,8 @@
 #include "integrator/integrator.h"
 #include "geometry/world.h"
+#include "geometry/ray.h"
+#include "spectrum/spectrum.h"
+#include "sampler/sampler.h"
 
 #include <memory>
 
@@ -15,4 +18,14 @@ void Integrator::set_world(std::shared_ptr<World> world)
     m_world = world;
 }
 
+void Integrator::Li_stream(const Ray* rays, const PixelSample* samples, Spectrum* radiance,
+                           size_t n, Sampler& sampler) const
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        sampler.start_pixel_sample(samples[i]);
+        radiance[i] = Li(rays[i], sampler);
+    }
+}
+
 } // namespace hop
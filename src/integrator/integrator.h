@@ -2,8 +2,10 @@
 
 #include "geometry/world.h"
 #include "spectrum/spectrum.h"
+#include "sampler/sampler.h"
 
 #include <memory>
+#include <cstddef>
 
 namespace hop {
 
@@ -14,8 +16,19 @@ class Integrator
 public:
     Integrator(std::shared_ptr<World> world, float ray_epsilon);
 
-    // Sample the incident radiance along a ray.
-    virtual Spectrum Li(const Ray& ray) const = 0;
+    // Sample the incident radiance along a ray. The random numbers are
+    // drawn from the sampler, already started on the ray's pixel sample.
+    virtual Spectrum Li(const Ray& ray, Sampler& sampler) const = 0;
+
+    // Sample the incident radiance along n rays. This calls Li for each
+    // ray unless the integrator traces its paths together.
+    // samples[i] is the pixel sample that generated rays[i], with the
+    // dimension reached after generating the camera ray.
+    virtual void Li_stream(const Ray* rays, const PixelSample* samples, Spectrum* radiance,
+                           size_t n, Sampler& sampler) const;
+
+    // Wavefront integrators want to receive whole tiles through Li_stream
+    virtual bool is_wavefront() const { return false; }
 
     void set_world(std::shared_ptr<World> world);
 
@@ -8,6 +8,7 @@
 #include "geometry/interaction.h"
 #include "geometry/world.h"
 #include "sampler/sampling.h"
+#include "sampler/sampler.h"
 #include "spectrum/spectrum.h"
 
 namespace hop {
@@ -24,7 +25,7 @@ static float fresnel(float costheta1, float costheta2, float n1, float n2)
     return (sqr(rp) + sqr(rs)) * 0.5f;
 }
 
-Spectrum PathIntegrator::Li(const Ray& r) const
+Spectrum PathIntegrator::Li(const Ray& r, Sampler& sampler) const
 {
     Spectrum rad(0.0f);
     Spectrum throughput(1.0f);
@@ -50,7 +51,8 @@ Spectrum PathIntegrator::Li(const Ray& r) const
         Vec3f ray_dir = Vec3f(ray.dir);
         if (mat == 0)
         {
-            ray_dir = sample::cosine_sample_hemisphere(random<float>(), random<float>());
+            const Vec2f u = sampler.get_2d();
+            ray_dir = sample::cosine_sample_hemisphere(u.x, u.y);
             if (dot(ray_dir, n) < 0.0f)
                 ray_dir = -ray_dir;
             brdf = Spectrum(0.9f, 0.7f, 0.4f) * (float)one_over_pi;
@@ -71,7 +73,7 @@ Spectrum PathIntegrator::Li(const Ray& r) const
             float n2 = n_dot_dir < 0.0f ? 1.5f : 1.0f;
             Vec3f refract_dir = refract(ray_dir, n, n1 * rcp(n2));
             float fresnel_coeff = fresnel(abs(n_dot_dir), abs(dot(refract_dir, n)), n1, n2);
-            if (random<float>() < fresnel_coeff)
+            if (sampler.get_1d() < fresnel_coeff)
             {
                 ray_dir = reflect(ray_dir, n);
                 if (n_dot_dir > 0.0f && dot(ray_dir, n) < 0.0f)
@@ -97,7 +99,7 @@ Spectrum PathIntegrator::Li(const Ray& r) const
         if (depth > 3)
         {
             const float absorption = 0.2f;
-            if (random<float>() > (1.0f - absorption))
+            if (sampler.get_1d() > (1.0f - absorption))
                 break;
             throughput *= rcp(1.0f - absorption);
         }
@@ -0,0 +1,211 @@
+#include "hop.h"
+#include "types.h"
+#include "integrator/wavefront.h"
+#include "math/math.h"
+#include "math/vec3.h"
+#include "geometry/ray.h"
+#include "geometry/hit_info.h"
+#include "geometry/interaction.h"
+#include "geometry/world.h"
+#include "sampler/sampling.h"
+#include "sampler/sampler.h"
+#include "spectrum/spectrum.h"
+
+#include <vector>
+
+namespace hop {
+
+static const Spectrum SKY_RADIANCE = Spectrum(1.0f);
+static const Spectrum DIFFUSE_ALBEDO = Spectrum(0.9f, 0.7f, 0.4f);
+
+WavefrontPathIntegrator::WavefrontPathIntegrator(std::shared_ptr<World> world, float ray_eps)
+    : Integrator(world, ray_eps)
+{
+}
+
+void WavefrontPathIntegrator::PathPool::resize(size_t n)
+{
+    rays.resize(n);
+    hits.resize(n);
+    throughput.resize(n);
+    depth.resize(n);
+    samples.resize(n);
+    live.resize(n);
+    sorted.resize(n);
+    queue_rays.resize(n);
+    queue_hits.resize(n);
+    shadow_rays.resize(n);
+    shadow_contribs.resize(n);
+    shadow_paths.resize(n);
+}
+
+Spectrum WavefrontPathIntegrator::Li(const Ray& ray, Sampler& sampler) const
+{
+    const PixelSample sample = sampler.get_pixel_sample();
+    Spectrum radiance;
+    Li_stream(&ray, &sample, &radiance, 1, sampler);
+    return radiance;
+}
+
+void WavefrontPathIntegrator::Li_stream(const Ray* rays, const PixelSample* samples, Spectrum* radiance,
+                                        size_t n, Sampler& sampler) const
+{
+    // The pool is kept per thread so its buffers are only allocated once
+    static thread_local PathPool pool;
+
+    generate(&pool, rays, samples, radiance, n);
+    while (!pool.live.empty())
+    {
+        extend(&pool);
+        shade(&pool, radiance, sampler);
+        shadow(&pool, radiance);
+    }
+}
+
+// Start one path per camera ray
+void WavefrontPathIntegrator::generate(PathPool* pool, const Ray* rays, const PixelSample* samples,
+                                       Spectrum* radiance, size_t n) const
+{
+    if (pool->rays.size() < n)
+        pool->resize(n);
+
+    pool->live.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        pool->rays[i] = rays[i];
+        pool->throughput[i] = Spectrum(1.0f);
+        pool->depth[i] = 0;
+        pool->samples[i] = samples[i];
+        pool->live[i] = i;
+        radiance[i] = Spectrum(0.0f);
+    }
+}
+
+// Sort the live paths by ray direction octant and origin octant, relative to
+// the center of the origins, then trace them as one stream
+void WavefrontPathIntegrator::extend(PathPool* pool) const
+{
+    const size_t num_live = pool->live.size();
+
+    Vec3r center(0, 0, 0);
+    for (auto p : pool->live)
+        center += pool->rays[p].org;
+    center = center * rcp((Real)num_live);
+
+    auto octant = [&](uint32 p)
+    {
+        const Ray& ray = pool->rays[p];
+        return (ray.dir.x < 0 ? 1 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 4 : 0) |
+               (ray.org.x < center.x ? 8 : 0) | (ray.org.y < center.y ? 16 : 0) | (ray.org.z < center.z ? 32 : 0);
+    };
+
+    // Counting sort on the 64 octant combinations
+    uint32 offsets[64 + 1] = { 0 };
+    for (auto p : pool->live)
+        ++offsets[octant(p) + 1];
+    for (uint32 i = 0; i < 64; ++i)
+        offsets[i + 1] += offsets[i];
+
+    pool->sorted.resize(num_live);
+    for (auto p : pool->live)
+        pool->sorted[offsets[octant(p)]++] = p;
+
+    for (size_t i = 0; i < num_live; ++i)
+        pool->queue_rays[i] = pool->rays[pool->sorted[i]];
+
+    m_world->intersect_stream(&pool->queue_rays[0], &pool->queue_hits[0], num_live);
+
+    for (size_t i = 0; i < num_live; ++i)
+        pool->hits[pool->sorted[i]] = pool->queue_hits[i];
+
+    pool->live.swap(pool->sorted);
+}
+
+// Shade the hits: sample the shadow ray towards the sky and the next
+// direction, terminate the paths that escaped or didn't survive the roulette
+void WavefrontPathIntegrator::shade(PathPool* pool, Spectrum* radiance, Sampler& sampler) const
+{
+    size_t num_live = 0;
+    size_t num_shadow = 0;
+
+    for (auto p : pool->live)
+    {
+        const HitInfo& hit = pool->hits[p];
+        if (hit.primitive_id < 0)
+        {
+            // The sky was already accounted for by the shadow rays
+            if (pool->depth[p] == 0)
+                radiance[p] += pool->throughput[p] * SKY_RADIANCE;
+            continue;
+        }
+
+        SurfaceInteraction isect;
+        m_world->get_surface_interaction(hit, &isect);
+        const Vec3f n = isect.normal;
+
+        // Continue the path's sample dimensions where the previous bounce left them
+        sampler.start_pixel_sample(pool->samples[p]);
+
+        // Lambertian surface with cosine sampling, brdf * cos / pdf is the albedo
+        const Vec2f u_shadow = sampler.get_2d();
+        Vec3f shadow_dir = sample::cosine_sample_hemisphere(u_shadow.x, u_shadow.y);
+        if (dot(shadow_dir, n) < 0.0f)
+            shadow_dir = -shadow_dir;
+
+        Ray& shadow_ray = pool->shadow_rays[num_shadow];
+        shadow_ray.dir = normalize(Vec3r(shadow_dir));
+        shadow_ray.org = isect.position;
+        shadow_ray.tmin = m_ray_epsilon;
+        shadow_ray.tmax = RAY_TFAR;
+        pool->shadow_contribs[num_shadow] = pool->throughput[p] * DIFFUSE_ALBEDO * SKY_RADIANCE;
+        pool->shadow_paths[num_shadow] = p;
+        ++num_shadow;
+
+        const Vec2f u_dir = sampler.get_2d();
+        Vec3f ray_dir = sample::cosine_sample_hemisphere(u_dir.x, u_dir.y);
+        if (dot(ray_dir, n) < 0.0f)
+            ray_dir = -ray_dir;
+
+        Ray& ray = pool->rays[p];
+        ray.dir = normalize(Vec3r(ray_dir));
+        ray.org = isect.position;
+        ray.tmin = m_ray_epsilon;
+        ray.tmax = RAY_TFAR;
+
+        pool->throughput[p] *= DIFFUSE_ALBEDO;
+
+        // Russian roulette
+        if (++pool->depth[p] > 3)
+        {
+            const float absorption = 0.2f;
+            if (sampler.get_1d() > (1.0f - absorption))
+                continue;
+            pool->throughput[p] *= rcp(1.0f - absorption);
+        }
+        pool->samples[p].dimension = sampler.get_dimension();
+
+        // Compact the live paths in place
+        pool->live[num_live++] = p;
+    }
+
+    pool->live.resize(num_live);
+    pool->shadow_rays.resize(num_shadow);
+}
+
+// Trace the shadow rays as one stream and add the contribution of the unoccluded ones
+void WavefrontPathIntegrator::shadow(PathPool* pool, Spectrum* radiance) const
+{
+    const size_t num_shadow = pool->shadow_rays.size();
+    if (num_shadow > 0)
+    {
+        m_world->intersect_any_stream(&pool->shadow_rays[0], &pool->queue_hits[0], num_shadow);
+
+        for (size_t i = 0; i < num_shadow; ++i)
+            if (pool->queue_hits[i].primitive_id < 0)
+                radiance[pool->shadow_paths[i]] += pool->shadow_contribs[i];
+    }
+
+    pool->shadow_rays.resize(pool->rays.size());
+}
+
+} // namespace hop
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "integrator/integrator.h"
+#include "geometry/ray.h"
+#include "geometry/hit_info.h"
+#include "spectrum/spectrum.h"
+#include "sampler/sampler.h"
+
+#include <vector>
+
+namespace hop {
+
+// Path tracer that advances a whole pool of paths one bounce at a time
+// instead of following each path to the end. Each bounce runs in stages:
+//   extend: the rays of the live paths are sorted by octant and traced together
+//   shade:  the hits are shaded, new directions and shadow rays are sampled
+//   shadow: the shadow rays are traced together and the unoccluded ones contribute
+// The sky is the only emitter, it is sampled explicitly by the shadow rays so
+// the paths that escape only contribute when they come straight from the camera.
+class WavefrontPathIntegrator : public Integrator
+{
+public:
+    WavefrontPathIntegrator(std::shared_ptr<World> world, float ray_eps);
+
+    Spectrum Li(const Ray& ray, Sampler& sampler) const override;
+    void Li_stream(const Ray* rays, const PixelSample* samples, Spectrum* radiance,
+                   size_t n, Sampler& sampler) const override;
+    bool is_wavefront() const override { return true; }
+
+private:
+    // Paths data as SoA, indexed by path
+    struct PathPool
+    {
+        std::vector<Ray> rays;
+        std::vector<HitInfo> hits;
+        std::vector<Spectrum> throughput;
+        std::vector<uint32> depth;
+
+        // Pixel sample of each path, the sampler is restarted on it to shade the path
+        std::vector<PixelSample> samples;
+
+        // Indices of the live paths, and the same indices sorted by octant
+        std::vector<uint32> live;
+        std::vector<uint32> sorted;
+
+        // Rays and hits gathered in the sorted order for the stream calls
+        std::vector<Ray> queue_rays;
+        std::vector<HitInfo> queue_hits;
+
+        // Shadow rays and the radiance they carry if they are not occluded
+        std::vector<Ray> shadow_rays;
+        std::vector<Spectrum> shadow_contribs;
+        std::vector<uint32> shadow_paths;
+
+        void resize(size_t n);
+    };
+
+    void generate(PathPool* pool, const Ray* rays, const PixelSample* samples, Spectrum* radiance, size_t n) const;
+    void extend(PathPool* pool) const;
+    void shade(PathPool* pool, Spectrum* radiance, Sampler& sampler) const;
+    void shadow(PathPool* pool, Spectrum* radiance) const;
+};
+
+} // namespace hop
@@ -0,0 +1,282 @@
+#include "loaders/mesh_cache.h"
+#include "material/material_manager.h"
+#include "util/file_util.h"
+#include "util/log.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace hop {
+
+// Bump when the layout of the file or of bvh::Node changes
+static const uint32 MESH_CACHE_VERSION = 4;
+static const char MESH_CACHE_MAGIC[8] = { 'H', 'O', 'P', 'M', 'E', 'S', 'H', 0 };
+
+// The sections start on cache line boundaries, the nodes can be used in place
+static const uint64 SECTION_ALIGNMENT = 64;
+
+#if defined(BVH_SPATIAL_SPLITS)
+static const uint32 BVH_BUILDER_ID = 2;
+#elif defined(BVH_BINNED_BUILDER)
+static const uint32 BVH_BUILDER_ID = 1;
+#else
+static const uint32 BVH_BUILDER_ID = 0;
+#endif
+
+// Spatial split parameters the mesh BVHs are built with
+#ifdef BVH_SPATIAL_SPLITS
+static const Real SPATIAL_SPLIT_PARAMS[2] = { SBVH_MAX_DUPLICATION, SBVH_MIN_OVERLAP };
+#else
+static const Real SPATIAL_SPLIT_PARAMS[2] = { 0, 0 };
+#endif
+
+struct MeshCacheHeader
+{
+    char magic[8];
+    uint32 version;
+    uint32 real_size;
+    uint32 node_size;
+    uint32 min_prims_per_leaf;
+    uint32 num_sah_splits;
+    uint32 builder;
+    Real spatial_split_params[2];
+    uint64 source_hash;
+    uint64 file_size;
+
+    uint32 num_triangles;
+    uint32 num_vertices;
+    uint32 num_nodes;
+    uint32 max_depth;
+    uint32 num_materials;
+    Real bbox_min[3];
+    Real bbox_max[3];
+
+    uint64 nodes_offset;
+    uint64 vertices_offset;
+    uint64 normals_offset;
+    uint64 uvs_offset;
+    uint64 indices_offset;
+    uint64 materials_offset;
+    uint64 names_offset;
+};
+
+static uint64 align_offset(uint64 offset)
+{
+    return (offset + SECTION_ALIGNMENT - 1) & ~(SECTION_ALIGNMENT - 1);
+}
+
+// Set the build parameters and the section offsets of a cache holding
+// the given number of triangles, vertices and nodes
+static void layout_header(MeshCacheHeader* header, uint32 num_triangles, uint32 num_vertices,
+                          uint32 num_nodes, uint64 names_size)
+{
+    std::memset(header, 0, sizeof(MeshCacheHeader));
+    std::memcpy(header->magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+    header->version = MESH_CACHE_VERSION;
+    header->real_size = sizeof(Real);
+    header->node_size = sizeof(bvh::Node);
+    header->min_prims_per_leaf = MIN_PRIMS_PER_LEAF;
+    header->num_sah_splits = NUM_SAH_SPLITS;
+    header->builder = BVH_BUILDER_ID;
+    std::memcpy(header->spatial_split_params, SPATIAL_SPLIT_PARAMS, sizeof(SPATIAL_SPLIT_PARAMS));
+    header->num_triangles = num_triangles;
+    header->num_vertices = num_vertices;
+    header->num_nodes = num_nodes;
+
+    header->nodes_offset = align_offset(sizeof(MeshCacheHeader));
+    header->vertices_offset = align_offset(header->nodes_offset + (uint64)num_nodes * sizeof(bvh::Node));
+    header->normals_offset = align_offset(header->vertices_offset + (uint64)num_vertices * sizeof(Vec3f));
+    header->uvs_offset = align_offset(header->normals_offset + (uint64)num_vertices * sizeof(Vec3f));
+    header->indices_offset = align_offset(header->uvs_offset + (uint64)num_vertices * sizeof(Vec2f));
+    header->materials_offset = align_offset(header->indices_offset + 3 * (uint64)num_triangles * sizeof(uint32));
+    header->names_offset = align_offset(header->materials_offset + (uint64)num_triangles * sizeof(uint32));
+    header->file_size = header->names_offset + names_size;
+}
+
+std::string MeshCache::get_cache_file(const std::string& source_file)
+{
+    return remove_extension(source_file) + ".hopmesh";
+}
+
+MeshCache::MeshCache(std::unique_ptr<MappedFile> file)
+    : m_file(std::move(file))
+{
+    const char* data = m_file->data();
+    const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(data);
+
+    m_num_triangles = header->num_triangles;
+    m_num_vertices = header->num_vertices;
+    m_num_nodes = header->num_nodes;
+    m_max_depth = header->max_depth;
+    m_bbox = BBoxr(Vec3r(header->bbox_min[0], header->bbox_min[1], header->bbox_min[2]),
+                   Vec3r(header->bbox_max[0], header->bbox_max[1], header->bbox_max[2]));
+    m_nodes = reinterpret_cast<const bvh::Node*>(data + header->nodes_offset);
+    m_vertices = reinterpret_cast<const Vec3f*>(data + header->vertices_offset);
+    m_normals = reinterpret_cast<const Vec3f*>(data + header->normals_offset);
+    m_uvs = reinterpret_cast<const Vec2f*>(data + header->uvs_offset);
+    m_indices = reinterpret_cast<const uint32*>(data + header->indices_offset);
+    m_material_indices = reinterpret_cast<const uint32*>(data + header->materials_offset);
+}
+
+std::shared_ptr<MeshCache> MeshCache::open(const std::string& cache_file, uint64 source_hash)
+{
+    if (!file_exists(cache_file))
+        return nullptr;
+
+    std::unique_ptr<MappedFile> file;
+    try
+    {
+        file.reset(new MappedFile(cache_file));
+    }
+    catch (const IOError&)
+    {
+        return nullptr;
+    }
+
+    if (file->size() < sizeof(MeshCacheHeader))
+        return nullptr;
+
+    MeshCacheHeader header;
+    std::memcpy(&header, file->data(), sizeof(MeshCacheHeader));
+
+    // The header must match the one this build would write for the same counts
+    MeshCacheHeader expected;
+    layout_header(&expected, header.num_triangles, header.num_vertices, header.num_nodes, 0);
+    if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+        header.version != expected.version ||
+        header.real_size != expected.real_size ||
+        header.node_size != expected.node_size ||
+        header.min_prims_per_leaf != expected.min_prims_per_leaf ||
+        header.num_sah_splits != expected.num_sah_splits ||
+        header.builder != expected.builder ||
+        std::memcmp(header.spatial_split_params, expected.spatial_split_params, sizeof(SPATIAL_SPLIT_PARAMS)) != 0 ||
+        header.names_offset != expected.names_offset ||
+        header.file_size != file->size() ||
+        header.file_size < header.names_offset ||
+        header.max_depth > BVH_MAX_DEPTH)
+    {
+        Log("mesh_cache") << INFO << cache_file << " was written with other build parameters, ignoring it";
+        return nullptr;
+    }
+
+    if (header.source_hash != source_hash)
+    {
+        Log("mesh_cache") << INFO << cache_file << " is out of date, ignoring it";
+        return nullptr;
+    }
+
+    // Material names, each one preceded by its length
+    std::vector<std::string> names;
+    const char* p = file->data() + header.names_offset;
+    const char* end = file->data() + header.file_size;
+    for (uint32 i = 0; i < header.num_materials; ++i)
+    {
+        uint32 length;
+        if (end - p < (ptrdiff_t)sizeof(uint32))
+            return nullptr;
+        std::memcpy(&length, p, sizeof(uint32));
+        p += sizeof(uint32);
+        if ((uint64)(end - p) < length)
+            return nullptr;
+        names.emplace_back(p, length);
+        p += length;
+    }
+
+    std::shared_ptr<MeshCache> cache(new MeshCache(std::move(file)));
+
+    for (uint32 t = 0; t < cache->m_num_triangles; ++t)
+        if (cache->m_material_indices[t] >= names.size())
+            return nullptr;
+    for (uint64 i = 0; i < 3 * (uint64)cache->m_num_triangles; ++i)
+        if (cache->m_indices[i] >= cache->m_num_vertices)
+            return nullptr;
+
+    for (const std::string& name : names)
+        cache->m_materials.push_back(MaterialManager::get(MaterialManager::create(name)));
+
+    return cache;
+}
+
+bool MeshCache::write(const std::string& cache_file, uint64 source_hash, const BBoxr& bbox,
+                      const std::vector<bvh::Node>& nodes, uint32 max_depth, uint32 num_triangles, uint32 num_vertices,
+                      const Vec3f* vertices, const Vec3f* normals, const Vec2f* uvs,
+                      const uint32* indices, Material* const* materials)
+{
+    // The materials are stored by name, in order of first use
+    std::map<Material*, uint32> material_indices;
+    std::vector<uint32> triangle_materials(num_triangles);
+    std::vector<char> names;
+    for (uint32 t = 0; t < num_triangles; ++t)
+    {
+        auto it = material_indices.find(materials[t]);
+        if (it == material_indices.end())
+        {
+            const std::string& name = materials[t]->get_name();
+            const uint32 length = name.size();
+            names.insert(names.end(), (const char*)&length, (const char*)&length + sizeof(uint32));
+            names.insert(names.end(), name.begin(), name.end());
+            it = material_indices.emplace(materials[t], (uint32)material_indices.size()).first;
+        }
+        triangle_materials[t] = it->second;
+    }
+
+    MeshCacheHeader header;
+    layout_header(&header, num_triangles, num_vertices, nodes.size(), names.size());
+    header.source_hash = source_hash;
+    header.max_depth = max_depth;
+    header.num_materials = material_indices.size();
+    for (uint32 i = 0; i < 3; ++i)
+    {
+        header.bbox_min[i] = bbox.pmin[i];
+        header.bbox_max[i] = bbox.pmax[i];
+    }
+
+    // Write to a temporary file first so a partial cache is never picked up
+    const std::string tmp_file = cache_file + ".tmp";
+    FILE* file = fopen(tmp_file.c_str(), "wb");
+    if (!file)
+    {
+        Log("mesh_cache") << WARNING << "cannot open " << tmp_file << " for writing";
+        return false;
+    }
+
+    const std::pair<uint64, std::pair<const void*, uint64>> sections[] =
+    {
+        { 0, { &header, sizeof(MeshCacheHeader) } },
+        { header.nodes_offset, { nodes.data(), nodes.size() * sizeof(bvh::Node) } },
+        { header.vertices_offset, { vertices, (uint64)num_vertices * sizeof(Vec3f) } },
+        { header.normals_offset, { normals, (uint64)num_vertices * sizeof(Vec3f) } },
+        { header.uvs_offset, { uvs, (uint64)num_vertices * sizeof(Vec2f) } },
+        { header.indices_offset, { indices, 3 * (uint64)num_triangles * sizeof(uint32) } },
+        { header.materials_offset, { triangle_materials.data(), (uint64)num_triangles * sizeof(uint32) } },
+        { header.names_offset, { names.data(), names.size() } }
+    };
+
+    static const char zeros[SECTION_ALIGNMENT] = { 0 };
+    uint64 offset = 0;
+    bool ok = true;
+    for (const auto& section : sections)
+    {
+        ok = ok && fwrite(zeros, 1, section.first - offset, file) == section.first - offset;
+        ok = ok && fwrite(section.second.first, 1, section.second.second, file) == section.second.second;
+        offset = section.first + section.second.second;
+    }
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || std::rename(tmp_file.c_str(), cache_file.c_str()) != 0)
+    {
+        Log("mesh_cache") << WARNING << "error writing " << cache_file;
+        std::remove(tmp_file.c_str());
+        return false;
+    }
+
+    Log("mesh_cache") << INFO << "wrote " << cache_file;
+    return true;
+}
+
+} // namespace hop
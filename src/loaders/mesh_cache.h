@@ -0,0 +1,75 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "accel/bvh_node.h"
+#include "material/material.h"
+#include "math/bbox.h"
+#include "math/vec2.h"
+#include "math/vec3.h"
+#include "util/mapped_file.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace hop {
+
+// Binary cache of a mesh ready to be rendered, stored next to its source
+// file: the vertices, the vertex indices of the triangles in BVH leaf order
+// and the BVH nodes of the mesh. With spatial splits a triangle can be
+// stored once per leaf that references it. The node children, the leaf triangle ranges
+// and the vertex indices are relative to the mesh.
+// The cache is memory mapped and only valid for the source file it was
+// written from and for the BVH build parameters of this build.
+class MeshCache
+{
+public:
+    // Name of the cache file of a source file
+    static std::string get_cache_file(const std::string& source_file);
+
+    // Map the cache file, returns null if it doesn't exist, is stale or
+    // was written with other build parameters
+    static std::shared_ptr<MeshCache> open(const std::string& cache_file, uint64 source_hash);
+
+    // Write a cache file, there are 3 indices and one material per triangle.
+    // max_depth is the depth of the BVH. Returns false if the file can't be written.
+    static bool write(const std::string& cache_file, uint64 source_hash, const BBoxr& bbox,
+                      const std::vector<bvh::Node>& nodes, uint32 max_depth, uint32 num_triangles, uint32 num_vertices,
+                      const Vec3f* vertices, const Vec3f* normals, const Vec2f* uvs,
+                      const uint32* indices, Material* const* materials);
+
+    uint32 get_num_triangles() const { return m_num_triangles; }
+    uint32 get_num_vertices() const { return m_num_vertices; }
+    uint32 get_num_nodes() const { return m_num_nodes; }
+    uint32 get_max_depth() const { return m_max_depth; }
+    const BBoxr& get_bbox() const { return m_bbox; }
+
+    const bvh::Node* get_nodes() const { return m_nodes; }
+    const Vec3f* get_vertices() const { return m_vertices; }
+    const Vec3f* get_normals() const { return m_normals; }
+    const Vec2f* get_uvs() const { return m_uvs; }
+    const uint32* get_indices() const { return m_indices; }
+
+    // Material of a triangle, the materials are created when the cache is opened
+    Material* get_material(uint32 triangle) const { return m_materials[m_material_indices[triangle]]; }
+
+private:
+    explicit MeshCache(std::unique_ptr<MappedFile> file);
+
+    std::unique_ptr<MappedFile> m_file;
+    uint32 m_num_triangles;
+    uint32 m_num_vertices;
+    uint32 m_num_nodes;
+    uint32 m_max_depth;
+    BBoxr m_bbox;
+    const bvh::Node* m_nodes;
+    const Vec3f* m_vertices;
+    const Vec3f* m_normals;
+    const Vec2f* m_uvs;
+    const uint32* m_indices;
+    const uint32* m_material_indices;
+    std::vector<Material*> m_materials;
+};
+
+} // namespace hop
@@ -1,7 +1,8 @@
 #include "obj.h"
 #include "types.h"
-#include "util/string_util.h"
 #include "util/file_util.h"
+#include "util/mapped_file.h"
+#include "util/stop_watch.h"
 #include "util/log.h"
 #include "math/vec2.h"
 #include "math/vec3.h"
@@ -11,25 +12,195 @@
 #include "geometry/triangle_mesh.h"
 #include "geometry/shape_manager.h"
 #include "material/material_manager.h"
+#include "loaders/mesh_cache.h"
+#include "math/hash.h"
 #include "except.h"
 
 #include <memory>
 #include <string>
-#include <fstream>
-#include <sstream>
 #include <vector>
+#include <cstring>
+#include <cstdint>
 
 namespace hop { namespace obj {
 
-std::vector<float> parse_floats(const std::vector<std::string>& vec)
+// The file is parsed in chunks of about this many bytes in parallel
+static const size_t CHUNK_SIZE = 4 << 20;
+
+// A face as written in the file. The indices start from 0, the ones that
+// were negative in the file are relative to the number of elements read
+// in the chunk before the face and are fixed up once all the chunks are read.
+struct Face
+{
+    int32 vertex[4];
+    int32 uv[4];
+    int32 normal[4];
+    uint8 num_vertices;
+    uint16 relative;    // bits i, 4 + i and 8 + i: the vertex, uv and normal indices of vertex i are relative
+    bool has_uvs;
+    bool has_normals;
+    int32 material;     // index in the chunk's materials, -1 keeps the previous one
+};
+
+// Marks a missing uv or normal index
+static const uint32 NO_INDEX = ~0u;
+
+// Everything read from a chunk of the file
+struct Chunk
+{
+    Chunk() : begin(nullptr), end(nullptr), num_lines(0), error_line(0) { }
+
+    const char* begin;
+    const char* end;
+    std::vector<Vec3f> vertices;
+    std::vector<Vec3f> normals;
+    std::vector<Vec2f> uvs;
+    std::vector<Face> faces;
+    std::vector<std::string> materials;
+    size_t num_lines;
+
+    std::string error;
+    size_t error_line;      // line of the error in the chunk
+};
+
+class ParseError
+{
+public:
+    explicit ParseError(const char* msg) : message(msg) { }
+    std::string message;
+};
+
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+inline const char* skip_spaces(const char* p, const char* end)
+{
+    while (p < end && is_space(*p))
+        ++p;
+    return p;
+}
+
+inline const char* skip_line(const char* p, const char* end)
+{
+    if (p >= end)
+        return end;
+    const char* eol = (const char*)std::memchr(p, '\n', (size_t)(end - p));
+    return eol ? eol : end;
+}
+
+// Parse a decimal floating point number without any allocation or locale.
+// The digits are accumulated in an integer and scaled by a power of 10 in
+// double precision before rounding to a float.
+const char* parse_float(const char* p, const char* end, float* out)
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    p = skip_spaces(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64 mantissa = 0;
+    int32 exponent = 0;
+    uint32 num_digits = 0;
+    const char* start = p;
+
+    // Digits past the 19th don't fit in the mantissa, they only scale it
+    for (; p < end && is_digit(*p); ++p)
+    {
+        if (num_digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa)
+                ++num_digits;
+        }
+        else
+        {
+            ++exponent;
+        }
+    }
+    if (p < end && *p == '.')
+    {
+        for (++p; p < end && is_digit(*p); ++p)
+        {
+            if (num_digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa)
+                    ++num_digits;
+                --exponent;
+            }
+        }
+    }
+    if (p == start || (p == start + 1 && *start == '.'))
+        throw ParseError("expected a number");
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        ++p;
+        bool negative_exp = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative_exp = *p++ == '-';
+        if (p == end || !is_digit(*p))
+            throw ParseError("expected an exponent");
+        int32 e = 0;
+        for (; p < end && is_digit(*p); ++p)
+            if (e < 10000)
+                e = e * 10 + (*p - '0');
+        exponent += negative_exp ? -e : e;
+    }
+
+    double value = (double)mantissa;
+    if (exponent < 0)
+    {
+        while (exponent < -22)
+        {
+            value /= 1e22;
+            exponent += 22;
+        }
+        value /= powers[-exponent];
+    }
+    else if (exponent > 0)
+    {
+        while (exponent > 22)
+        {
+            value *= 1e22;
+            exponent -= 22;
+        }
+        value *= powers[exponent];
+    }
+
+    *out = (float)(negative ? -value : value);
+    return p;
+}
+
+// Parse an index of a face. Indices start from 1 and may be negative to
+// indicate an offset off the end of the vertex/uv/normal list.
+const char* parse_index(const char* p, const char* end, int64* out)
 {
-    std::vector<float> out;
-    for (auto& v : vec)
-        out.push_back(std::stof(v));
-    return out;
+    bool negative = false;
+    if (p < end && *p == '-')
+    {
+        negative = true;
+        ++p;
+    }
+    if (p == end || !is_digit(*p))
+        throw ParseError("expected an index");
+
+    int64 n = 0;
+    for (; p < end && is_digit(*p); ++p)
+        n = n * 10 + (*p - '0');
+    if (n == 0 || n > INT32_MAX)
+        throw ParseError("invalid index");
+
+    *out = negative ? -n : n;
+    return p;
 }
 
-// Parse face definition. Each face definitions consists of 3 arguments,
+// Parse face definition. Each face definitions consists of 3 or 4 arguments,
 // one for each vertex. Each one of the vertex arguments is comprised of
 // 1, 2 or 3 args separated by a slash character. The following formats are
 // supported:
@@ -37,200 +208,384 @@ std::vector<float> parse_floats(const std::vector<std::string>& vec)
 //     vertex_index/uv_index
 //     vertex_index//normal_index
 //     vertex_index/uv_index/normal_index
-//
-// Indices start from 1 and may be negative to indicate
-// an offset off the end of the vertex/uv list
-uint32 parse_index(const std::string& s, size_t size)
+const char* parse_face(const char* p, const char* end, Chunk* chunk, int32 material)
 {
-    int n = 0;
-    try {
-        n = std::stoi(s) - 1;
-    } catch (...) { }
-    if (n < 0)
-        return uint32(int(size) + n);
-    else
-        return uint32(n);
-}
+    Face face;
+    face.num_vertices = 0;
+    face.relative = 0;
+    face.has_uvs = false;
+    face.has_normals = false;
+    face.material = material;
+    for (uint32 i = 0; i < 4; ++i)
+        face.uv[i] = face.normal[i] = 0;
+
+    for (;;)
+    {
+        p = skip_spaces(p, end);
+        if (p == end || *p == '\n' || *p == '#')
+            break;
 
-// Only works with triangular or quad faces and returns an error if a
-// face with more than 4 vertices is encountered.
-ShapeID load(const char* file)
-{
-    Log("obj") << INFO << "loading OBJ: " << file;
+        if (face.num_vertices == 4)
+            throw ParseError("expected 3 or 4 vertices per face");
+        const uint32 i = face.num_vertices++;
 
-    std::ifstream file_stream(file);
+        // Negative indices are made relative to the start of the chunk
+        auto resolve = [&](int64 index, size_t count, uint32 bit) -> int32
+        {
+            if (index > 0)
+                return (int32)(index - 1);
+            face.relative |= 1 << bit;
+            return (int32)((int64)count + index);
+        };
+
+        int64 index;
+        p = parse_index(p, end, &index);
+        face.vertex[i] = resolve(index, chunk->vertices.size(), i);
+
+        bool uv = false;
+        bool normal = false;
+        if (p < end && *p == '/')
+        {
+            ++p;
+            if (p < end && *p != '/')
+            {
+                p = parse_index(p, end, &index);
+                face.uv[i] = resolve(index, chunk->uvs.size(), 4 + i);
+                uv = true;
+            }
+            if (p < end && *p == '/')
+            {
+                ++p;
+                p = parse_index(p, end, &index);
+                face.normal[i] = resolve(index, chunk->normals.size(), 8 + i);
+                normal = true;
+            }
+        }
 
-    if (!file_stream.good())
-        throw Error("Can't open OBJ file: " + std::string(file));
+        if (face.has_uvs && !uv)
+            throw ParseError("expected uv coordinates");
+        if (face.has_normals && !normal)
+            throw ParseError("expected normal");
+        face.has_uvs |= uv;
+        face.has_normals |= normal;
+    }
 
-    std::vector<std::string> tokens(20);
+    if (face.num_vertices < 3)
+        throw ParseError("expected 3 or 4 vertices per face");
 
-    std::vector<Vec3f> vertices;
-    std::vector<Vec3f> normals;
-    std::vector<Vec2f> uvs;
-    std::vector<Triangle> triangles;
+    chunk->faces.push_back(face);
+    return p;
+}
 
-    MaterialID material_id = 0;
+// Parse the lines of a chunk, the chunk starts at the beginning of a line
+void parse_chunk(Chunk* chunk)
+{
+    const char* p = chunk->begin;
+    const char* end = chunk->end;
+    int32 material = -1;
+    chunk->num_lines = 0;
 
-    std::string mesh_name = "default";
+    try
+    {
+        while (p < end)
+        {
+            p = skip_spaces(p, end);
 
-    size_t line_num = 0;
+            if (p + 1 < end && p[0] == 'v' && is_space(p[1]))
+            {
+                Vec3f v;
+                p = parse_float(p + 1, end, &v.x);
+                p = parse_float(p, end, &v.y);
+                p = parse_float(p, end, &v.z);
+                chunk->vertices.push_back(v);
+            }
+            else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && is_space(p[2]))
+            {
+                Vec2f uv;
+                p = parse_float(p + 2, end, &uv.x);
+                p = parse_float(p, end, &uv.y);
+                chunk->uvs.push_back(uv);
+            }
+            else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && is_space(p[2]))
+            {
+                Vec3f n;
+                p = parse_float(p + 2, end, &n.x);
+                p = parse_float(p, end, &n.y);
+                p = parse_float(p, end, &n.z);
+                chunk->normals.push_back(n);
+            }
+            else if (p + 1 < end && p[0] == 'f' && is_space(p[1]))
+            {
+                p = parse_face(p + 1, end, chunk, material);
+            }
+            else if (end - p > 6 && std::strncmp(p, "usemtl", 6) == 0 && is_space(p[6]))
+            {
+                const char* name = skip_spaces(p + 6, end);
+                const char* name_end = skip_line(name, end);
+                while (name_end > name && is_space(name_end[-1]))
+                    --name_end;
+                material = (int32)chunk->materials.size();
+                chunk->materials.push_back(std::string(name, name_end));
+            }
+
+            // The rest of the line is ignored (comments, w coordinates, ...)
+            p = skip_line(p, end);
+            if (p < end)
+                ++p;
+            ++chunk->num_lines;
+        }
+    }
+    catch (const ParseError& e)
+    {
+        chunk->error = e.message;
+        chunk->error_line = chunk->num_lines;
+    }
+}
 
-    for (std::string line; std::getline(file_stream, line);)
+// Split the file in chunks starting at the beginning of a line
+std::vector<Chunk> split_chunks(const char* data, size_t size)
+{
+    std::vector<Chunk> chunks;
+    const char* end = data + size;
+    const char* p = data;
+    while (p < end)
     {
-        ++line_num;
-        std::stringstream line_stream(line);
-        tokens.clear();
-        std::string token;
-        while (line_stream >> token)
-            tokens.push_back(token);
+        Chunk chunk;
+        chunk.begin = p;
+        p = (size_t)(end - p) > CHUNK_SIZE ? skip_line(p + CHUNK_SIZE, end) : end;
+        if (p < end)
+            ++p;
+        chunk.end = p;
+        chunks.push_back(std::move(chunk));
+    }
+    return chunks;
+}
 
-        if (tokens.empty() || tokens[0][0] == '#')
-            continue;
+// Fold the corners of the triangles that share the same vertex, uv and normal
+// indices into a single mesh vertex. Returns the position, uv and normal
+// indices of the mesh vertices and sets the index of each corner.
+void index_vertices(const std::vector<uint32>& corner_vertices, const std::vector<uint32>& corner_uvs,
+                    const std::vector<uint32>& corner_normals, size_t num_positions,
+                    std::vector<uint32>* vertex_keys, std::vector<uint32>* indices)
+{
+    // The mesh vertices with the same position are chained in a list
+    std::vector<uint32> first_vertex(num_positions, NO_INDEX);
+    std::vector<uint32> next_vertex;
 
-        std::string keyword = tokens[0];
-        tokens.erase(tokens.begin());
+    indices->resize(corner_vertices.size());
+    for (size_t c = 0; c < corner_vertices.size(); ++c)
+    {
+        const uint32 vi = corner_vertices[c];
+        uint32 v = first_vertex[vi];
+        while (v != NO_INDEX && ((*vertex_keys)[3 * v + 1] != corner_uvs[c] || (*vertex_keys)[3 * v + 2] != corner_normals[c]))
+            v = next_vertex[v];
 
-        if (keyword == "usemtl")
-        {
-            material_id = MaterialManager::create(tokens[0]);
-        }
-        else if (keyword == "v")
+        if (v == NO_INDEX)
         {
-            auto f = parse_floats(tokens);
-            vertices.push_back(Vec3f(f[0], f[1], f[2]));
+            v = next_vertex.size();
+            vertex_keys->push_back(vi);
+            vertex_keys->push_back(corner_uvs[c]);
+            vertex_keys->push_back(corner_normals[c]);
+            next_vertex.push_back(first_vertex[vi]);
+            first_vertex[vi] = v;
         }
-        else if (keyword == "vt")
-        {
-            auto f = parse_floats(tokens);
-            uvs.push_back(Vec2f(f[0], f[1]));
-        }
-        else if (keyword == "vn")
-        {
-            auto f = parse_floats(tokens);
-            normals.push_back(Vec3f(f[0], f[1], f[2]));
-        }
-        else if (keyword == "f")
-        {
-            uint32 face_vert_idx[4] = { 0 };
-            uint32 face_norm_idx[4] = { 0 };
-            uint32 face_uv_idx[4] = { 0 };
+        (*indices)[c] = v;
+    }
+}
 
-            bool has_uvs = false;
-            bool has_normals = false;
+// The file is memory mapped and split in chunks that are parsed in parallel.
+// The faces refer to the vertices of all the chunks, the indices are fixed up
+// once the number of elements in each chunk is known. Only works with
+// triangular or quad faces and returns an error if a face with more than
+// 4 vertices is encountered.
+// When the mesh cache next to the file is up to date, the triangles and the
+// BVH are taken from the cache and the file is not parsed.
+ShapeID load(const char* file)
+{
+    Log("obj") << INFO << "loading OBJ: " << file;
 
-            if (tokens.size() > 4)
-                throw Error("Expected 3 or 4 arguments at line " + std::to_string(line_num) +
-                            " got " + std::to_string(tokens.size()));
+    StopWatch timer;
+    timer.start();
 
-            for (size_t i = 0; i < tokens.size(); ++i)
-            {
-                auto vertex = split_string(tokens[i] + "//", '/');
+    std::unique_ptr<MappedFile> mapped_file;
+    try
+    {
+        mapped_file = std::make_unique<MappedFile>(file);
+    }
+    catch (const IOError&)
+    {
+        throw Error("Can't open OBJ file: " + std::string(file));
+    }
 
-                face_vert_idx[i] = parse_index(vertex[0], vertices.size());
+    const std::string name = remove_extension(get_filename(std::string(file)));
+    const std::string cache_file = MeshCache::get_cache_file(file);
+    const uint64 source_hash = hash_bytes(mapped_file->data(), mapped_file->size());
 
-                if (has_uvs && vertex[1].empty())
-                {
-                    throw Error("expected uv coordinates at line " + std::to_string(line_num));
-                }
-                else if (!vertex[1].empty())
-                {
-                    face_uv_idx[i] = parse_index(vertex[1], uvs.size());
-                    has_uvs = true;
-                }
-                if (has_normals && vertex[2].empty())
+    if (std::shared_ptr<MeshCache> cache = MeshCache::open(cache_file, source_hash))
+    {
+        Log("obj") << INFO << "loaded " << cache->get_num_triangles() << " triangles from "
+                   << cache_file << " in " << timer.get_elapsed_time_ms() << " ms";
+        return ShapeManager::create<TriangleMesh>(name, cache);
+    }
+
+    std::vector<Chunk> chunks = split_chunks(mapped_file->data(), mapped_file->size());
+    const int32 num_chunks = (int32)chunks.size();
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int32 c = 0; c < num_chunks; ++c)
+        parse_chunk(&chunks[c]);
+
+    // Offsets of the chunks in the global lists, the first error is reported
+    std::vector<size_t> vertex_base(num_chunks + 1, 0);
+    std::vector<size_t> normal_base(num_chunks + 1, 0);
+    std::vector<size_t> uv_base(num_chunks + 1, 0);
+    std::vector<size_t> triangle_base(num_chunks + 1, 0);
+    size_t line_base = 0;
+    for (int32 c = 0; c < num_chunks; ++c)
+    {
+        const Chunk& chunk = chunks[c];
+        if (!chunk.error.empty())
+            throw Error("OBJ file " + std::string(file) + ": " + chunk.error +
+                        " at line " + std::to_string(line_base + chunk.error_line + 1));
+        line_base += chunk.num_lines;
+
+        size_t num_triangles = 0;
+        for (const Face& face : chunk.faces)
+            num_triangles += face.num_vertices - 2;
+
+        vertex_base[c + 1] = vertex_base[c] + chunk.vertices.size();
+        normal_base[c + 1] = normal_base[c] + chunk.normals.size();
+        uv_base[c + 1] = uv_base[c] + chunk.uvs.size();
+        triangle_base[c + 1] = triangle_base[c] + num_triangles;
+    }
+
+    // The materials are created in file order, a chunk starts with the last
+    // material of the previous chunks
+    std::vector<std::vector<MaterialID>> material_ids(num_chunks);
+    std::vector<MaterialID> first_material(num_chunks, 0);
+    MaterialID material_id = 0;
+    for (int32 c = 0; c < num_chunks; ++c)
+    {
+        first_material[c] = material_id;
+        for (const std::string& name : chunks[c].materials)
+            material_ids[c].push_back(material_id = MaterialManager::create(name));
+    }
+
+    // Gather the vertices, normals and uvs of all the chunks
+    std::vector<Vec3f> vertices(vertex_base[num_chunks]);
+    std::vector<Vec3f> normals(normal_base[num_chunks]);
+    std::vector<Vec2f> uvs(uv_base[num_chunks]);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int32 c = 0; c < num_chunks; ++c)
+    {
+        std::copy(chunks[c].vertices.begin(), chunks[c].vertices.end(), vertices.begin() + vertex_base[c]);
+        std::copy(chunks[c].normals.begin(), chunks[c].normals.end(), normals.begin() + normal_base[c]);
+        std::copy(chunks[c].uvs.begin(), chunks[c].uvs.end(), uvs.begin() + uv_base[c]);
+        std::vector<Vec3f>().swap(chunks[c].vertices);
+        std::vector<Vec3f>().swap(chunks[c].normals);
+        std::vector<Vec2f>().swap(chunks[c].uvs);
+    }
+
+    // Vertex, uv and normal indices of the corners of the triangles
+    const size_t num_triangles = triangle_base[num_chunks];
+    std::vector<uint32> corner_vertices(3 * num_triangles);
+    std::vector<uint32> corner_uvs(3 * num_triangles);
+    std::vector<uint32> corner_normals(3 * num_triangles);
+    std::vector<MaterialID> materials(num_triangles);
+    std::vector<std::string> errors(num_chunks);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int32 c = 0; c < num_chunks; ++c)
+    {
+        size_t t = triangle_base[c];
+        for (const Face& face : chunks[c].faces)
+        {
+            // Absolute indices of the face's vertices
+            int64 vi[4], ti[4], ni[4];
+            bool valid = true;
+            for (uint32 i = 0; i < face.num_vertices; ++i)
+            {
+                vi[i] = face.vertex[i] + ((face.relative >> i) & 1 ? (int64)vertex_base[c] : 0);
+                valid &= vi[i] >= 0 && vi[i] < (int64)vertices.size();
+                ti[i] = NO_INDEX;
+                if (face.has_uvs)
                 {
-                    throw Error("expected normal at line " + std::to_string(line_num));
+                    ti[i] = face.uv[i] + ((face.relative >> (4 + i)) & 1 ? (int64)uv_base[c] : 0);
+                    valid &= ti[i] >= 0 && ti[i] < (int64)uvs.size();
                 }
-                else if (!vertex[2].empty())
+                ni[i] = NO_INDEX;
+                if (face.has_normals)
                 {
-                    face_norm_idx[i] = parse_index(vertex[2], normals.size());
-                    has_normals = true;
+                    ni[i] = face.normal[i] + ((face.relative >> (8 + i)) & 1 ? (int64)normal_base[c] : 0);
+                    valid &= ni[i] >= 0 && ni[i] < (int64)normals.size();
                 }
             }
+            if (!valid)
+            {
+                errors[c] = "face index out of range";
+                break;
+            }
+
+            const MaterialID mat = face.material < 0 ? first_material[c] : material_ids[c][face.material];
 
             size_t indices_list[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
-            size_t num_tris = (tokens.size() == 3) ? 1 : 2;
-            for (size_t i = 0; i < num_tris; ++i)
+            const size_t num_tris = face.num_vertices - 2;
+            for (size_t i = 0; i < num_tris; ++i, ++t)
             {
-                size_t* indices = &indices_list[i][0];
-                Triangle tri;
-
-                bool uvs_null = true;
-                bool normals_null = true;
                 for (size_t j = 0; j < 3; ++j)
                 {
-                    size_t index = indices[j];
-                    tri.vertices[j] = vertices[face_vert_idx[index]];
-                    if (has_normals)
-                    {
-                        tri.normals[j] = normalize(normals[face_norm_idx[index]]);
-                        if (tri.normals[j].x != 0.0f || tri.normals[j].y != 0.0f || tri.normals[j].z != 0.0f)
-                            normals_null = false;
-                    }
-                    if (has_uvs)
-                    {
-                        tri.uvs[j] = uvs[face_uv_idx[index]];
-                        if (tri.uvs[j].x != 0.0f || tri.uvs[j].y != 0.0f)
-                            uvs_null = false;
-                    }
+                    const size_t index = indices_list[i][j];
+                    corner_vertices[3 * t + j] = (uint32)vi[index];
+                    corner_uvs[3 * t + j] = (uint32)ti[index];
+                    corner_normals[3 * t + j] = (uint32)ni[index];
                 }
-
-                if (!has_normals || normals_null)
-                {
-                    const Vec3f e01 = tri.vertices[1] - tri.vertices[0];
-                    const Vec3f e02 = tri.vertices[2] - tri.vertices[0];
-                    const Vec3f normal = normalize(cross(e01, e02));
-                    tri.normals[0] = tri.normals[1] = tri.normals[2] = normal;
-                }
-
-                if (!has_uvs || uvs_null)
-                {
-                    tri.uvs[0] = Vec2f(0, 0);
-                    tri.uvs[1] = Vec2f(1, 0);
-                    tri.uvs[2] = Vec2f(1, 1);
-                }
-
-                //tri.bbox = BBoxr(tri.vertices[0], tri.vertices[1], tri.vertices[2]);
-                //tri.centroid = tri.bbox.get_centroid();
-                tri.material_id = material_id;
-
-                triangles.push_back(std::move(tri));
+                materials[t] = mat;
             }
         }
-        /*else if (keyword == "g" || keyword == "o")
-        {
-            if (!triangles.empty())
-            {
-                std::shared_ptr<TriangleMesh> mesh =
-                    std::make_shared<TriangleMesh>(mesh_name, triangles);
-                instances.push_back(std::make_shared<ShapeInstance>(mesh, Transformr()));
-            }
-
-            mesh_name = tokens[0];
-            triangles.clear();
-        }*/
     }
 
-    /*if (!triangles.empty())
-    {
-        std::shared_ptr<TriangleMesh> mesh =
-            std::make_shared<TriangleMesh>(mesh_name, triangles);
-        instances.push_back(std::make_shared<ShapeInstance>(mesh, Transformr()));
-    }*/
+    for (const std::string& error : errors)
+        if (!error.empty())
+            throw Error("OBJ file " + std::string(file) + ": " + error);
 
-    file_stream.close();
-
-    if (triangles.empty())
+    if (num_triangles == 0)
         return 0;
 
-    const std::string name = remove_extension(get_filename(std::string(file)));
-    //std::shared_ptr<TriangleMesh> mesh =
-    //    std::make_shared<TriangleMesh>(name, triangles);
+    std::vector<uint32> vertex_keys;
+    std::vector<uint32> indices;
+    index_vertices(corner_vertices, corner_uvs, corner_normals, vertices.size(), &vertex_keys, &indices);
+    std::vector<uint32>().swap(corner_vertices);
+    std::vector<uint32>().swap(corner_uvs);
+    std::vector<uint32>().swap(corner_normals);
+
+    // The missing uvs and normals are left to zero, the triangles without
+    // them get default uvs and their face normal when shaded
+    const size_t num_mesh_vertices = vertex_keys.size() / 3;
+    std::vector<Vec3f> mesh_vertices(num_mesh_vertices);
+    std::vector<Vec3f> mesh_normals(num_mesh_vertices, Vec3f(0.0f));
+    std::vector<Vec2f> mesh_uvs(num_mesh_vertices, Vec2f(0.0f));
+
+#pragma omp parallel for schedule(static)
+    for (size_t v = 0; v < num_mesh_vertices; ++v)
+    {
+        mesh_vertices[v] = vertices[vertex_keys[3 * v + 0]];
+        if (vertex_keys[3 * v + 1] != NO_INDEX)
+            mesh_uvs[v] = uvs[vertex_keys[3 * v + 1]];
+        if (vertex_keys[3 * v + 2] != NO_INDEX)
+        {
+            const Vec3f& n = normals[vertex_keys[3 * v + 2]];
+            if (n.x != 0.0f || n.y != 0.0f || n.z != 0.0f)
+                mesh_normals[v] = normalize(n);
+        }
+    }
 
-    Log("obj") << INFO << "loaded " << triangles.size() << " triangles";
+    Log("obj") << INFO << "loaded " << num_triangles << " triangles and " << num_mesh_vertices
+               << " vertices in " << timer.get_elapsed_time_ms() << " ms";
 
-    return ShapeManager::create<TriangleMesh>(name, triangles);
+    const ShapeID id = ShapeManager::create<TriangleMesh>(name, mesh_vertices, mesh_normals, mesh_uvs, indices, materials);
+    ShapeManager::get<TriangleMesh>(id)->set_cache_file(cache_file, source_hash);
+    return id;
 }
 
 } } // namespace hop::obj
@@ -11,9 +11,12 @@
 #include "math/transform.h"
 #include "geometry/world.h"
 #include "geometry/shape_manager.h"
+#include "geometry/shape_group.h"
 #include "camera/perspective_camera.h"
 #include "render/renderer.h"
 #include "render/tonemap.h"
+#include "sampler/sampler.h"
+#include "render/filter.h"
 
 #include <sstream>
 #include <memory>
@@ -322,6 +325,26 @@ static int shape_get_bbox(lua_State* L)
     return 1;
 }
 
+static int shape_add_shape(lua_State* L)
+{
+    Stack s(L);
+    ShapeGroup* group = ShapeManager::get<ShapeGroup>(s.get_shape(1));
+    if (!group)
+        return luaL_error(L, "add_shape: the shape is not a group");
+    ShapeID shape = s.get_shape(2);
+    if (!group->add_shape(shape))
+        return luaL_error(L, "add_shape: cannot add the shape to %s", group->get_name().c_str());
+    return 0;
+}
+
+static int make_group(lua_State* L)
+{
+    Stack s(L);
+    const char* name = s.get_string(1);
+    s.push_shape(ShapeManager::create<ShapeGroup>(name));
+    return 1;
+}
+
 static int world_ctor(lua_State* L)
 {
     Stack s(L);
@@ -363,6 +386,24 @@ static int world_preprocess(lua_State* L)
     return 0;
 }
 
+static int world_set_instance_transform(lua_State* L)
+{
+    Stack s(L);
+    auto world = s.get_world(1);
+    ShapeID instance = s.get_shape(2);
+    Transformr xfm = s.get_transform(3);
+    world->set_instance_transform(instance, xfm);
+    return 0;
+}
+
+static int world_update_instances(lua_State* L)
+{
+    Stack s(L);
+    auto world = s.get_world(1);
+    world->update_instances();
+    return 0;
+}
+
 static int make_instance(lua_State* L)
 {
     Stack s(L);
@@ -448,6 +489,12 @@ static int renderer_ctor(lua_State* L)
     float adaptive_exponent = (float)safe_getfield_real(L, 3, "adaptive_exponent", opts.adaptive_exponent);
     float firefly_threshold = (float)safe_getfield_real(L, 3, "firefly_threshold", opts.firefly_threshold);
     const char* tonemap_str = safe_getfield_string(L, 3, "tonemap", "gamma");
+    const char* sampler_str = safe_getfield_string(L, 3, "sampler", "owen");
+    const char* filter_str = safe_getfield_string(L, 3, "filter", "gaussian");
+    float filter_radius = (float)safe_getfield_real(L, 3, "filter_radius", opts.filter_radius);
+    int seed = safe_getfield_int(L, 3, "seed", opts.seed);
+    int num_threads = safe_getfield_int(L, 3, "threads", opts.num_threads);
+    bool pin_threads = safe_getfield_bool(L, 3, "pin_threads", opts.pin_threads);
 
     opts.ray_epsilon = ray_epsilon;
     opts.frame_size = Vec2u(fw, fh);
@@ -461,6 +508,12 @@ static int renderer_ctor(lua_State* L)
     opts.firefly_spp = firefly_spp;
     opts.firefly_threshold = firefly_threshold;
     opts.tonemap = tonemap_from_string(tonemap_str);
+    opts.sampler = sampler_from_string(sampler_str);
+    opts.filter = filter_from_string(filter_str);
+    opts.filter_radius = filter_radius;
+    opts.seed = seed;
+    opts.num_threads = num_threads;
+    opts.pin_threads = pin_threads;
 
     std::shared_ptr<Renderer> renderer = std::make_shared<Renderer>(world, cam, opts);
     renderer->set_lua_environment(g_environment);
@@ -478,10 +531,57 @@ static int renderer_dtor(lua_State* L)
 }
 
 static int renderer_render_interactive(lua_State* L)
+{
+    Stack s(L);
+    int status = 0;
+    {
+        auto renderer = s.get_renderer(1);
+        if (g_environment->is_batch_mode())
+            status = renderer->render_batch(g_environment->get_batch_options());
+        else
+            renderer->render();
+    }
+
+    // Raised once the renderer is released, lua errors don't unwind the C++ stack
+    if (status != 0)
+    {
+        g_environment->set_exit_status(status);
+        return luaL_error(L, "render_interactive: the batch render failed");
+    }
+    return 0;
+}
+
+// renderer:render_batch({ output = "image.exr", spp = 64, time = 0, checkpoint = 0 })
+// The command line batch options override the script's ones
+static int renderer_render_batch(lua_State* L)
 {
     Stack s(L);
     auto renderer = s.get_renderer(1);
-    renderer->render(true);
+
+    BatchOptions batch;
+    if (lua_istable(L, 2))
+    {
+        batch.output = safe_getfield_string(L, 2, "output", batch.output.c_str());
+        batch.spp = safe_getfield_int(L, 2, "spp", batch.spp);
+        batch.time_budget = safe_getfield_real(L, 2, "time", batch.time_budget);
+        batch.checkpoint_interval = safe_getfield_real(L, 2, "checkpoint", batch.checkpoint_interval);
+    }
+    if (g_environment->is_batch_mode())
+        batch = g_environment->get_batch_options();
+
+    const int status = renderer->render_batch(batch);
+    if (status != 0 && g_environment->is_batch_mode())
+        g_environment->set_exit_status(status);
+
+    s.push_int(status);
+    return 1;
+}
+
+static int renderer_save_image(lua_State* L)
+{
+    Stack s(L);
+    auto renderer = s.get_renderer(1);
+    renderer->save_image(s.get_string(2));
     return 0;
 }
 
@@ -564,10 +664,13 @@ void load_api(Environment& env, const std::string& path)
 
     const luaL_Reg shape_funcs[] = {
         { "get_bbox",   shape_get_bbox },
+        { "add_shape",  shape_add_shape },
         { nullptr,      nullptr }
     };
     env.register_module("Shape", shape_funcs);
 
+    env.register_function("make_group", make_group);
+
     env.register_function("make_rotation_x", make_rotation_x_transform);
     env.register_function("make_rotation_y", make_rotation_y_transform);
     env.register_function("make_rotation_z", make_rotation_z_transform);
@@ -577,12 +680,14 @@ void load_api(Environment& env, const std::string& path)
     env.register_function("make_lookat", make_lookat_transform);
 
     const luaL_Reg world_funcs[] = {
-        { "new",        world_ctor },
-        { "__gc",       world_dtor },
-        { "add_shape",  world_add_shape },
-        { "get_bbox",   world_get_bbox },
-        { "preprocess", world_preprocess },
-        { nullptr,      nullptr }
+        { "new",                    world_ctor },
+        { "__gc",                   world_dtor },
+        { "add_shape",              world_add_shape },
+        { "get_bbox",               world_get_bbox },
+        { "preprocess",             world_preprocess },
+        { "set_instance_transform", world_set_instance_transform },
+        { "update_instances",       world_update_instances },
+        { nullptr,                  nullptr }
     };
     env.register_module("World", world_funcs);
 
@@ -602,6 +707,8 @@ void load_api(Environment& env, const std::string& path)
         { "new",                renderer_ctor },
         { "__gc",               renderer_dtor },
         { "render_interactive", renderer_render_interactive },
+        { "render_batch",       renderer_render_batch },
+        { "save_image",         renderer_save_image },
         { "reset",              renderer_reset },
         { "get_camera",         renderer_get_camera },
         { "set_focus_point",    renderer_set_focus_point },
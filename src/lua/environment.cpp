@@ -88,8 +88,10 @@ void Environment::load(const char* file)
     load_api(*this, path + "/");
 
     if (status == 0)
-        lua_pcall(L, 0, 0, 0);
+        status = lua_pcall(L, 0, 0, 0);
 
+    if (status != 0)
+        m_exit_status = 1;
     check_errors(L, status);
 }
 
@@ -140,7 +142,11 @@ void Environment::call(const char* func, const char* sig, ...)
 
     int nres = std::strlen(sig);
     if (lua_pcall(L, narg, nres, -2) != 0)
+    {
         error_handler(L);
+        if (m_exit_status == 0)
+            m_exit_status = 1;
+    }
 
     nres = -nres;
     while (*sig)
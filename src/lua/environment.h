@@ -1,6 +1,7 @@
 #pragma once
 
 #include "lua/lua.h"
+#include "render_options.h"
 
 namespace hop { namespace lua {
 
@@ -21,11 +22,23 @@ public:
 
     void set_path(const char* path);
 
+    // In batch mode the scripts' interactive renders are done without a window
+    void set_batch_mode(const BatchOptions& batch) { m_batch_mode = true; m_batch = batch; }
+    bool is_batch_mode() const { return m_batch_mode; }
+    const BatchOptions& get_batch_options() const { return m_batch; }
+
+    // Exit status of the program, set when the script fails or a batch render fails
+    void set_exit_status(int status) { m_exit_status = status; }
+    int get_exit_status() const { return m_exit_status; }
+
     Environment(const Environment&) = delete;
     Environment& operator=(const Environment&) = delete;
 
 private:
     lua_State* L;
+    bool m_batch_mode = false;
+    BatchOptions m_batch;
+    int m_exit_status = 0;
 };
 
 } } // namespace hop::lua
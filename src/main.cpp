@@ -2,6 +2,7 @@
 #include "util/input_parser.h"
 #include "util/file_util.h"
 #include "lua/environment.h"
+#include "render_options.h"
 
 #include <string>
 
@@ -11,17 +12,23 @@ void show_usage()
 {
     std::cout << "usage: hop -h\n"
               << "usage: hop -s script.lua\n"
+              << "usage: hop -s script.lua -b image.exr [-spp 64] [-t 60] [-c 10]\n"
               << "\n"
               << "options:\n"
-              << "       -h  Print this menu\n"
-              << "       -s  Run a lua script\n"
-              << "       -v  Verbose\n"
-              << "       -vv Very verbose\n" << std::endl;
+              << "       -h   Print this menu\n"
+              << "       -s   Run a lua script\n"
+              << "       -b   Render without a window and write the image to a file (exr, pfm, png or ppm)\n"
+              << "       -spp Number of samples per pixel of the batch render\n"
+              << "       -t   Time budget of the batch render in seconds\n"
+              << "       -c   Write the batch render's image every this many seconds\n"
+              << "       -v   Verbose\n"
+              << "       -vv  Very verbose\n" << std::endl;
 }
 
 int main(int argc, char* argv[])
 {
     Log::set_log_level(INFO);
+    int status = 0;
 
     try
     {
@@ -45,12 +52,30 @@ int main(int argc, char* argv[])
             if (!has_extension(file, ".lua"))
             {
                 Log("main") << WARNING << file << " is not a lua file";
+                status = 1;
             }
             else
             {
                 lua::Environment env;
+
+                if (input.option_exists("-b"))
+                {
+                    BatchOptions batch;
+                    batch.output = input.get_option("-b");
+                    if (input.option_exists("-spp"))
+                        batch.spp = std::stoul(input.get_option("-spp"));
+                    if (input.option_exists("-t"))
+                        batch.time_budget = std::stod(input.get_option("-t"));
+                    if (input.option_exists("-c"))
+                        batch.checkpoint_interval = std::stod(input.get_option("-c"));
+                    if (batch.spp == 0 && batch.time_budget == 0.0)
+                        Log("main") << INFO << "no spp or time budget given, rendering one pass";
+                    env.set_batch_mode(batch);
+                }
+
                 env.load(file.c_str());
                 env.call("init", "");
+                status = env.get_exit_status();
             }
         }
         else
@@ -63,7 +88,8 @@ int main(int argc, char* argv[])
     catch (std::exception& e)
     {
         Log("main") << ERROR << e.what();
+        status = 1;
     }
 
-    return 0;
+    return status;
 }
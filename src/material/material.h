@@ -14,6 +14,8 @@ class Material
 public:
     Material(const std::string& name);
 
+    const std::string& get_name() const { return m_name; }
+
     virtual Bsdf* get_bsdf(const SurfaceInteraction& isect) const;
 
 private:
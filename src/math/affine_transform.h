@@ -0,0 +1,177 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "math/math.h"
+#include "math/vec3.h"
+#include "math/mat4.h"
+
+#include <immintrin.h>
+
+namespace hop {
+
+// Affine transform, the top 3x4 part of a transform matrix. The matrix is
+// stored by columns padded to 4 lanes: the images of the x, y and z axes
+// and the translation. Transforming a point is then 3 multiplies and 3 adds
+// of SSE registers, without the homogeneous divide of Transform.
+class ALIGN(16) AffineTransform
+{
+public:
+    Real col[4][4];
+
+    AffineTransform()
+    {
+        for (uint32 c = 0; c < 4; ++c)
+            for (uint32 r = 0; r < 4; ++r)
+                col[c][r] = c == r && r < 3 ? Real(1) : Real(0);
+    }
+
+    explicit AffineTransform(const Mat4<Real>& m)
+    {
+        for (uint32 c = 0; c < 4; ++c)
+        {
+            for (uint32 r = 0; r < 3; ++r)
+                col[c][r] = m[r][c];
+            col[c][3] = Real(0);
+        }
+    }
+
+    AffineTransform operator*(const AffineTransform& t) const
+    {
+        AffineTransform res;
+        for (uint32 c = 0; c < 4; ++c)
+        {
+            for (uint32 r = 0; r < 3; ++r)
+            {
+                res.col[c][r] = col[0][r] * t.col[c][0] + col[1][r] * t.col[c][1] + col[2][r] * t.col[c][2] +
+                                (c == 3 ? col[3][r] : Real(0));
+            }
+        }
+        return res;
+    }
+};
+
+#ifndef REAL_IS_DOUBLE
+
+inline __m128 load_vec3(const Vec3f& v)
+{
+    return _mm_setr_ps(v.x, v.y, v.z, 0.0f);
+}
+
+inline Vec3f store_vec3(__m128 v)
+{
+    ALIGN(16) float f[4];
+    _mm_store_ps(f, v);
+    return Vec3f(f[0], f[1], f[2]);
+}
+
+inline __m128 transform_vector(const AffineTransform& t, __m128 v)
+{
+    const __m128 x = _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0));
+    const __m128 y = _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1));
+    const __m128 z = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_load_ps(t.col[0])), _mm_mul_ps(y, _mm_load_ps(t.col[1]))),
+                      _mm_mul_ps(z, _mm_load_ps(t.col[2])));
+}
+
+inline __m128 transform_point(const AffineTransform& t, __m128 p)
+{
+    return _mm_add_ps(transform_vector(t, p), _mm_load_ps(t.col[3]));
+}
+
+// Same refined reciprocal as rcp(float), on 4 lanes
+inline __m128 rcp(__m128 a)
+{
+    const __m128 r = _mm_rcp_ps(a);
+    return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(r, a)));
+}
+
+inline Vec3f transform_point(const AffineTransform& t, const Vec3f& p)
+{
+    return store_vec3(transform_point(t, load_vec3(p)));
+}
+
+inline Vec3f transform_vector(const AffineTransform& t, const Vec3f& v)
+{
+    return store_vec3(transform_vector(t, load_vec3(v)));
+}
+
+// Transform a ray and compute the reciprocal of its new direction
+inline void transform_ray(const AffineTransform& t, Vec3f* org, Vec3f* dir, Vec3f* inv_dir)
+{
+    const __m128 d = transform_vector(t, load_vec3(*dir));
+    *org = transform_point(t, *org);
+    *dir = store_vec3(d);
+    *inv_dir = store_vec3(rcp(d));
+}
+
+#else
+
+inline Vec3r transform_point(const AffineTransform& t, const Vec3r& p)
+{
+    return Vec3r(p.x * t.col[0][0] + p.y * t.col[1][0] + p.z * t.col[2][0] + t.col[3][0],
+                 p.x * t.col[0][1] + p.y * t.col[1][1] + p.z * t.col[2][1] + t.col[3][1],
+                 p.x * t.col[0][2] + p.y * t.col[1][2] + p.z * t.col[2][2] + t.col[3][2]);
+}
+
+inline Vec3r transform_vector(const AffineTransform& t, const Vec3r& v)
+{
+    return Vec3r(v.x * t.col[0][0] + v.y * t.col[1][0] + v.z * t.col[2][0],
+                 v.x * t.col[0][1] + v.y * t.col[1][1] + v.z * t.col[2][1],
+                 v.x * t.col[0][2] + v.y * t.col[1][2] + v.z * t.col[2][2]);
+}
+
+inline void transform_ray(const AffineTransform& t, Vec3r* org, Vec3r* dir, Vec3r* inv_dir)
+{
+    *org = transform_point(t, *org);
+    *dir = transform_vector(t, *dir);
+    *inv_dir = rcp(*dir);
+}
+
+#endif
+
+// Transform P rays stored as SoA, org[axis][ray], and compute the
+// reciprocals of their new directions. The lanes are transformed in
+// vectorized loops, 4 or 8 rays at a time depending on the target.
+template <uint32 P>
+inline void transform_rays(const AffineTransform& t, Real (*org)[P], Real (*dir)[P], Real (*rcp_dir)[P])
+{
+    const Real m00 = t.col[0][0], m10 = t.col[0][1], m20 = t.col[0][2];
+    const Real m01 = t.col[1][0], m11 = t.col[1][1], m21 = t.col[1][2];
+    const Real m02 = t.col[2][0], m12 = t.col[2][1], m22 = t.col[2][2];
+    const Real m03 = t.col[3][0], m13 = t.col[3][1], m23 = t.col[3][2];
+
+#pragma omp simd
+    for (uint32 i = 0; i < P; ++i)
+    {
+        const Real ox = org[0][i], oy = org[1][i], oz = org[2][i];
+        const Real dx = dir[0][i], dy = dir[1][i], dz = dir[2][i];
+        org[0][i] = m00 * ox + m01 * oy + m02 * oz + m03;
+        org[1][i] = m10 * ox + m11 * oy + m12 * oz + m13;
+        org[2][i] = m20 * ox + m21 * oy + m22 * oz + m23;
+        dir[0][i] = m00 * dx + m01 * dy + m02 * dz;
+        dir[1][i] = m10 * dx + m11 * dy + m12 * dz;
+        dir[2][i] = m20 * dx + m21 * dy + m22 * dz;
+    }
+
+    for (uint32 axis = 0; axis < 3; ++axis)
+    {
+        uint32 i = 0;
+#ifndef REAL_IS_DOUBLE
+        for (; i + 4 <= P; i += 4)
+            _mm_storeu_ps(&rcp_dir[axis][i], rcp(_mm_loadu_ps(&dir[axis][i])));
+#endif
+        for (; i < P; ++i)
+            rcp_dir[axis][i] = rcp(dir[axis][i]);
+    }
+}
+
+// Transform a normal given the inverse of the transform
+inline Vec3r transform_normal(const AffineTransform& inv, const Vec3r& n)
+{
+    return Vec3r(n.x * inv.col[0][0] + n.y * inv.col[0][1] + n.z * inv.col[0][2],
+                 n.x * inv.col[1][0] + n.y * inv.col[1][1] + n.z * inv.col[1][2],
+                 n.x * inv.col[2][0] + n.y * inv.col[2][1] + n.z * inv.col[2][2]);
+}
+
+} // namespace hop
@@ -53,6 +53,15 @@ public:
         return (pmin + pmax) * T(0.5);
     }
 
+    // Half of the surface area, this is all the SAH needs to compare costs
+    inline T get_half_area() const
+    {
+        if (empty())
+            return T(0);
+        const Vec3<T> side = pmax - pmin;
+        return side.x * side.y + side.x * side.z + side.y * side.z;
+    }
+
     inline bool empty() const
     {
         if (pmin.x > pmax.x) return true;
@@ -78,6 +87,16 @@ inline BBox<T> merge(const BBox<T>& b, const Vec3<T>& p)
     return BBox<T>(min(b.pmin, p), max(b.pmax, p));
 }
 
+// Bounds common to two boxes, empty if they don't overlap
+template <typename T>
+inline BBox<T> intersect(const BBox<T>& b1, const BBox<T>& b2)
+{
+    BBox<T> b;
+    b.pmin = max(b1.pmin, b2.pmin);
+    b.pmax = min(b1.pmax, b2.pmax);
+    return b;
+}
+
 template <typename T>
 std::ostream& operator<<(std::ostream& os, const BBox<T>& v)
 {
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "types.h"
+
+#include <cstddef>
+#include <cstring>
+
+namespace hop {
+
+// 64 bits finalizer of splitmix64, good avalanche for cheap hashing of integers
+inline uint64 mix_bits(uint64 v)
+{
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ull;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= v >> 33;
+    return v;
+}
+
+inline uint64 hash(uint32 a, uint32 b)
+{
+    return mix_bits(((uint64)a << 32) | b);
+}
+
+inline uint64 hash(uint32 a, uint32 b, uint32 c, uint32 d)
+{
+    return mix_bits(hash(a, b) ^ (((uint64)c << 32) | d));
+}
+
+// Hash of a block of memory, used to tell if a file changed. The data is
+// read in four independent lanes of 8 bytes so it runs close to memory speed.
+inline uint64 hash_bytes(const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    uint64 lanes[4] = { 0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull, 0x27d4eb2f165667c5ull };
+
+    const size_t num_blocks = size / 32;
+    for (size_t i = 0; i < num_blocks; ++i, p += 32)
+    {
+        for (uint32 k = 0; k < 4; ++k)
+        {
+            uint64 word;
+            std::memcpy(&word, p + 8 * k, sizeof(uint64));
+            lanes[k] ^= word;
+            lanes[k] = (lanes[k] << 31 | lanes[k] >> 33) * 0x9e3779b97f4a7c15ull;
+        }
+    }
+
+    uint64 h = size;
+    for (uint32 k = 0; k < 4; ++k)
+        h = mix_bits(h ^ lanes[k]);
+
+    // Remaining bytes
+    for (size_t i = num_blocks * 32; i < size; ++i)
+        h = mix_bits(h ^ (uint8)*p++);
+    return h;
+}
+
+inline uint32 reverse_bits(uint32 x)
+{
+    x = ((x & 0x55555555u) << 1) | ((x >> 1) & 0x55555555u);
+    x = ((x & 0x33333333u) << 2) | ((x >> 2) & 0x33333333u);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x >> 4) & 0x0f0f0f0fu);
+    x = ((x & 0x00ff00ffu) << 8) | ((x >> 8) & 0x00ff00ffu);
+    return (x << 16) | (x >> 16);
+}
+
+} // namespace hop
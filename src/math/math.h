@@ -2,12 +2,15 @@
 
 #include "hop.h"
 #include "types.h"
+#include "math/pcg32.h"
 #include <cmath>
 #include <limits>
 #include <cfloat>
 #include <cstdint>
 #include <type_traits>
 #include <algorithm>
+#include <thread>
+#include <functional>
 
 #include <emmintrin.h>
 #include <xmmintrin.h>
@@ -326,48 +329,19 @@ template<typename T> inline T rad2deg(const T& x) { return x * T(5.7295779513082
 template<typename T> inline T sin2cos(const T& x) { return sqrt(max(T(0), T(1) - x * x)); }
 template<typename T> inline T cos2sin(const T& x) { return sin2cos(x);                         }
 
-template<typename T> T random() { return T(0); }
-
-#ifdef RAND_HARDWARE
-
-template<> inline float random()
-{
-    unsigned long long val;
-    //_rdseed64_step(&val);
-    _rdrand64_step(&val);
-    return (float)val / (float)std::numeric_limits<unsigned long long>::max();
-}
-
-template<> inline double random()
-{
-    unsigned long long val;
-    //_rdseed64_step(&val);
-    _rdrand64_step(&val);
-    return (double)val / (double)std::numeric_limits<unsigned long long>::max();
-}
-
-template<> inline uint32_t random()
+// Fallback random numbers from a per-thread PCG32, the renderer and the
+// integrators draw their samples from a Sampler instead
+inline PCG32& get_thread_rng()
 {
-    unsigned int val;
-    _rdrand32_step(&val);
-    return uint32_t(val);
+    static thread_local PCG32 rng(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    return rng;
 }
 
-template<> inline int random()
-{
-    unsigned int val;
-    _rdrand32_step(&val);
-    return int(val);
-}
-
-#else
-
-template<> inline float    random() { return rand() / float(RAND_MAX); }
-template<> inline double   random() { return rand() / double(RAND_MAX); }
-template<> inline uint32_t random() { return uint32_t(rand()) ^ (uint32_t(rand()) << 16); }
-template<> inline int      random() { return int(rand()); }
-
-#endif
+template<typename T> T random() { return T(0); }
+template<> inline float    random() { return get_thread_rng().next_float(); }
+template<> inline double   random() { return get_thread_rng().next_double(); }
+template<> inline uint32_t random() { return get_thread_rng().next_uint(); }
+template<> inline int      random() { return (int)get_thread_rng().next_uint(); }
 
 template<typename T> inline T lerp(const T& v0, const T& v1, const float t) {
     return madd(T(1.0f - t), v0, t * v1);
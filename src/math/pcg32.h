@@ -0,0 +1,74 @@
+#pragma once
+
+#include "types.h"
+
+namespace hop {
+
+// PCG32 random number generator (M.E. O'Neill, pcg-random.org).
+// 64 bits of state, 32 bits outputs, 2^63 selectable sequences
+// and O(log n) jumps ahead in a sequence.
+class PCG32
+{
+public:
+    PCG32() { set_sequence(0); }
+    PCG32(uint64 seq_index, uint64 seed = PCG32_DEFAULT_STATE) { set_sequence(seq_index, seed); }
+
+    void set_sequence(uint64 seq_index, uint64 seed = PCG32_DEFAULT_STATE)
+    {
+        m_state = 0u;
+        m_inc = (seq_index << 1u) | 1u;
+        next_uint();
+        m_state += seed;
+        next_uint();
+    }
+
+    uint32 next_uint()
+    {
+        const uint64 old_state = m_state;
+        m_state = old_state * PCG32_MULT + m_inc;
+        const uint32 xorshifted = (uint32)(((old_state >> 18u) ^ old_state) >> 27u);
+        const uint32 rot = (uint32)(old_state >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+    }
+
+    // Uniform float in [0, 1)
+    float next_float()
+    {
+        return (float)(next_uint() >> 8) * 5.96046448e-08f;
+    }
+
+    // Uniform double in [0, 1)
+    double next_double()
+    {
+        const uint64 v = ((uint64)next_uint() << 32) | next_uint();
+        return (double)(v >> 11) * 1.1102230246251565e-16;
+    }
+
+    // Jump ahead (or back) delta steps in the sequence
+    void advance(int64 idelta)
+    {
+        uint64 cur_mult = PCG32_MULT, cur_plus = m_inc, acc_mult = 1u, acc_plus = 0u;
+        uint64 delta = (uint64)idelta;
+        while (delta > 0)
+        {
+            if (delta & 1)
+            {
+                acc_mult *= cur_mult;
+                acc_plus = acc_plus * cur_mult + cur_plus;
+            }
+            cur_plus = (cur_mult + 1) * cur_plus;
+            cur_mult *= cur_mult;
+            delta /= 2;
+        }
+        m_state = acc_mult * m_state + acc_plus;
+    }
+
+private:
+    static constexpr uint64 PCG32_DEFAULT_STATE = 0x853c49e6748fea9bull;
+    static constexpr uint64 PCG32_MULT = 0x5851f42d4c957f2dull;
+
+    uint64 m_state;
+    uint64 m_inc;
+};
+
+} // namespace hop
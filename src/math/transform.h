@@ -21,6 +21,13 @@ public:
     Transform(const Mat4<T>& m, const Mat4<T>& inv) : m(m), inv(inv) { }
     Transform(const Transform<T>& t) : m(t.m), inv(t.inv) { }
 
+    Transform<T>& operator=(const Transform<T>& t)
+    {
+        m = t.m;
+        inv = t.inv;
+        return *this;
+    }
+
     Mat4<T> get_mat4() const { return m; }
 
     Transform<T> operator*(const Transform<T>& t) const
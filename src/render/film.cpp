@@ -1,51 +1,263 @@
 #include "render/film.h"
+#include "render/tile.h"
+#include "render/filter.h"
 #include "math/math.h"
+#include "math/vec2.h"
 #include "math/vec3.h"
 #include "spectrum/spectrum.h"
 
-#include <memory>
+#include <algorithm>
 #include <cstring>
-#include <utility>
+#include <vector>
 
 namespace hop {
 
-Film::Film(uint32 w, uint32 h)
-    : m_width(w), m_height(h)
-    , m_image(std::make_unique<Pixel[]>(w * h))
+// Variance of the intensity from the weighted sums of the samples, n is
+// the number of samples taken in the pixel
+static float variance(float sum_intensity, float sum_sqr, float weight, uint32 n)
 {
-    std::memset(&m_image[0], 0, sizeof(Pixel) * m_width * m_height);
+    if (n < 2 || weight <= 0.0f)
+        return 0.0f;
+    const float rcp_w = rcp(weight);
+    const float mean = sum_intensity * rcp_w;
+    return max(sum_sqr * rcp_w - mean * mean, 0.0f) * ((float)n * rcp((float)(n - 1)));
 }
 
-void Film::add_sample(uint32 x, uint32 y, const Spectrum& color, float weight)
+// Add to a float the other render threads may be adding to
+static void atomic_add(float* p, float v)
+{
+    uint32* bits = reinterpret_cast<uint32*>(p);
+    uint32 expected = __atomic_load_n(bits, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        float f;
+        std::memcpy(&f, &expected, sizeof(float));
+        f += v;
+        uint32 desired;
+        std::memcpy(&desired, &f, sizeof(float));
+        if (__atomic_compare_exchange_n(bits, &expected, desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+// Overwrite a float the other render threads may be adding to
+static void atomic_store(float* p, float v)
+{
+    uint32 bits;
+    std::memcpy(&bits, &v, sizeof(float));
+    __atomic_store_n(reinterpret_cast<uint32*>(p), bits, __ATOMIC_RELAXED);
+}
+
+void FilmTile::add_sample(const Vec2f& pos, const Spectrum& color, float weight)
 {
     const Spectrum sample = color * weight;
-    uint32 idx = y * m_width + x;
-    float n = ++m_image[idx].num_samples;
-    float rcp_n = rcp(n);
+    const Vec3f c = sample.get_color();
+    const float intensity = sample.get_intensity();
+    const float radius = m_filter->get_radius();
+
+    // The pixels with their center within the radius of the sample,
+    // the center of pixel x is at x + 0.5
+    const int x0 = max((int)floor(pos.x - radius - 0.5f) + 1, (int)m_x);
+    const int x1 = min((int)floor(pos.x + radius - 0.5f), (int)(m_x + m_width - 1));
+    const int y0 = max((int)floor(pos.y - radius - 0.5f) + 1, (int)m_y);
+    const int y1 = min((int)floor(pos.y + radius - 0.5f), (int)(m_y + m_height - 1));
+
+    float wx[2 * (int)MAX_FILTER_RADIUS + 1];
+    for (int x = x0; x <= x1; ++x)
+        wx[x - x0] = m_filter->evaluate(pos.x - ((float)x + 0.5f));
+
+    for (int y = y0; y <= y1; ++y)
+    {
+        const float wy = m_filter->evaluate(pos.y - ((float)y + 0.5f));
+        uint32 idx = get_index(x0, y);
+        for (int x = x0; x <= x1; ++x, ++idx)
+        {
+            const float w = wx[x - x0] * wy;
+            m_r[idx] += c.x * w;
+            m_g[idx] += c.y * w;
+            m_b[idx] += c.z * w;
+            m_weights[idx] += w;
+            m_sum_sqr[idx] += intensity * intensity * w;
+        }
+    }
 
-    if (n > 1.0f)
-        m_image[idx].variance = m_image[idx].variance * ((n - 2.0f) * rcp(n - 1.0f)) +
-            (sqr(sample.get_intensity() - m_image[idx].color.get_intensity()) * rcp_n);
+    // The sample counts for the pixel it was taken in
+    ++m_num_samples[get_index((uint32)pos.x, (uint32)pos.y)];
+}
+
+void FilmTile::fill(const Tile& rect)
+{
+    const uint32 first = get_index(rect.x, rect.y);
+    for (uint32 j = 0; j < rect.h; ++j)
+    {
+        const uint32 row = first + j * m_width;
+        std::fill_n(&m_r[row], rect.w, m_r[first]);
+        std::fill_n(&m_g[row], rect.w, m_g[first]);
+        std::fill_n(&m_b[row], rect.w, m_b[first]);
+        std::fill_n(&m_weights[row], rect.w, m_weights[first]);
+        std::fill_n(&m_sum_sqr[row], rect.w, m_sum_sqr[first]);
+        std::fill_n(&m_num_samples[row], rect.w, m_num_samples[first]);
+    }
+}
+
+Film::Film(uint32 w, uint32 h, const Filter& filter)
+    : m_width(w), m_height(h), m_filter(filter)
+    , m_guard((uint32)ceil(filter.get_radius() - 0.5f))
+    , m_r(w * h, 0.0f), m_g(w * h, 0.0f), m_b(w * h, 0.0f)
+    , m_weights(w * h, 0.0f), m_sum_sqr(w * h, 0.0f), m_num_samples(w * h, 0)
+{
+}
+
+void Film::reset_tile(const Tile& tile, FilmTile* film_tile) const
+{
+    film_tile->m_tile = tile;
+    film_tile->m_filter = &m_filter;
+    film_tile->m_x = tile.x > m_guard ? tile.x - m_guard : 0;
+    film_tile->m_y = tile.y > m_guard ? tile.y - m_guard : 0;
+    film_tile->m_width = min(tile.x + tile.w + m_guard, m_width) - film_tile->m_x;
+    film_tile->m_height = min(tile.y + tile.h + m_guard, m_height) - film_tile->m_y;
 
-    m_image[idx].color += (sample - m_image[idx].color) * rcp_n;
+    const uint32 num_pixels = film_tile->m_width * film_tile->m_height;
+    film_tile->m_r.assign(num_pixels, 0.0f);
+    film_tile->m_g.assign(num_pixels, 0.0f);
+    film_tile->m_b.assign(num_pixels, 0.0f);
+    film_tile->m_weights.assign(num_pixels, 0.0f);
+    film_tile->m_sum_sqr.assign(num_pixels, 0.0f);
+    film_tile->m_num_samples.assign(num_pixels, 0);
+}
+
+void Film::merge_tile(const FilmTile& tile, bool replace)
+{
+    const Tile& t = tile.m_tile;
+
+    if (replace)
+    {
+        for (uint32 j = 0; j < t.h; ++j)
+        {
+            const uint32 src = tile.get_index(t.x, t.y + j);
+            const uint32 dst = (t.y + j) * m_width + t.x;
+            std::copy_n(&tile.m_num_samples[src], t.w, &m_num_samples[dst]);
+
+            // The scheduler holds the neighbouring tiles back until the previews
+            // are done, but after a reset the tiles of the previous render can
+            // still add their guard band
+            if (m_guard == 0)
+            {
+                std::copy_n(&tile.m_r[src], t.w, &m_r[dst]);
+                std::copy_n(&tile.m_g[src], t.w, &m_g[dst]);
+                std::copy_n(&tile.m_b[src], t.w, &m_b[dst]);
+                std::copy_n(&tile.m_weights[src], t.w, &m_weights[dst]);
+                std::copy_n(&tile.m_sum_sqr[src], t.w, &m_sum_sqr[dst]);
+                continue;
+            }
+            for (uint32 i = 0; i < t.w; ++i)
+            {
+                atomic_store(&m_r[dst + i], tile.m_r[src + i]);
+                atomic_store(&m_g[dst + i], tile.m_g[src + i]);
+                atomic_store(&m_b[dst + i], tile.m_b[src + i]);
+                atomic_store(&m_weights[dst + i], tile.m_weights[src + i]);
+                atomic_store(&m_sum_sqr[dst + i], tile.m_sum_sqr[src + i]);
+            }
+        }
+        return;
+    }
+
+    // Only the thread merging the tile writes the sample counts of its pixels
+    for (uint32 j = 0; j < t.h; ++j)
+    {
+        const uint32 src = tile.get_index(t.x, t.y + j);
+        const uint32 dst = (t.y + j) * m_width + t.x;
+        for (uint32 i = 0; i < t.w; ++i)
+            m_num_samples[dst + i] += tile.m_num_samples[src + i];
+    }
+
+    // Without a guard band, no other thread writes to the pixels of the tile
+    if (m_guard == 0)
+    {
+        for (uint32 j = 0; j < t.h; ++j)
+        {
+            const uint32 src = tile.get_index(t.x, t.y + j);
+            const uint32 dst = (t.y + j) * m_width + t.x;
+            for (uint32 i = 0; i < t.w; ++i)
+            {
+                m_r[dst + i] += tile.m_r[src + i];
+                m_g[dst + i] += tile.m_g[src + i];
+                m_b[dst + i] += tile.m_b[src + i];
+                m_weights[dst + i] += tile.m_weights[src + i];
+                m_sum_sqr[dst + i] += tile.m_sum_sqr[src + i];
+            }
+        }
+        return;
+    }
+
+    for (uint32 j = 0; j < tile.m_height; ++j)
+    {
+        const uint32 src = j * tile.m_width;
+        const uint32 dst = (tile.m_y + j) * m_width + tile.m_x;
+        for (uint32 i = 0; i < tile.m_width; ++i)
+        {
+            if (tile.m_weights[src + i] == 0.0f)
+                continue;
+            atomic_add(&m_r[dst + i], tile.m_r[src + i]);
+            atomic_add(&m_g[dst + i], tile.m_g[src + i]);
+            atomic_add(&m_b[dst + i], tile.m_b[src + i]);
+            atomic_add(&m_weights[dst + i], tile.m_weights[src + i]);
+            atomic_add(&m_sum_sqr[dst + i], tile.m_sum_sqr[src + i]);
+        }
+    }
+}
+
+Spectrum Film::get_color(uint32 x, uint32 y) const
+{
+    const uint32 idx = y * m_width + x;
+    const float weight = m_weights[idx];
+    if (weight <= 0.0f)
+        return Spectrum(0.0f);
+    return Spectrum(m_r[idx], m_g[idx], m_b[idx]) * rcp(weight);
+}
+
+void Film::get_colors(uint32 x, uint32 y, uint32 n, float* r, float* g, float* b) const
+{
+    const uint32 first = y * m_width + x;
+    for (uint32 i = 0; i < n; ++i)
+    {
+        const float weight = m_weights[first + i];
+        const float rcp_w = weight > 0.0f ? 1.0f / weight : 0.0f;
+        r[i] = m_r[first + i] * rcp_w;
+        g[i] = m_g[first + i] * rcp_w;
+        b[i] = m_b[first + i] * rcp_w;
+    }
+}
+
+float Film::get_variance(uint32 x, uint32 y) const
+{
+    const uint32 idx = y * m_width + x;
+    const float sum_intensity = Spectrum(m_r[idx], m_g[idx], m_b[idx]).get_intensity();
+    return variance(sum_intensity, m_sum_sqr[idx], m_weights[idx], m_num_samples[idx]);
 }
 
-void Film::reset_pixel(uint32 x, uint32 y)
+float Film::get_standard_deviation(uint32 x, uint32 y) const
 {
-    uint32 idx = y * m_width + x;
-    m_image[idx].color = Spectrum(0.0f);
-    m_image[idx].variance = 0.0f;
-    m_image[idx].num_samples = 0.0f;
+    return sqrt(get_variance(x, y));
 }
 
-float Film::get_variance(uint32 x, uint32 y)
+float Film::get_standard_deviation(uint32 x, uint32 y, const FilmTile& tile) const
 {
-    return m_image[y * m_width + x].variance;
+    const uint32 idx = y * m_width + x;
+    const uint32 tidx = tile.get_index(x, y);
+    const Spectrum sum(m_r[idx] + tile.m_r[tidx], m_g[idx] + tile.m_g[tidx], m_b[idx] + tile.m_b[tidx]);
+    const float weight = m_weights[idx] + tile.m_weights[tidx];
+    const float sum_sqr = m_sum_sqr[idx] + tile.m_sum_sqr[tidx];
+    const uint32 n = m_num_samples[idx] + tile.m_num_samples[tidx];
+    return sqrt(variance(sum.get_intensity(), sum_sqr, weight, n));
 }
 
-float Film::get_standard_deviation(uint32 x, uint32 y)
+void Film::snapshot(std::vector<Vec3f>* colors) const
 {
-    return sqrt(m_image[y * m_width + x].variance);
+    colors->resize(m_width * m_height);
+    for (uint32 y = 0; y < m_height; ++y)
+        for (uint32 x = 0; x < m_width; ++x)
+            (*colors)[y * m_width + x] = get_color(x, y).get_color();
 }
 
 } // namespace hop
@@ -2,34 +2,132 @@
 
 #include "types.h"
 #include "spectrum/spectrum.h"
+#include "render/tile.h"
+#include "render/filter.h"
+#include "math/vec2.h"
+#include "math/vec3.h"
 
 #include <memory>
+#include <vector>
 
 namespace hop {
 
+// Samples of a tile accumulated by a single render thread.
+// The sums are kept in separate arrays, a thread adding samples only
+// touches its own memory and there is no division per sample.
+// The buffers extend past the tile by a guard band as wide as the filter
+// footprint, the samples near the border of the tile also reach the pixels
+// of the neighbouring tiles. The tiles are set up by Film::reset_tile.
+class FilmTile
+{
+public:
+    FilmTile() : m_tile{0, 0, 0, 0, 0}, m_x(0), m_y(0), m_width(0), m_height(0), m_filter(nullptr) { }
+
+    // Add a sample to a single pixel of the tile, without filtering.
+    // The coordinates are in film space.
+    void add_sample(uint32 x, uint32 y, const Spectrum& color, float weight)
+    {
+        const uint32 idx = get_index(x, y);
+        const Spectrum sample = color * weight;
+        const Vec3f c = sample.get_color();
+        const float intensity = sample.get_intensity();
+        m_r[idx] += c.x;
+        m_g[idx] += c.y;
+        m_b[idx] += c.z;
+        m_weights[idx] += 1.0f;
+        m_sum_sqr[idx] += intensity * intensity;
+        ++m_num_samples[idx];
+    }
+
+    // Splat a sample to the pixels under the filter footprint. The position
+    // is in film space, pixel (x, y) covers [x, x + 1) x [y, y + 1) and the
+    // sample must be inside the tile.
+    void add_sample(const Vec2f& pos, const Spectrum& color, float weight);
+
+    uint32 get_num_samples(uint32 x, uint32 y) const { return m_num_samples[get_index(x, y)]; }
+
+    // Copy the samples of the first pixel of rect to the other pixels of rect,
+    // a preview renders a single pixel for a whole block of pixels
+    void fill(const Tile& rect);
+
+    const Tile& get_tile() const { return m_tile; }
+
+private:
+    friend class Film;
+
+    uint32 get_index(uint32 x, uint32 y) const { return (y - m_y) * m_width + (x - m_x); }
+
+    Tile m_tile;
+    uint32 m_x, m_y, m_width, m_height; // the tile and its guard band
+    const Filter* m_filter;
+    std::vector<float> m_r;
+    std::vector<float> m_g;
+    std::vector<float> m_b;
+    std::vector<float> m_weights;
+    std::vector<float> m_sum_sqr;
+    std::vector<uint32> m_num_samples;
+};
+
+// The accumulated samples of the whole image. For each pixel the film keeps
+// the sum of the filtered samples, the sum of the filter weights, the
+// weighted sum of the squared intensities and the number of samples taken
+// in the pixel, each in its own array. The render threads only write to
+// the film when they merge a tile.
 class Film
 {
 public:
-    struct Pixel
+    Film(uint32 w, uint32 h, const Filter& filter);
+
+    // Clear a tile buffer and set it up to cover the given tile of the film
+    void reset_tile(const Tile& tile, FilmTile* film_tile) const;
+
+    // Add the samples of a tile to the film. When replace is set, the
+    // pixels of the tile are overwritten instead and the guard band is dropped.
+    // Two threads must not merge the same tile at the same time, the guard
+    // bands of neighbouring tiles are added atomically and the replaced pixels
+    // are stored atomically. The guard band a neighbour added is lost when
+    // the pixels are replaced, the TileScheduler keeps a tile from adding it
+    // while its neighbours are in their preview passes.
+    void merge_tile(const FilmTile& tile, bool replace);
+
+    Spectrum get_color(uint32 x, uint32 y) const;
+
+    // Colors of n consecutive pixels of a row starting at (x, y), in separate arrays
+    void get_colors(uint32 x, uint32 y, uint32 n, float* r, float* g, float* b) const;
+
+    float get_variance(uint32 x, uint32 y) const;
+    float get_standard_deviation(uint32 x, uint32 y) const;
+    uint32 get_num_samples(uint32 x, uint32 y) const { return m_num_samples[y * m_width + x]; }
+
+    // Statistics of a pixel including the samples of a tile not merged yet
+    float get_standard_deviation(uint32 x, uint32 y, const FilmTile& tile) const;
+    uint32 get_num_samples(uint32 x, uint32 y, const FilmTile& tile) const
     {
-        Spectrum color;
-        float variance;
-        float num_samples;
-    };
+        return get_num_samples(x, y) + tile.get_num_samples(x, y);
+    }
 
-    Film(uint32 w, uint32 h);
+    uint32 get_width() const { return m_width; }
+    uint32 get_height() const { return m_height; }
+    const Filter& get_filter() const { return m_filter; }
 
-    void add_sample(uint32 x, uint32 y, const Spectrum& color, float weight);
-    void reset_pixel(uint32 x, uint32 y);
-    float get_variance(uint32 x, uint32 y);
-    float get_standard_deviation(uint32 x, uint32 y);
+    // The samples of a tile can change the pixels this far around it
+    uint32 get_guard_band() const { return m_guard; }
 
-    Pixel* get_pixels() { return m_image.get(); }
+    // Copy the pixel colors, rows bottom to top. The render threads can keep
+    // merging tiles, a pixel may be copied in the middle of a merge.
+    void snapshot(std::vector<Vec3f>* colors) const;
 
 private:
     uint32 m_width;
     uint32 m_height;
-    std::unique_ptr<Pixel[]> m_image;
+    Filter m_filter;
+    uint32 m_guard; // width of the guard band of the tiles in pixels
+    std::vector<float> m_r;
+    std::vector<float> m_g;
+    std::vector<float> m_b;
+    std::vector<float> m_weights;
+    std::vector<float> m_sum_sqr;
+    std::vector<uint32> m_num_samples;
 };
 
 } // namespace hop
@@ -0,0 +1,120 @@
+#include "render/film_exporter.h"
+#include "render/image_io.h"
+#include "render/tonemap.h"
+#include "spectrum/spectrum.h"
+#include "util/log.h"
+#include "util/stop_watch.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace hop {
+
+FilmExporter::FilmExporter()
+    : m_busy(false), m_stop(false), m_failed(false)
+{
+}
+
+FilmExporter::~FilmExporter()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_job_cond.notify_one();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void FilmExporter::export_film(const Film& film, const std::string& filename, ToneMapType tonemap)
+{
+    Job job;
+    job.filename = filename;
+    job.format = image_format_from_filename(filename);
+    job.tonemap = tonemap;
+    job.width = film.get_width();
+    job.height = film.get_height();
+    film.snapshot(&job.pixels);
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        // The thread is only started with the first export
+        if (!m_thread.joinable())
+            m_thread = std::thread(&FilmExporter::run, this);
+
+        bool replaced = false;
+        for (auto& pending : m_jobs)
+        {
+            if (pending.filename == filename)
+            {
+                pending = std::move(job);
+                replaced = true;
+                break;
+            }
+        }
+        if (!replaced)
+            m_jobs.push_back(std::move(job));
+    }
+    m_job_cond.notify_one();
+}
+
+bool FilmExporter::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle_cond.wait(lock, [this]() { return m_jobs.empty() && !m_busy; });
+
+    const bool ok = !m_failed;
+    m_failed = false;
+    return ok;
+}
+
+void FilmExporter::run()
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_job_cond.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+
+            // Pending exports are still written when stopping
+            if (m_jobs.empty())
+                return;
+
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_busy = true;
+        }
+
+        const bool ok = write(job);
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_busy = false;
+            m_failed |= !ok;
+        }
+        m_idle_cond.notify_all();
+    }
+}
+
+bool FilmExporter::write(Job& job)
+{
+    StopWatch timer;
+    timer.start();
+
+    if (!is_hdr_format(job.format))
+        for (auto& pixel : job.pixels)
+            pixel = tonemap(job.tonemap, Spectrum(pixel.x, pixel.y, pixel.z));
+
+    if (!write_image(job.filename, job.format, &job.pixels[0], job.width, job.height))
+        return false;
+
+    Log("film") << INFO << "wrote " << job.filename << " in " << timer.get_elapsed_time_ms() << " ms";
+    return true;
+}
+
+} // namespace hop
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "types.h"
+#include "math/vec3.h"
+#include "render/film.h"
+#include "render/image_io.h"
+#include "render/tonemap.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace hop {
+
+// Writes images of the film on a background thread. The film is copied
+// when the export is requested, the tonemapping and the encoding happen
+// on the exporter thread so the render threads are never stalled.
+// A pending export to a file is replaced by a newer one to the same file,
+// checkpoints can be requested faster than they are written.
+class FilmExporter
+{
+public:
+    FilmExporter();
+    ~FilmExporter();
+
+    // The format comes from the file extension, tonemap is only applied
+    // to the 8 bits formats
+    void export_film(const Film& film, const std::string& filename, ToneMapType tonemap);
+
+    // Wait until all the requested exports are written.
+    // Returns false if an export failed since the last call.
+    bool wait();
+
+    FilmExporter(const FilmExporter&) = delete;
+    FilmExporter& operator=(const FilmExporter&) = delete;
+
+private:
+    struct Job
+    {
+        std::string filename;
+        ImageFormat format;
+        ToneMapType tonemap;
+        uint32 width;
+        uint32 height;
+        std::vector<Vec3f> pixels;
+    };
+
+    void run();
+    static bool write(Job& job);
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_job_cond;
+    std::condition_variable m_idle_cond;
+    std::deque<Job> m_jobs;
+    bool m_busy;
+    bool m_stop;
+    bool m_failed;
+};
+
+} // namespace hop
@@ -0,0 +1,95 @@
+#include "render/filter.h"
+#include "math/math.h"
+#include "util/log.h"
+#include "util/string_util.h"
+
+#include <string>
+
+namespace hop {
+
+FilterType filter_from_string(const char* s)
+{
+    const std::string str = to_lower(s);
+
+    if (str == "box")
+        return FilterType::BOX;
+    else if (str == "gaussian")
+        return FilterType::GAUSSIAN;
+    else if (str == "mitchell")
+        return FilterType::MITCHELL;
+    else if (str == "blackman_harris" || str == "blackman-harris")
+        return FilterType::BLACKMAN_HARRIS;
+    return FilterType::GAUSSIAN;
+}
+
+float get_default_filter_radius(FilterType type)
+{
+    switch (type)
+    {
+        case FilterType::BOX:
+            return 0.5f;
+        case FilterType::GAUSSIAN:
+            return 1.5f;
+        case FilterType::MITCHELL:
+        case FilterType::BLACKMAN_HARRIS:
+        default:
+            return 2.0f;
+    }
+}
+
+// 1D profile of the filter at a distance x in [0, radius]
+static float evaluate_profile(FilterType type, float x, float radius)
+{
+    switch (type)
+    {
+        case FilterType::GAUSSIAN: {
+            const float alpha = 2.0f;
+            return max(0.0f, exp(-alpha * x * x) - exp(-alpha * radius * radius));
+        }
+
+        // Mitchell-Netravali with B = C = 1/3, the profile spans [-2, 2]
+        case FilterType::MITCHELL: {
+            const float B = 1.0f / 3.0f;
+            const float C = 1.0f / 3.0f;
+            const float t = 2.0f * x / radius;
+            if (t < 1.0f)
+                return ((12.0f - 9.0f * B - 6.0f * C) * t * t * t +
+                        (-18.0f + 12.0f * B + 6.0f * C) * t * t +
+                        (6.0f - 2.0f * B)) * (1.0f / 6.0f);
+            return ((-B - 6.0f * C) * t * t * t + (6.0f * B + 30.0f * C) * t * t +
+                    (-12.0f * B - 48.0f * C) * t + (8.0f * B + 24.0f * C)) * (1.0f / 6.0f);
+        }
+
+        // 4 term Blackman-Harris window over [-radius, radius]
+        case FilterType::BLACKMAN_HARRIS: {
+            const float a0 = 0.35875f;
+            const float a1 = 0.48829f;
+            const float a2 = 0.14128f;
+            const float a3 = 0.01168f;
+            const float t = 2.0f * (float)pi * (0.5f + 0.5f * x / radius);
+            return a0 - a1 * cos(t) + a2 * cos(2.0f * t) - a3 * cos(3.0f * t);
+        }
+
+        case FilterType::BOX:
+        default:
+            return 1.0f;
+    }
+}
+
+Filter::Filter(FilterType type, float radius)
+    : m_type(type)
+{
+    m_radius = radius > 0.0f ? radius : get_default_filter_radius(type);
+    if (m_radius > MAX_FILTER_RADIUS)
+    {
+        Log("filter") << WARNING << "filter radius " << m_radius << " clamped to " << MAX_FILTER_RADIUS;
+        m_radius = MAX_FILTER_RADIUS;
+    }
+
+    // The table entries are evaluated at the middle of their interval
+    m_table_scale = (float)FILTER_TABLE_SIZE / m_radius;
+    for (uint32 i = 0; i < FILTER_TABLE_SIZE; ++i)
+        m_table[i] = evaluate_profile(type, ((float)i + 0.5f) / m_table_scale, m_radius);
+}
+
+} // namespace hop
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "math/math.h"
+
+namespace hop {
+
+enum class FilterType
+{
+    BOX,
+    GAUSSIAN,
+    MITCHELL,
+    BLACKMAN_HARRIS
+};
+
+FilterType filter_from_string(const char* str);
+
+// Radius of the filter's footprint in pixels when none is given
+float get_default_filter_radius(FilterType type);
+
+// Separable pixel reconstruction filter. The weight of a sample is the
+// product of the 1D profile along x and y, the profile is tabulated over
+// the radius of the filter.
+class Filter
+{
+public:
+    // A radius of 0 uses the filter's default radius
+    Filter(FilterType type, float radius = 0.0f);
+
+    FilterType get_type() const { return m_type; }
+    float get_radius() const { return m_radius; }
+
+    // Weight at a distance d from the pixel center along an axis, |d| < radius
+    float evaluate(float d) const
+    {
+        const uint32 i = min((uint32)(abs(d) * m_table_scale), (uint32)(FILTER_TABLE_SIZE - 1));
+        return m_table[i];
+    }
+
+    float evaluate(float dx, float dy) const { return evaluate(dx) * evaluate(dy); }
+
+private:
+    FilterType m_type;
+    float m_radius;
+    float m_table_scale;
+    float m_table[FILTER_TABLE_SIZE];
+};
+
+} // namespace hop
@@ -3,34 +3,58 @@
 
 #include <string>
 #include <sstream>
+#include <vector>
+#include <cstring>
 #include <GL/glew.h>
 
 namespace hop {
 
 GLWindow::GLWindow(unsigned int width, unsigned int height, const char* title)
     : Window(width, height, title)
-    , m_texture_id(0), m_pbo_id(0)
+    , m_texture_id(0), m_pbo_ids{0, 0}, m_pbo_index(0)
     , m_quad_vao_id(0), m_quad_vbo_id(0), m_quad_program_id(0)
 {
 }
 
-void* GLWindow::map_framebuffer()
-{
-    // Bind PBO to update pixel values
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo_id);
-    glBufferData(GL_PIXEL_UNPACK_BUFFER, 3 * sizeof(float) * m_window_width * m_window_height, 0, GL_STREAM_DRAW);
-    return glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
-}
-
-void GLWindow::unmap_framebuffer()
+void GLWindow::upload_regions(const float* image, const std::vector<FramebufferRegion>& regions)
 {
+    size_t num_floats = 0;
+    for (const auto& r : regions)
+        num_floats += 3 * r.w * r.h;
+    if (num_floats == 0)
+        return;
+
+    // Stage the regions in the PBO that wasn't used for the last frame, its
+    // previous content is discarded so the map doesn't wait for the GPU
+    m_pbo_index ^= 1;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo_ids[m_pbo_index]);
+    float* staging = (float*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, num_floats * sizeof(float),
+                                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!staging)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return;
+    }
+
+    float* dst = staging;
+    for (const auto& r : regions)
+    {
+        for (unsigned int j = 0; j < r.h; ++j)
+        {
+            std::memcpy(dst, image + 3 * ((r.y + j) * m_window_width + r.x), 3 * sizeof(float) * r.w);
+            dst += 3 * r.w;
+        }
+    }
     glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-    // Transfer the data
+    // Transfer the regions from their offsets in the PBO
     glBindTexture(GL_TEXTURE_2D, m_texture_id);
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo_id);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_window_width, m_window_height, GL_RGB, GL_FLOAT, 0);
+    size_t offset = 0;
+    for (const auto& r : regions)
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.w, r.h, GL_RGB, GL_FLOAT, (void*)(offset * sizeof(float)));
+        offset += 3 * r.w * r.h;
+    }
     glBindTexture(GL_TEXTURE_2D, 0);
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
@@ -65,13 +89,13 @@ void GLWindow::init()
 
 void GLWindow::release()
 {
-    if (m_pbo_id) glDeleteBuffers(1, &m_pbo_id);
+    if (m_pbo_ids[0]) glDeleteBuffers(2, m_pbo_ids);
     if (m_texture_id) glDeleteTextures(1, &m_texture_id);
     if (m_quad_vao_id) glDeleteVertexArrays(1, &m_quad_vao_id);
     if (m_quad_vbo_id) glDeleteBuffers(1, &m_quad_vbo_id);
     if (m_quad_program_id) glDeleteProgram(m_quad_program_id);
 
-    m_pbo_id = 0;
+    m_pbo_ids[0] = m_pbo_ids[1] = 0;
     m_texture_id = 0;
     m_quad_vao_id = 0;
     m_quad_vbo_id = 0;
@@ -100,9 +124,13 @@ void GLWindow::init_gl()
     glBindTexture(GL_TEXTURE_2D, 0);
     check_gl_error();
 
-    glGenBuffers(1, &m_pbo_id);
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo_id);
-    glBufferData(GL_PIXEL_UNPACK_BUFFER, 3 * sizeof(float) * m_window_width * m_window_height, NULL, GL_STREAM_DRAW);
+    // Two PBOs large enough for a full frame, used in turn
+    glGenBuffers(2, m_pbo_ids);
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo_ids[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, 3 * sizeof(float) * m_window_width * m_window_height, NULL, GL_STREAM_DRAW);
+    }
     glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
     check_gl_error();
 
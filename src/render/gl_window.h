@@ -3,17 +3,27 @@
 #include "render/window.h"
 
 #include <string>
+#include <vector>
 #include <GL/glew.h>
 
 namespace hop {
 
+struct FramebufferRegion
+{
+    unsigned int x, y, w, h;
+};
+
 class GLWindow : public Window
 {
 public:
     GLWindow(unsigned int width, unsigned int height, const char* title);
 
-    void* map_framebuffer();
-    void unmap_framebuffer();
+    // Copy regions of an image to the displayed texture. The image has the
+    // size of the window, RGB float pixels and rows bottom to top.
+    // Only the regions are staged in a PBO, packed one after the other, and
+    // each one is uploaded with its own glTexSubImage2D. The two PBOs are
+    // used in turn, a frame is staged while the previous one is transferred.
+    void upload_regions(const float* image, const std::vector<FramebufferRegion>& regions);
 
     void init() override;
     void release() override;
@@ -28,7 +38,8 @@ private:
 
 private:
     GLuint m_texture_id;
-    GLuint m_pbo_id;
+    GLuint m_pbo_ids[2];
+    unsigned int m_pbo_index;
     GLuint m_quad_vao_id;
     GLuint m_quad_vbo_id;
     GLuint m_quad_program_id;
@@ -0,0 +1,366 @@
+#include "render/image_io.h"
+#include "math/math.h"
+#include "util/log.h"
+#include "util/file_util.h"
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+namespace hop {
+
+ImageFormat image_format_from_filename(const std::string& filename)
+{
+    if (has_extension(filename, ".png"))
+        return ImageFormat::PNG;
+    else if (has_extension(filename, ".pfm"))
+        return ImageFormat::PFM;
+    else if (has_extension(filename, ".exr"))
+        return ImageFormat::EXR_HALF;
+    return ImageFormat::PPM;
+}
+
+bool is_hdr_format(ImageFormat format)
+{
+    return format == ImageFormat::PFM || format == ImageFormat::EXR_HALF || format == ImageFormat::EXR_FLOAT;
+}
+
+static inline uint8 to_byte(float v)
+{
+    return (uint8)(clamp(v, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// Little helper accumulating the bytes of a file before writing it at once
+class ByteWriter
+{
+public:
+    void put(const void* data, size_t size)
+    {
+        const uint8* bytes = (const uint8*)data;
+        m_data.insert(m_data.end(), bytes, bytes + size);
+    }
+
+    void put_u8(uint8 v) { m_data.push_back(v); }
+    void put_string(const char* s) { put(s, strlen(s) + 1); }
+
+    // Little endian, as in EXR files
+    void put_u32_le(uint32 v) { for (uint32 i = 0; i < 4; ++i) put_u8((v >> (i * 8)) & 0xff); }
+    void put_u64_le(uint64 v) { for (uint32 i = 0; i < 8; ++i) put_u8((v >> (i * 8)) & 0xff); }
+    void put_f32_le(float v) { uint32 u; memcpy(&u, &v, 4); put_u32_le(u); }
+
+    // Big endian, as in PNG files
+    void put_u32_be(uint32 v) { for (int i = 3; i >= 0; --i) put_u8((v >> (i * 8)) & 0xff); }
+
+    size_t size() const { return m_data.size(); }
+    const uint8* data() const { return m_data.data(); }
+    uint8* data() { return m_data.data(); }
+
+private:
+    std::vector<uint8> m_data;
+};
+
+static bool write_file(const std::string& filename, const void* data, size_t size)
+{
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file)
+    {
+        Log("image") << ERROR << "cannot open " << filename << " for writing";
+        return false;
+    }
+
+    const bool ok = fwrite(data, 1, size, file) == size;
+    fclose(file);
+
+    if (!ok)
+        Log("image") << ERROR << "error writing " << filename;
+    return ok;
+}
+
+bool write_ppm(const std::string& filename, const Vec3f* pixels, uint32 width, uint32 height)
+{
+    char header[64];
+    snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height);
+
+    ByteWriter out;
+    out.put(header, strlen(header));
+    for (uint32 y = 0; y < height; ++y)
+    {
+        const Vec3f* row = pixels + (height - 1 - y) * width;
+        for (uint32 x = 0; x < width; ++x)
+        {
+            out.put_u8(to_byte(row[x].x));
+            out.put_u8(to_byte(row[x].y));
+            out.put_u8(to_byte(row[x].z));
+        }
+    }
+    return write_file(filename, out.data(), out.size());
+}
+
+static uint32 crc32(const uint8* data, size_t size, uint32 crc = 0)
+{
+    static uint32 table[256];
+    static bool table_ready = false;
+    if (!table_ready)
+    {
+        for (uint32 i = 0; i < 256; ++i)
+        {
+            uint32 c = i;
+            for (uint32 k = 0; k < 8; ++k)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        table_ready = true;
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put_png_chunk(ByteWriter& out, const char* type, const ByteWriter& data)
+{
+    out.put_u32_be((uint32)data.size());
+    const size_t start = out.size();
+    out.put(type, 4);
+    out.put(data.data(), data.size());
+    out.put_u32_be(crc32(out.data() + start, out.size() - start));
+}
+
+// The image data is stored in uncompressed deflate blocks, the file is
+// bigger than a compressed PNG but there is no dependency on zlib and
+// encoding is as fast as a copy
+bool write_png(const std::string& filename, const Vec3f* pixels, uint32 width, uint32 height)
+{
+    // Rows are prefixed by their filter type, 0 is no filtering
+    const size_t row_size = width * 3 + 1;
+    std::vector<uint8> raw(row_size * height);
+    for (uint32 y = 0; y < height; ++y)
+    {
+        const Vec3f* row = pixels + (height - 1 - y) * width;
+        uint8* dst = &raw[y * row_size];
+        *dst++ = 0;
+        for (uint32 x = 0; x < width; ++x)
+        {
+            *dst++ = to_byte(row[x].x);
+            *dst++ = to_byte(row[x].y);
+            *dst++ = to_byte(row[x].z);
+        }
+    }
+
+    ByteWriter zlib;
+    zlib.put_u8(0x78); // deflate, 32K window
+    zlib.put_u8(0x01); // no preset dictionary, fastest compression
+    const size_t max_block = 65535;
+    for (size_t offset = 0; offset < raw.size() || offset == 0; offset += max_block)
+    {
+        const size_t size = min(raw.size() - offset, max_block);
+        const bool last = offset + size >= raw.size();
+        zlib.put_u8(last ? 1 : 0);
+        zlib.put_u8(size & 0xff);
+        zlib.put_u8((size >> 8) & 0xff);
+        zlib.put_u8(~size & 0xff);
+        zlib.put_u8((~size >> 8) & 0xff);
+        zlib.put(raw.data() + offset, size);
+        if (last)
+            break;
+    }
+
+    uint32 a = 1, b = 0;
+    for (size_t i = 0; i < raw.size(); ++i)
+    {
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    zlib.put_u32_be((b << 16) | a);
+
+    ByteWriter header;
+    header.put_u32_be(width);
+    header.put_u32_be(height);
+    header.put_u8(8); // bit depth
+    header.put_u8(2); // RGB
+    header.put_u8(0); // deflate
+    header.put_u8(0); // adaptive filtering
+    header.put_u8(0); // no interlacing
+
+    ByteWriter out;
+    const uint8 signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    out.put(signature, 8);
+    put_png_chunk(out, "IHDR", header);
+    put_png_chunk(out, "IDAT", zlib);
+    put_png_chunk(out, "IEND", ByteWriter());
+
+    return write_file(filename, out.data(), out.size());
+}
+
+// Portable float map, the rows are stored bottom to top like the film.
+// A negative scale means little endian data.
+bool write_pfm(const std::string& filename, const Vec3f* pixels, uint32 width, uint32 height)
+{
+    char header[64];
+    snprintf(header, sizeof(header), "PF\n%u %u\n-1.0\n", width, height);
+
+    ByteWriter out;
+    out.put(header, strlen(header));
+    for (uint32 i = 0; i < width * height; ++i)
+    {
+        out.put_f32_le(pixels[i].x);
+        out.put_f32_le(pixels[i].y);
+        out.put_f32_le(pixels[i].z);
+    }
+    return write_file(filename, out.data(), out.size());
+}
+
+// Float to half float conversion with rounding to nearest even,
+// overflows become infinities and NaNs stay NaNs
+static uint16 float_to_half(float f)
+{
+    uint32 x;
+    memcpy(&x, &f, 4);
+
+    const uint32 sign = (x >> 16) & 0x8000;
+    const uint32 abs = x & 0x7fffffff;
+
+    if (abs >= 0x7f800000) // inf or nan
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    if (abs >= 0x477ff000) // rounds to a value larger than the largest half
+        return sign | 0x7c00;
+    if (abs < 0x38800000) // denormal half or zero
+    {
+        if (abs < 0x33000000)
+            return sign;
+        const uint32 shift = 126 - (abs >> 23);
+        const uint32 mantissa = (abs & 0x7fffff) | 0x800000;
+        uint32 h = mantissa >> shift;
+        const uint32 rest = mantissa & ((1u << shift) - 1);
+        const uint32 halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1)))
+            ++h;
+        return sign | h;
+    }
+
+    uint32 h = (abs - 0x38000000) >> 13;
+    const uint32 rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        ++h;
+    return sign | h;
+}
+
+static void put_exr_attribute(ByteWriter& out, const char* name, const char* type, const ByteWriter& value)
+{
+    out.put_string(name);
+    out.put_string(type);
+    out.put_u32_le((uint32)value.size());
+    out.put(value.data(), value.size());
+}
+
+// Single part scanline OpenEXR file without compression, one scanline per block
+bool write_exr(const std::string& filename, const Vec3f* pixels, uint32 width, uint32 height, bool half)
+{
+    const uint32 pixel_type = half ? 1 : 2; // HALF or FLOAT
+    const uint32 channel_size = half ? 2 : 4;
+
+    ByteWriter out;
+    out.put_u32_le(20000630); // magic number
+    out.put_u32_le(2);        // version 2, scanline file
+
+    // The channels are sorted by name
+    ByteWriter channels;
+    for (const char* name : { "B", "G", "R" })
+    {
+        channels.put_string(name);
+        channels.put_u32_le(pixel_type);
+        channels.put_u8(0); // pLinear
+        channels.put_u8(0); channels.put_u8(0); channels.put_u8(0);
+        channels.put_u32_le(1); // x sampling
+        channels.put_u32_le(1); // y sampling
+    }
+    channels.put_u8(0);
+    put_exr_attribute(out, "channels", "chlist", channels);
+
+    ByteWriter compression;
+    compression.put_u8(0); // NO_COMPRESSION
+    put_exr_attribute(out, "compression", "compression", compression);
+
+    ByteWriter window;
+    window.put_u32_le(0);
+    window.put_u32_le(0);
+    window.put_u32_le(width - 1);
+    window.put_u32_le(height - 1);
+    put_exr_attribute(out, "dataWindow", "box2i", window);
+    put_exr_attribute(out, "displayWindow", "box2i", window);
+
+    ByteWriter line_order;
+    line_order.put_u8(0); // INCREASING_Y
+    put_exr_attribute(out, "lineOrder", "lineOrder", line_order);
+
+    ByteWriter aspect;
+    aspect.put_f32_le(1.0f);
+    put_exr_attribute(out, "pixelAspectRatio", "float", aspect);
+
+    ByteWriter center;
+    center.put_f32_le(0.0f);
+    center.put_f32_le(0.0f);
+    put_exr_attribute(out, "screenWindowCenter", "v2f", center);
+
+    ByteWriter window_width;
+    window_width.put_f32_le(1.0f);
+    put_exr_attribute(out, "screenWindowWidth", "float", window_width);
+
+    out.put_u8(0); // end of header
+
+    // Offsets of the scanlines, each is its y, its size and its data
+    const uint32 line_size = width * 3 * channel_size;
+    const uint64 first_line = out.size() + (uint64)height * 8;
+    for (uint32 y = 0; y < height; ++y)
+        out.put_u64_le(first_line + (uint64)y * (8 + line_size));
+
+    for (uint32 y = 0; y < height; ++y)
+    {
+        const Vec3f* row = pixels + (height - 1 - y) * width;
+        out.put_u32_le(y);
+        out.put_u32_le(line_size);
+        for (uint32 c = 0; c < 3; ++c)
+        {
+            // B, G then R
+            const uint32 component = 2 - c;
+            for (uint32 x = 0; x < width; ++x)
+            {
+                const float v = row[x][component];
+                if (half)
+                {
+                    const uint16 h = float_to_half(v);
+                    out.put_u8(h & 0xff);
+                    out.put_u8(h >> 8);
+                }
+                else
+                {
+                    out.put_f32_le(v);
+                }
+            }
+        }
+    }
+
+    return write_file(filename, out.data(), out.size());
+}
+
+bool write_image(const std::string& filename, ImageFormat format, const Vec3f* pixels, uint32 width, uint32 height)
+{
+    switch (format)
+    {
+        case ImageFormat::PNG:
+            return write_png(filename, pixels, width, height);
+        case ImageFormat::PFM:
+            return write_pfm(filename, pixels, width, height);
+        case ImageFormat::EXR_HALF:
+            return write_exr(filename, pixels, width, height, true);
+        case ImageFormat::EXR_FLOAT:
+            return write_exr(filename, pixels, width, height, false);
+        case ImageFormat::PPM:
+        default:
+            return write_ppm(filename, pixels, width, height);
+    }
+}
+
+} // namespace hop
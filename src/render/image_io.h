@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.h"
+#include "math/vec3.h"
+
+#include <string>
+
+namespace hop {
+
+enum class ImageFormat
+{
+    PPM,        // 8 bits RGB, tonemapped
+    PNG,        // 8 bits RGB, tonemapped
+    PFM,        // 32 bits float RGB, linear
+    EXR_HALF,   // 16 bits half float RGB, linear
+    EXR_FLOAT   // 32 bits float RGB, linear
+};
+
+// Format from the file extension, .exr files are written as half floats
+ImageFormat image_format_from_filename(const std::string& filename);
+
+// True for the formats that store linear radiance, the other formats
+// expect tonemapped values
+bool is_hdr_format(ImageFormat format);
+
+// Write RGB images. The rows are given bottom to top, as in the film and
+// the framebuffer. The 8 bits formats clamp the values to [0, 1].
+bool write_ppm(const std::string& filename, const Vec3f* pixels, uint32 width, uint32 height);
+bool write_png(const std::string& filename, const Vec3f* pixels, uint32 width, uint32 height);
+bool write_pfm(const std::string& filename, const Vec3f* pixels, uint32 width, uint32 height);
+bool write_exr(const std::string& filename, const Vec3f* pixels, uint32 width, uint32 height, bool half);
+
+bool write_image(const std::string& filename, ImageFormat format, const Vec3f* pixels, uint32 width, uint32 height);
+
+} // namespace hop
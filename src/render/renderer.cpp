@@ -7,12 +7,14 @@
 #include "render/film.h"
 #include "render/tile.h"
 #include "render/tonemap.h"
+#include "render/film_exporter.h"
 #include "geometry/world.h"
 #include "geometry/ray.h"
 #include "geometry/hit_info.h"
 #include "geometry/interaction.h"
 #include "util/log.h"
 #include "util/stop_watch.h"
+#include "util/thread_util.h"
 #include "camera/camera.h"
 #include "camera/projective_camera.h"
 #include "camera/camera_sample.h"
@@ -22,31 +24,42 @@
 #include "math/vec2.h"
 #include "math/vec3.h"
 #include "integrator/pathtracing.h"
+#include "integrator/wavefront.h"
 #include "integrator/ao.h"
 #include "integrator/debug.h"
 #include "spectrum/spectrum.h"
+#include "sampler/sampler.h"
 
 #include <vector>
 #include <memory>
-#include <mutex>
 #include <thread>
 #include <atomic>
 #include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
 
 namespace hop {
 
 Renderer::Renderer(std::shared_ptr<World> world, std::shared_ptr<Camera> camera, const RenderOptions& options)
-    : m_window(std::make_unique<GLWindow>(options.frame_size.x, options.frame_size.y, "Hop renderer"))
-    , m_world(world), m_camera(camera), m_next_free_tile(0)
+    : m_world(world), m_camera(camera)
     , m_ctrl_pressed(false), m_options(options), m_integrator_mode(PATH), m_display_mode(COLOR)
     , m_num_adaptive_samples(options.adaptive_spp), m_num_firefly_samples(options.firefly_spp)
     , m_adaptive_exponent(options.adaptive_exponent)
     , m_adaptive_threshold(options.adaptive_threshold), m_firefly_threshold(options.firefly_threshold)
     , m_tonemap(options.tonemap)
+    , m_displayed_mode(COLOR), m_displayed_tonemap(options.tonemap), m_num_saved_images(0)
 {
-    m_trackball = std::make_unique<TrackBall>(m_camera, this);
-
     reset();
+}
+
+// The window and the trackball are only created for interactive rendering,
+// batch rendering doesn't need a display
+void Renderer::init_window()
+{
+    m_window = std::make_unique<GLWindow>(m_options.frame_size.x, m_options.frame_size.y, "Hop renderer");
+    m_trackball = std::make_unique<TrackBall>(m_camera, this);
 
     m_window->set_key_handler([&](int key, int /*scancode*/, int action, int /*mods*/)
     {
@@ -62,6 +75,13 @@ Renderer::Renderer(std::shared_ptr<World> world, std::shared_ptr<Camera> camera,
         {
             m_trackball->reset();
         }
+        else if (action == GLFW_PRESS && key == GLFW_KEY_S)
+        {
+            // Save the linear and the tonemapped images
+            const std::string name = "hop_" + std::to_string(m_num_saved_images++);
+            save_image(name + ".exr");
+            save_image(name + ".png");
+        }
         else if (action == GLFW_PRESS && key == GLFW_KEY_O)
         {
             m_integrator_mode = OCCLUSION;
@@ -87,6 +107,11 @@ Renderer::Renderer(std::shared_ptr<World> world, std::shared_ptr<Camera> camera,
             m_integrator_mode = PATH;
             reset();
         }
+        else if (action == GLFW_PRESS && key == GLFW_KEY_W)
+        {
+            m_integrator_mode = WAVEFRONT;
+            reset();
+        }
         else if (action == GLFW_PRESS && key == GLFW_KEY_I)
         {
             m_display_mode = SAMPLES;
@@ -172,80 +197,111 @@ Real Renderer::set_focus_point(const Vec2r& point)
 
 void Renderer::reset()
 {
-    std::unique_lock<std::mutex> tiles_lock(m_tiles_mutex);
+    std::shared_ptr<Integrator> integrator;
 
     switch (m_integrator_mode)
     {
         case OCCLUSION:
-            m_integrator = std::make_shared<AmbientOcclusionIntegrator>(m_world, m_options.ray_epsilon);
+            integrator = std::make_shared<AmbientOcclusionIntegrator>(m_world, m_options.ray_epsilon);
+            break;
+        case WAVEFRONT:
+            integrator = std::make_shared<WavefrontPathIntegrator>(m_world, m_options.ray_epsilon);
             break;
         case POSITION:
-            m_integrator = std::make_shared<DebugIntegrator>(m_world, m_options.ray_epsilon, DebugIntegrator::POSITION);
+            integrator = std::make_shared<DebugIntegrator>(m_world, m_options.ray_epsilon, DebugIntegrator::POSITION);
             break;
         case NORMALS:
-            m_integrator = std::make_shared<DebugIntegrator>(m_world, m_options.ray_epsilon, DebugIntegrator::NORMALS);
+            integrator = std::make_shared<DebugIntegrator>(m_world, m_options.ray_epsilon, DebugIntegrator::NORMALS);
             break;
         case UVS:
-            m_integrator = std::make_shared<DebugIntegrator>(m_world, m_options.ray_epsilon, DebugIntegrator::UVS);
+            integrator = std::make_shared<DebugIntegrator>(m_world, m_options.ray_epsilon, DebugIntegrator::UVS);
             break;
         case PATH:
         default:
-            m_integrator = std::make_shared<PathIntegrator>(m_world, m_options.ray_epsilon);
+            integrator = std::make_shared<PathIntegrator>(m_world, m_options.ray_epsilon);
             break;
     }
 
-    m_next_free_tile = 0;
-    for (uint32 i = 0; i < m_tiles.size(); ++i)
-        m_tiles[i].n = 0;
+    // The render threads pick up the new integrator with their next tile
+    std::atomic_store(&m_integrator, integrator);
+    m_scheduler.reset();
 }
 
-int Renderer::render(bool interactive)
+void Renderer::init_render()
 {
 #ifdef TILES_SPIRAL
-    m_tiles = make_tiles_spiral(m_options.frame_size.x, m_options.frame_size.y,
-                                m_options.tile_size.x, m_options.tile_size.y);
+    m_scheduler.set_tiles(make_tiles_spiral(m_options.frame_size.x, m_options.frame_size.y,
+                                            m_options.tile_size.x, m_options.tile_size.y));
 #else
-    m_tiles = make_tiles_linear(m_options.frame_size.x, m_options.frame_size.y,
-                                m_options.tile_size.x, m_options.tile_size.y);
+    m_scheduler.set_tiles(make_tiles_linear(m_options.frame_size.x, m_options.frame_size.y,
+                                            m_options.tile_size.x, m_options.tile_size.y));
 #endif
 
-    std::atomic<bool> rendering_done(false);
-    std::atomic<bool> tile_done(false);
-    m_next_free_tile = 0;
+    m_film = std::make_unique<Film>(m_options.frame_size.x, m_options.frame_size.y,
+                                    Filter(m_options.filter, m_options.filter_radius));
 
-    m_film = std::make_unique<Film>(m_options.frame_size.x, m_options.frame_size.y);
+    const uint32 num_tiles = m_scheduler.get_num_tiles();
+    m_dirty_tiles = std::make_unique<std::atomic<bool>[]>(num_tiles);
+    for (uint32 i = 0; i < num_tiles; ++i)
+        m_dirty_tiles[i] = true;
+    m_display_buffer.assign(m_options.frame_size.x * m_options.frame_size.y, Vec3f(0.0f));
+    m_dirty_rows.resize(m_options.frame_size.y);
+}
 
-    // Spawn the render threads
-    int num_threads = std::thread::hardware_concurrency() - 1;
-    std::vector<std::thread> render_threads;
+// Spawn the render threads, they render the tiles handed out by the scheduler
+// until it runs out of passes or rendering_done is set
+void Renderer::spawn_render_threads(uint32 num_threads, const std::atomic<bool>& rendering_done,
+                                    std::atomic<bool>& tile_done, std::vector<std::thread>* threads)
+{
+    Log("renderer") << INFO << "rendering with " << num_threads << " threads";
 
-    for (int i = 0; i < num_threads; ++i)
+    for (uint32 i = 0; i < num_threads; ++i)
     {
-        render_threads.push_back(std::thread([&]()
+        threads->push_back(std::thread([&]()
         {
-            while (!rendering_done)
-            {
-                if (!interactive && m_next_free_tile >= m_tiles.size())
-                    break;
-
-                // Get a tile and render it
-                m_tiles_mutex.lock();
-                uint32 tile_idx = m_next_free_tile++ % m_tiles.size();
-                Tile tile = m_tiles[tile_idx];
-                std::shared_ptr<Integrator> integrator = m_integrator;
-                m_tiles_mutex.unlock();
-
-                render_tile(tile, m_options.spp, integrator);
-
-                // Increase the sample count for this tile
-                m_tiles_mutex.lock();
-                ++m_tiles[tile_idx].n;
-                m_tiles_mutex.unlock();
+            // Each thread draws its samples from its own sampler and
+            // accumulates them in its own tile buffer
+            std::unique_ptr<Sampler> sampler = make_sampler(m_options.sampler, m_options.spp, m_options.seed);
+            FilmTile film_tile;
 
+            TileTicket ticket;
+            while (!rendering_done && m_scheduler.acquire(&ticket))
+            {
+                std::shared_ptr<Integrator> integrator = std::atomic_load(&m_integrator);
+                {
+                    // Keep the world from being updated during the tile
+                    std::shared_lock<SharedMutex> lock(m_world->get_mutex());
+                    render_tile(ticket.tile, ticket.spp > 0 ? ticket.spp : m_options.spp, integrator, *sampler, film_tile);
+                }
+                m_scheduler.release(ticket);
+
+                m_dirty_tiles[ticket.index] = true;
                 tile_done = true;
             }
         }));
+
+        // Leave the first core to the main thread
+        if (m_options.pin_threads && !pin_thread_to_core(threads->back(), i + 1))
+            Log("renderer") << WARNING << "could not pin render thread " << i;
     }
+}
+
+int Renderer::render()
+{
+    if (!m_window)
+        init_window();
+
+    init_render();
+
+    std::atomic<bool> rendering_done(false);
+    std::atomic<bool> tile_done(false);
+
+    // The tiles are rendered over and over until the window is closed
+    m_scheduler.set_pass_limit(0);
+    m_scheduler.set_preview_passes(m_options.preview ? get_num_preview_passes() : 0, m_film->get_guard_band());
+
+    std::vector<std::thread> render_threads;
+    spawn_render_threads(get_num_worker_threads(m_options.num_threads), rendering_done, tile_done, &render_threads);
 
     m_window->show();
 
@@ -258,6 +314,12 @@ int Renderer::render(bool interactive)
     StopWatch loop_timer;
     loop_timer.start();
 
+    // The display is refreshed at a limited rate, not after every tile
+    StopWatch display_timer;
+    display_timer.start();
+    const double frame_time_ms = 1000.0 / MAX_DISPLAY_FPS;
+    std::vector<FramebufferRegion> regions;
+
     // Poll the window events and update the framebuffer
     while (!m_window->should_close())
     {
@@ -275,16 +337,24 @@ int Renderer::render(bool interactive)
         }
         */
 
-        if (tile_done)
+        const bool redraw_all = m_display_mode != m_displayed_mode || m_tonemap != m_displayed_tonemap;
+        if (!(tile_done || redraw_all) || display_timer.get_elapsed_time_ms() < frame_time_ms)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        else
         {
             tile_done = false;
-            // copy tile to framebuffer and swap the window's framebuffer
-            Vec3f* framebuffer = (Vec3f*)m_window->map_framebuffer();
-            postprocess_buffer_and_display(framebuffer, m_options.frame_size.x, m_options.frame_size.y);
+            display_timer.start();
+
+            // Update the tiles rendered since the last frame and upload
+            // the changed regions of the display buffer
+            update_display_buffer(redraw_all, &regions);
+            m_window->upload_regions((const float*)&m_display_buffer[0], regions);
 
             /*
             draw::Buffer<Vec3f> buf;
-            buf.buffer = framebuffer;
+            buf.buffer = &m_display_buffer[0];
             buf.pitch = m_options.frame_size.x;
             buf.width = m_options.frame_size.x;
             buf.height = m_options.frame_size.y;
@@ -295,8 +365,6 @@ int Renderer::render(bool interactive)
             draw::print(buf, oss.str().c_str(), Vec2u(10, 10), Vec3f(1, 1, 1));
             */
 
-            m_window->unmap_framebuffer();
-
             m_window->swap_buffers();
         }
     }
@@ -308,31 +376,111 @@ int Renderer::render(bool interactive)
     return 0;
 }
 
-// Renders a tile, spp rays are shot from the tile to determine the tile's uniform color
-void Renderer::render_subtile(const Tile& tile, uint32 spp, bool reset, std::shared_ptr<Integrator> integrator)
+// Render without a window for a number of samples per pixel and/or a time
+// budget, then write the image. All the cores render, there is no preview
+// and nothing is displayed while rendering.
+int Renderer::render_batch(const BatchOptions& batch)
 {
-    if (reset)
-        for (uint32 j = 0; j < tile.h; ++j)
-            for (uint32 i = 0; i < tile.w; ++i)
-                m_film->reset_pixel(tile.x + i, tile.y + j);
+    init_render();
+
+    // Every pass is a final pass
+    const bool preview = m_options.preview;
+    m_options.preview = false;
+
+    // The last pass renders the samples left when batch.spp isn't a multiple of the spp
+    const uint32 num_passes = batch.spp > 0 ? (batch.spp + m_options.spp - 1) / m_options.spp :
+                              batch.time_budget > 0.0 ? 0 : 1;
+    const uint32 last_pass_spp = batch.spp > 0 ? batch.spp - (num_passes - 1) * m_options.spp : m_options.spp;
+    m_scheduler.set_pass_limit(num_passes, last_pass_spp);
+
+    std::atomic<bool> rendering_done(false);
+    std::atomic<bool> tile_done(false);
+
+    const uint32 num_threads = m_options.num_threads > 0 ? m_options.num_threads : max(std::thread::hardware_concurrency(), 1u);
+
+    StopWatch timer;
+    timer.start();
+
+    std::vector<std::thread> render_threads;
+    spawn_render_threads(num_threads, rendering_done, tile_done, &render_threads);
+
+    // Wait until all the passes are handed out or the time is up
+    double last_report = 0.0;
+    double last_checkpoint = 0.0;
+    while (!m_scheduler.is_exhausted())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        const double elapsed = timer.get_elapsed_time_s();
+        if (batch.time_budget > 0.0 && elapsed >= batch.time_budget)
+            break;
 
+        // Write the image rendered so far, in the background
+        if (batch.checkpoint_interval > 0.0 && elapsed - last_checkpoint >= batch.checkpoint_interval)
+        {
+            last_checkpoint = elapsed;
+            m_exporter.export_film(*m_film, batch.output, m_tonemap);
+        }
+
+        if (elapsed - last_report >= 5.0)
+        {
+            last_report = elapsed;
+            const double passes = (double)m_scheduler.get_num_acquired() / m_scheduler.get_num_tiles();
+            Log("renderer") << INFO << "rendered " << (uint32)passes << " passes in " << elapsed << " s";
+        }
+    }
+
+    rendering_done = true;
+    for (auto& rt : render_threads)
+        rt.join();
+
+    m_options.preview = preview;
+
+    const uint32 passes = min(m_scheduler.get_num_acquired() / m_scheduler.get_num_tiles(),
+                              num_passes > 0 ? (uint64)num_passes : (uint64)pos_inf);
+    const uint32 spp = passes > 0 && passes == num_passes ? (passes - 1) * m_options.spp + last_pass_spp :
+                                                            passes * m_options.spp;
+    Log("renderer") << INFO << "rendered " << spp << " spp in " << timer.get_elapsed_time_s() << " s";
+
+    m_exporter.export_film(*m_film, batch.output, m_tonemap);
+    return m_exporter.wait() ? 0 : 1;
+}
+
+void Renderer::save_image(const std::string& filename)
+{
+    if (m_film)
+        m_exporter.export_film(*m_film, filename, m_tonemap);
+    else
+        Log("renderer") << WARNING << "nothing rendered yet, " << filename << " not written";
+}
+
+// Renders a tile, spp rays are shot from the tile to determine the tile's uniform color
+void Renderer::render_subtile(const Tile& tile, uint32 spp, std::shared_ptr<Integrator> integrator,
+                              Sampler& sampler, FilmTile& film_tile)
+{
     auto render = [&](uint32 spp)
     {
         for (uint32 k = 0; k < spp; ++k)
         {
-            Real dx = random<Real>();
-            Real dy = random<Real>();
+            // The samples already accumulated in the pixel give the index of the next one
+            const Vec2u pixel(tile.x, tile.y);
+            sampler.start_pixel_sample(pixel, m_film->get_num_samples(tile.x, tile.y, film_tile));
+
+            const Vec2f d = sampler.get_2d();
+            const Vec2f lens = sampler.get_2d();
             CameraSample sample;
-            sample.lens_point = Vec2r(random<Real>() * 1.0 - 0.5, random<Real>() * 1.0 - 0.5);
-            sample.film_point = Vec2r((Real)tile.x + 0.5 + dx * (Real)tile.w,
-                                  (Real)tile.y + 0.5 + dy * (Real)tile.h);
+            sample.lens_point = Vec2r(lens.x - 0.5, lens.y - 0.5);
+            sample.film_point = Vec2r((Real)tile.x + 0.5 + d.x * (Real)tile.w,
+                                  (Real)tile.y + 0.5 + d.y * (Real)tile.h);
             Ray ray;
             float ray_w = m_camera->generate_ray(sample, &ray);
-            Spectrum color = integrator->Li(ray);
+            Spectrum color = integrator->Li(ray, sampler);
 
-            for (uint32 j = 0; j < tile.h; ++j)
-                for (uint32 i = 0; i < tile.w; ++i)
-                    m_film->add_sample(tile.x + i, tile.y + j, color, ray_w);
+            // Single pixels are filtered, the camera samples are offset by half a pixel
+            if (tile.w == 1 && tile.h == 1)
+                film_tile.add_sample(Vec2f(sample.film_point.x - 0.5, sample.film_point.y - 0.5), color, ray_w);
+            else
+                film_tile.add_sample(tile.x, tile.y, color, ray_w);
         }
     };
 
@@ -342,7 +490,7 @@ void Renderer::render_subtile(const Tile& tile, uint32 spp, bool reset, std::sha
     // Render with an adaptive number of samples per pixel proportional to the standard deviation
     if (m_num_adaptive_samples > 0 && tile.n != 0 && tile.w == 1 && tile.h == 1)
     {
-        float stddev = m_film->get_standard_deviation(tile.x, tile.y);
+        float stddev = m_film->get_standard_deviation(tile.x, tile.y, film_tile);
         float v = pow(clamp(stddev * rcp(m_adaptive_threshold), 0.0f, 1.0f), m_adaptive_exponent);
         uint32 num_adaptive_samples = (uint32)(v * (float)m_num_adaptive_samples);
         if (num_adaptive_samples > 0)
@@ -352,19 +500,67 @@ void Renderer::render_subtile(const Tile& tile, uint32 spp, bool reset, std::sha
     // Render num_firefly_samples if the standard deviation is > than the threshold
     if (m_num_firefly_samples > 0 && tile.n != 0 && tile.w == 1 && tile.h == 1)
     {
-        float stddev = m_film->get_standard_deviation(tile.x, tile.y);
+        float stddev = m_film->get_standard_deviation(tile.x, tile.y, film_tile);
         if (stddev > m_firefly_threshold)
             render(m_num_firefly_samples);
     }
+
+    // The samples of a preview block count for all its pixels
+    if (tile.w > 1 || tile.h > 1)
+        film_tile.fill(tile);
+}
+
+// Renders spp samples for each pixel of a tile with a single Li_stream call.
+// There is no adaptive sampling in this mode.
+void Renderer::render_tile_stream(const Tile& tile, uint32 spp, std::shared_ptr<Integrator> integrator,
+                                  Sampler& sampler, FilmTile& film_tile)
+{
+    const uint32 num_samples = tile.w * tile.h * spp;
+
+    static thread_local std::vector<Ray> rays;
+    static thread_local std::vector<PixelSample> samples;
+    static thread_local std::vector<float> weights;
+    static thread_local std::vector<Vec2f> positions;
+    static thread_local std::vector<Spectrum> radiance;
+    rays.resize(num_samples);
+    samples.resize(num_samples);
+    weights.resize(num_samples);
+    positions.resize(num_samples);
+    radiance.resize(num_samples);
+
+    // Samples of the same pixel are consecutive
+    uint32 s = 0;
+    for (uint32 j = 0; j < tile.h; ++j)
+    {
+        for (uint32 i = 0; i < tile.w; ++i)
+        {
+            const Vec2u pixel(tile.x + i, tile.y + j);
+            const uint32 first_index = m_film->get_num_samples(pixel.x, pixel.y, film_tile);
+            for (uint32 k = 0; k < spp; ++k, ++s)
+            {
+                sampler.start_pixel_sample(pixel, first_index + k);
+                const CameraSample sample = get_camera_sample(sampler, pixel);
+                weights[s] = m_camera->generate_ray(sample, &rays[s]);
+                positions[s] = Vec2f(sample.film_point.x - 0.5, sample.film_point.y - 0.5);
+                samples[s] = sampler.get_pixel_sample();
+            }
+        }
+    }
+
+    integrator->Li_stream(&rays[0], &samples[0], &radiance[0], num_samples, sampler);
+
+    for (uint32 s = 0; s < num_samples; ++s)
+        film_tile.add_sample(positions[s], radiance[s], weights[s]);
 }
 
 // Recursively renders the four subtiles of a tile
-void Renderer::render_subtile_divide(const Tile& tile, const Tile& subtile, uint32 res, uint32 spp, bool reset, std::shared_ptr<Integrator> integrator)
+void Renderer::render_subtile_divide(const Tile& tile, const Tile& subtile, uint32 res, uint32 spp,
+                                     std::shared_ptr<Integrator> integrator, Sampler& sampler, FilmTile& film_tile)
 {
     if (subtile.w <= res && subtile.h <= res)
     {
         Tile tile_to_render = { tile.x + subtile.x, tile.y + subtile.y, subtile.w, subtile.h, 0 };
-        render_subtile(tile_to_render, spp, reset, integrator);
+        render_subtile(tile_to_render, spp, integrator, sampler, film_tile);
     }
     else
     {
@@ -376,26 +572,42 @@ void Renderer::render_subtile_divide(const Tile& tile, const Tile& subtile, uint
         Tile cbr = { subtile.x + wl, subtile.y,      wr, hb, 0 };
         Tile ctl = { subtile.x,      subtile.y + hb, wl, ht, 0 };
         Tile ctr = { subtile.x + wl, subtile.y + hb, wr, ht, 0 };
-        if (cbl.w && cbl.h) render_subtile_divide(tile, cbl, res, spp, reset, integrator);
-        if (cbr.w && cbr.h) render_subtile_divide(tile, cbr, res, spp, reset, integrator);
-        if (ctl.w && ctl.h) render_subtile_divide(tile, ctl, res, spp, reset, integrator);
-        if (ctr.w && ctr.h) render_subtile_divide(tile, ctr, res, spp, reset, integrator);
+        if (cbl.w && cbl.h) render_subtile_divide(tile, cbl, res, spp, integrator, sampler, film_tile);
+        if (cbr.w && cbr.h) render_subtile_divide(tile, cbr, res, spp, integrator, sampler, film_tile);
+        if (ctl.w && ctl.h) render_subtile_divide(tile, ctl, res, spp, integrator, sampler, film_tile);
+        if (ctr.w && ctr.h) render_subtile_divide(tile, ctr, res, spp, integrator, sampler, film_tile);
     }
 }
 
+// All the tiles have as many preview passes as a tile of the full tile size,
+// neighbouring tiles leave the preview together
+uint32 Renderer::get_num_preview_passes() const
+{
+    return (uint32)max(log2(m_options.tile_size.x), log2(m_options.tile_size.y)) + 1;
+}
+
 // Render a tile with the given number of samples per pixel
-// The method returns the actual number of spp used, which may be different in preview mode
-void Renderer::render_tile(const Tile& tile, uint32 spp, std::shared_ptr<Integrator> integrator)
+// The samples are accumulated in film_tile and merged into the film at the end of the pass
+void Renderer::render_tile(const Tile& tile, uint32 spp, std::shared_ptr<Integrator> integrator,
+                           Sampler& sampler, FilmTile& film_tile)
 {
+    m_film->reset_tile(tile, &film_tile);
+
     // Give a preview of the render by rendering using
     // a resolution a one sample per tile and increasing the resolution by 4 (2 for x and y)
-    // at each call to render_tile.
-    if (m_options.preview && tile.n <= (uint32)max(log2(tile.w), log2(tile.h)))
+    // at each call to render_tile. The tiles smaller than the tile size
+    // reach the final resolution first and keep replacing it until the others do.
+    const bool preview = m_options.preview && tile.n < get_num_preview_passes();
+    if (preview)
     {
         uint32 res = max(1u, max(tile.w, tile.h) / (1 << tile.n));
         Tile subtile = { 0, 0, tile.w, tile.h, 0 };
-        // we ask for a framebuffer reset after each iteration
-        render_subtile_divide(tile, subtile, res, m_options.preview_spp, true, integrator);
+        render_subtile_divide(tile, subtile, res, m_options.preview_spp, integrator, sampler, film_tile);
+    }
+    // Wavefront integrators trace all the samples of the tile together
+    else if (integrator->is_wavefront())
+    {
+        render_tile_stream(tile, spp, integrator, sampler, film_tile);
     }
     // Once the final resolution is reached, we can render normally
     else
@@ -406,50 +618,114 @@ void Renderer::render_tile(const Tile& tile, uint32 spp, std::shared_ptr<Integra
             for (uint32 i = 0; i < tile.w; ++i)
             {
                 Tile tile_to_render = { tile.x + i, tile.y + j, 1, 1, tile.n };
-                render_subtile(tile_to_render, spp, false, integrator);
+                render_subtile(tile_to_render, spp, integrator, sampler, film_tile);
             }
         }
     }
+
+    // Each preview pass replaces the previous one
+    m_film->merge_tile(film_tile, preview);
 }
 
-// Copy the accumulation buffer to the screen an apply the neccessary postprocessing
-void Renderer::postprocess_buffer_and_display(Vec3f* framebuffer, uint32 size_x, uint32 size_y)
+// Tonemap the pixels of the tiles merged since the last update into the display buffer.
+// A tile's samples reach the pixels around it as far as the film's guard band,
+// the rows of the tiles are grown by the guard band and merged so that each
+// pixel is processed once. The rows are processed in parallel.
+// The changed rectangles of the display buffer are returned in regions.
+void Renderer::update_display_buffer(bool redraw_all, std::vector<FramebufferRegion>* regions)
 {
-    const Film::Pixel* pixels = m_film->get_pixels();
+    const uint32 width = m_film->get_width();
+    const uint32 height = m_film->get_height();
+    const uint32 guard = m_film->get_guard_band();
+
+    regions->clear();
+    uint64 dirty_area = 0;
+
+    for (uint32 i = 0; i < m_scheduler.get_num_tiles(); ++i)
+    {
+        if (!m_dirty_tiles[i].exchange(false) && !redraw_all)
+            continue;
+
+        const Tile& tile = m_scheduler.get_tile(i);
+        const uint32 x0 = tile.x > guard ? tile.x - guard : 0;
+        const uint32 y0 = tile.y > guard ? tile.y - guard : 0;
+        const uint32 x1 = min(tile.x + tile.w + guard, width);
+        const uint32 y1 = min(tile.y + tile.h + guard, height);
+        for (uint32 y = y0; y < y1; ++y)
+            m_dirty_rows[y].push_back(Vec2u(x0, x1));
+
+        regions->push_back({ x0, y0, x1 - x0, y1 - y0 });
+        dirty_area += (uint64)(x1 - x0) * (y1 - y0);
+    }
 
-    if (m_display_mode == COLOR)
+    // One upload of the whole frame is cheaper than many small ones
+    if (redraw_all || dirty_area * 2 >= (uint64)width * height)
+        regions->assign(1, { 0, 0, width, height });
+
+    // Spans of pixels to update, as one pixel high tiles
+    std::vector<Tile> spans;
+    for (uint32 y = 0; y < height; ++y)
     {
-        for (uint32 i = 0; i < size_y; ++i)
+        std::vector<Vec2u>& row = m_dirty_rows[y];
+        if (row.empty())
+            continue;
+
+        std::sort(row.begin(), row.end(), [](const Vec2u& a, const Vec2u& b) { return a.x < b.x; });
+        Vec2u span = row[0];
+        for (size_t k = 1; k < row.size(); ++k)
         {
-            for (uint32 j = 0; j < size_x; ++j)
+            if (row[k].x <= span.y)
             {
-                const Spectrum col = pixels[i * size_x + j].color;
-                framebuffer[i * size_x + j] = tonemap(m_tonemap, col);
+                span.y = max(span.y, row[k].y);
+            }
+            else
+            {
+                spans.push_back({ span.x, y, span.y - span.x, 1, 0 });
+                span = row[k];
             }
         }
+        spans.push_back({ span.x, y, span.y - span.x, 1, 0 });
+        row.clear();
     }
-    else if (m_display_mode == VARIANCE)
+
+    const DisplayMode mode = m_display_mode;
+    const ToneMapType tonemap_type = m_tonemap;
+
+#pragma omp parallel for schedule(dynamic, 16)
+    for (int32 k = 0; k < (int32)spans.size(); ++k)
     {
-        for (uint32 i = 0; i < size_y; ++i)
+        const Tile& span = spans[k];
+        Vec3f* out = &m_display_buffer[span.y * width + span.x];
+
+        if (mode == COLOR)
+        {
+            static thread_local std::vector<float> r, g, b;
+            r.resize(span.w);
+            g.resize(span.w);
+            b.resize(span.w);
+            m_film->get_colors(span.x, span.y, span.w, &r[0], &g[0], &b[0]);
+            tonemap(tonemap_type, &r[0], &g[0], &b[0], out, span.w);
+        }
+        else if (mode == VARIANCE)
         {
-            for (uint32 j = 0; j < size_x; ++j)
+            for (uint32 i = 0; i < span.w; ++i)
             {
-                const float dev = sqrt(pixels[i * size_x + j].variance);
-                framebuffer[i * size_x + j] = Vec3f(dev, dev, dev);
+                const float dev = m_film->get_standard_deviation(span.x + i, span.y);
+                out[i] = Vec3f(dev, dev, dev);
             }
         }
-    }
-    else if (m_display_mode == SAMPLES)
-    {
-        for (uint32 i = 0; i < size_y; ++i)
+        else if (mode == SAMPLES)
         {
-            for (uint32 j = 0; j < size_x; ++j)
+            for (uint32 i = 0; i < span.w; ++i)
             {
-                float n = float(pixels[i * size_x + j].num_samples) / 1000.0f;
-                framebuffer[i * size_x + j] = Vec3f(n, n, n);
+                float n = float(m_film->get_num_samples(span.x + i, span.y)) / 1000.0f;
+                out[i] = Vec3f(n, n, n);
             }
         }
     }
+
+    m_displayed_mode = mode;
+    m_displayed_tonemap = tonemap_type;
 }
 
 } // namespace hop
@@ -8,17 +8,23 @@
 #include "geometry/ray.h"
 #include "render/gl_window.h"
 #include "render/film.h"
+#include "render/film_exporter.h"
 #include "render/tile.h"
+#include "render/tile_scheduler.h"
 #include "render/tonemap.h"
 #include "math/vec2.h"
 #include "math/vec3.h"
 #include "lua/environment.h"
 #include "util/log.h"
 #include "integrator/integrator.h"
+#include "sampler/sampler.h"
 
 #include <memory>
-#include <mutex>
 #include <functional>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
 
 namespace hop {
 
@@ -28,7 +34,16 @@ public:
     Renderer(std::shared_ptr<World> world, std::shared_ptr<Camera> camera, const RenderOptions& options);
     ~Renderer() { Log("renderer") << DEBUG << "renderer deleted"; }
 
-    int render(bool interactive = true);
+    // Render in a window until it is closed
+    int render();
+
+    // Render without a window and write the image
+    int render_batch(const BatchOptions& batch);
+
+    // Write the film to an image file in the background, the format comes
+    // from the extension: exr, pfm, png or ppm
+    void save_image(const std::string& filename);
+
     void reset();
 
     std::shared_ptr<Camera> get_camera() const { return m_camera; }
@@ -38,15 +53,27 @@ public:
     void set_lua_environment(lua::Environment* env) { m_lua = env; }
 
 private:
-    void render_tile(const Tile& tile, uint32 spp, std::shared_ptr<Integrator> integrator);
-    void render_subtile(const Tile& tile, uint32 spp, bool reset, std::shared_ptr<Integrator> integrator);
-    void render_subtile_divide(const Tile& tile, const Tile& subtile, uint32 res, uint32 spp, bool reset, std::shared_ptr<Integrator> integrator);
+    void init_window();
+    void init_render();
+    void spawn_render_threads(uint32 num_threads, const std::atomic<bool>& rendering_done,
+                              std::atomic<bool>& tile_done, std::vector<std::thread>* threads);
+
+    uint32 get_num_preview_passes() const;
+    void render_tile(const Tile& tile, uint32 spp, std::shared_ptr<Integrator> integrator,
+                     Sampler& sampler, FilmTile& film_tile);
+    void render_subtile(const Tile& tile, uint32 spp, std::shared_ptr<Integrator> integrator,
+                        Sampler& sampler, FilmTile& film_tile);
+    void render_tile_stream(const Tile& tile, uint32 spp, std::shared_ptr<Integrator> integrator,
+                            Sampler& sampler, FilmTile& film_tile);
+    void render_subtile_divide(const Tile& tile, const Tile& subtile, uint32 res, uint32 spp,
+                               std::shared_ptr<Integrator> integrator, Sampler& sampler, FilmTile& film_tile);
 
-    void postprocess_buffer_and_display(Vec3f* framebuffer, uint32 size_x, uint32 size_y);
+    void update_display_buffer(bool redraw_all, std::vector<FramebufferRegion>* regions);
 
     enum IntegratorMode
     {
         PATH,
+        WAVEFRONT,
         OCCLUSION,
         POSITION,
         NORMALS,
@@ -65,11 +92,9 @@ private:
     std::shared_ptr<World> m_world;
     std::shared_ptr<Camera> m_camera;
     std::unique_ptr<TrackBall> m_trackball;
-    std::mutex m_tiles_mutex;
     std::unique_ptr<Film> m_film;
-    std::vector<Tile> m_tiles;
-    std::shared_ptr<Integrator> m_integrator;
-    uint32 m_next_free_tile;
+    TileScheduler m_scheduler;
+    std::shared_ptr<Integrator> m_integrator; // swapped atomically by reset
     bool m_ctrl_pressed;
     RenderOptions m_options;
     lua::Environment* m_lua;
@@ -81,6 +106,13 @@ private:
     float m_adaptive_threshold;
     float m_firefly_threshold;
     ToneMapType m_tonemap;
+    std::unique_ptr<std::atomic<bool>[]> m_dirty_tiles; // tiles merged since the last display update
+    std::vector<Vec3f> m_display_buffer;                // tonemapped pixels
+    std::vector<std::vector<Vec2u>> m_dirty_rows;       // column ranges to update in each row
+    DisplayMode m_displayed_mode;
+    ToneMapType m_displayed_tonemap;
+    FilmExporter m_exporter;
+    uint32 m_num_saved_images;
 };
 
 } // namespace hop
@@ -0,0 +1,122 @@
+#include "render/tile_scheduler.h"
+#include "math/math.h"
+
+#include <vector>
+#include <atomic>
+#include <thread>
+
+namespace hop {
+
+void TileScheduler::set_tiles(const std::vector<Tile>& tiles)
+{
+    m_tiles = tiles;
+    m_states.reset(new TileState[tiles.size()]);
+    for (uint32 i = 0; i < tiles.size(); ++i)
+    {
+        m_states[i].passes = 0;
+        m_states[i].busy = false;
+    }
+    m_next = (uint64)(m_epoch & EPOCH_MASK) << EPOCH_SHIFT;
+    m_neighbours.clear();
+    m_preview_passes = 0;
+}
+
+void TileScheduler::set_preview_passes(uint32 passes, uint32 guard)
+{
+    m_preview_passes = passes;
+    m_neighbours.assign(m_tiles.size(), std::vector<uint32>());
+    if (passes == 0 || guard == 0 || m_tiles.empty())
+        return;
+
+    // The tiles lie on a grid of the size of the largest tile
+    uint32 tw = 1, th = 1, grid_w = 0, grid_h = 0;
+    for (const Tile& tile : m_tiles)
+    {
+        tw = max(tw, tile.w);
+        th = max(th, tile.h);
+    }
+    for (const Tile& tile : m_tiles)
+    {
+        grid_w = max(grid_w, tile.x / tw + 1);
+        grid_h = max(grid_h, tile.y / th + 1);
+    }
+    std::vector<int> grid(grid_w * grid_h, -1);
+    for (uint32 i = 0; i < m_tiles.size(); ++i)
+        grid[(m_tiles[i].y / th) * grid_w + m_tiles[i].x / tw] = (int)i;
+
+    const int rx = (int)((guard + tw - 1) / tw);
+    const int ry = (int)((guard + th - 1) / th);
+    for (uint32 i = 0; i < m_tiles.size(); ++i)
+    {
+        const int cx = (int)(m_tiles[i].x / tw);
+        const int cy = (int)(m_tiles[i].y / th);
+        for (int y = max(cy - ry, 0); y <= min(cy + ry, (int)grid_h - 1); ++y)
+        {
+            for (int x = max(cx - rx, 0); x <= min(cx + rx, (int)grid_w - 1); ++x)
+            {
+                const int n = grid[y * grid_w + x];
+                if (n >= 0 && (uint32)n != i)
+                    m_neighbours[i].push_back((uint32)n);
+            }
+        }
+    }
+}
+
+bool TileScheduler::acquire(TileTicket* ticket)
+{
+    const uint32 num_tiles = get_num_tiles();
+    if (num_tiles == 0)
+        return false;
+
+    const uint64 counter = m_next.fetch_add(1, std::memory_order_acquire);
+    const uint64 next = counter & COUNT_MASK;
+    if (m_pass_limit > 0 && next >= (uint64)m_pass_limit * num_tiles)
+        return false;
+
+    const uint32 index = (uint32)(next % num_tiles);
+    TileState& state = m_states[index];
+
+    // Wait for the thread still rendering the previous pass of this tile
+    while (state.busy.exchange(true, std::memory_order_acquire))
+        std::this_thread::yield();
+
+    ticket->index = index;
+    ticket->epoch = (uint32)(counter >> EPOCH_SHIFT);
+
+    // The previews of the other tiles of the last pass are all handed out
+    // already, they are being rendered. Stop waiting if the render is reset.
+    if (state.passes.load(std::memory_order_relaxed) == m_preview_passes && m_preview_passes > 0)
+    {
+        for (uint32 n : m_neighbours[index])
+        {
+            while (m_states[n].passes.load(std::memory_order_acquire) < m_preview_passes &&
+                   (m_epoch.load(std::memory_order_acquire) & EPOCH_MASK) == ticket->epoch)
+                std::this_thread::yield();
+        }
+    }
+
+    ticket->spp = m_pass_limit > 0 && next / num_tiles == m_pass_limit - 1 ? m_last_pass_spp : 0;
+    ticket->tile = m_tiles[index];
+    ticket->tile.n = state.passes.load(std::memory_order_relaxed);
+    return true;
+}
+
+void TileScheduler::release(const TileTicket& ticket)
+{
+    TileState& state = m_states[ticket.index];
+    if (ticket.epoch == (m_epoch.load(std::memory_order_acquire) & EPOCH_MASK))
+        state.passes.fetch_add(1, std::memory_order_relaxed);
+    state.busy.store(false, std::memory_order_release);
+}
+
+void TileScheduler::reset()
+{
+    // The tiles handed out from here until the counter restarts belong to
+    // the old epoch, they are discarded
+    const uint32 epoch = m_epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+    for (uint32 i = 0; i < get_num_tiles(); ++i)
+        m_states[i].passes.store(0, std::memory_order_relaxed);
+    m_next.store((uint64)(epoch & EPOCH_MASK) << EPOCH_SHIFT, std::memory_order_release);
+}
+
+} // namespace hop
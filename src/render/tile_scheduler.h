@@ -0,0 +1,100 @@
+#pragma once
+
+#include "hop.h"
+#include "types.h"
+#include "render/tile.h"
+
+#include <vector>
+#include <atomic>
+#include <memory>
+
+namespace hop {
+
+// A tile handed out to a render thread. The epoch identifies the reset
+// the tile was acquired in, passes rendered before a reset are discarded.
+// spp is the number of samples per pixel of a shorter last pass, 0 if the
+// pass has the renderer's number of samples.
+struct TileTicket
+{
+    uint32 index;
+    uint32 epoch;
+    uint32 spp;
+    Tile tile;
+};
+
+// Lock-free distribution of the tiles to the render threads.
+// The tiles are handed out in order from a shared atomic counter, pass
+// after pass. A busy flag per tile makes sure that two threads never
+// render the same tile at the same time when there are more threads than
+// tiles. The number of passes rendered for each tile is kept in an atomic
+// counter. A tile leaves the preview only once the tiles around it did.
+class TileScheduler
+{
+public:
+    TileScheduler() : m_next(0), m_epoch(0), m_pass_limit(0), m_last_pass_spp(0), m_preview_passes(0) { }
+
+    void set_tiles(const std::vector<Tile>& tiles);
+    uint32 get_num_tiles() const { return (uint32)m_tiles.size(); }
+    const Tile& get_tile(uint32 index) const { return m_tiles[index]; }
+
+    // Number of tiles handed out since the last reset, over all the passes
+    uint64 get_num_acquired() const { return m_next.load(std::memory_order_relaxed) & COUNT_MASK; }
+
+    // True once all the passes of the pass limit are handed out
+    bool is_exhausted() const
+    {
+        return m_pass_limit > 0 && get_num_acquired() >= (uint64)m_pass_limit * get_num_tiles();
+    }
+
+    // Stop handing out tiles after this many passes over the tiles, 0 never stops.
+    // The tiles of the last pass are rendered with last_pass_spp samples per
+    // pixel if it isn't 0.
+    void set_pass_limit(uint32 passes, uint32 last_pass_spp = 0)
+    {
+        m_pass_limit = passes;
+        m_last_pass_spp = last_pass_spp;
+    }
+
+    // The first passes of the tiles are previews that replace the pixels of
+    // the tile instead of adding to them. A tile starts its first final pass
+    // once the tiles closer than guard pixels finished their previews,
+    // otherwise a preview would overwrite the guard band it adds to them.
+    // 0 passes disables the preview.
+    void set_preview_passes(uint32 passes, uint32 guard);
+
+    // Get the next tile to render.
+    // Returns false when all the passes of the pass limit are handed out.
+    bool acquire(TileTicket* ticket);
+
+    // Mark the tile as rendered, its pass count is increased
+    void release(const TileTicket& ticket);
+
+    // Restart rendering from the first tile with zero passes
+    void reset();
+
+private:
+    // The counter of the tiles handed out holds the epoch in its top bits, a
+    // ticket always gets the epoch its count was handed out in
+    static const uint32 EPOCH_SHIFT = 40;
+    static const uint64 COUNT_MASK = (1ull << EPOCH_SHIFT) - 1;
+    static const uint32 EPOCH_MASK = (1u << (64 - EPOCH_SHIFT)) - 1;
+
+    // Each tile's state is on its own cache line, the threads rendering
+    // neighbouring tiles don't invalidate each other's counters
+    struct ALIGN(64) TileState
+    {
+        std::atomic<uint32> passes;
+        std::atomic<bool> busy;
+    };
+
+    std::vector<Tile> m_tiles;
+    std::unique_ptr<TileState[]> m_states;
+    std::vector<std::vector<uint32>> m_neighbours;
+    std::atomic<uint64> m_next;
+    std::atomic<uint32> m_epoch;
+    uint32 m_pass_limit;
+    uint32 m_last_pass_spp;
+    uint32 m_preview_passes;
+};
+
+} // namespace hop
@@ -1,17 +1,14 @@
+#include "hop.h"
 #include "render/tonemap.h"
+#include "math/math.h"
+#include "math/vec3.h"
+#include "util/string_util.h"
 
 #include <string>
-#include <algorithm>
+#include <immintrin.h>
 
 namespace hop {
 
-std::string to_lower(const char* str)
-{
-    std::string out(str);
-    std::transform(out.begin(), out.end(), out.begin(), ::tolower);
-    return out;
-}
-
 ToneMapType tonemap_from_string(const char* s)
 {
     const std::string str = to_lower(s);
@@ -27,4 +24,117 @@ ToneMapType tonemap_from_string(const char* s)
     return ToneMapType::GAMMA;
 }
 
+// log2 of positive normalized floats, the exponent is extracted from the
+// bits and log2 of the mantissa in [1, 2) is a polynomial (error < 1e-5)
+static inline __m128 log2_ps(__m128 x)
+{
+    const __m128i bits = _mm_castps_si128(x);
+    const __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    const __m128 m = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff))), _mm_set1_ps(1.0f));
+    const __m128 t = _mm_sub_ps(m, _mm_set1_ps(1.0f));
+
+    __m128 p = _mm_set1_ps(-0.0345952095f);
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.146433611f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.303389664f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(0.469301686f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(-0.720442370f));
+    p = _mm_add_ps(_mm_mul_ps(p, t), _mm_set1_ps(1.44268325f));
+    return _mm_add_ps(e, _mm_mul_ps(p, t));
+}
+
+// 2^x, the integer part goes in the exponent bits and 2^f for the
+// fractional part in [0, 1) is a polynomial (relative error < 1e-7)
+static inline __m128 exp2_ps(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.0f)), _mm_set1_ps(127.0f));
+
+    // floor without SSE4.1, the truncation rounds the negative numbers up
+    __m128i i = _mm_cvttps_epi32(x);
+    const __m128 fi = _mm_cvtepi32_ps(i);
+    i = _mm_add_epi32(i, _mm_castps_si128(_mm_cmplt_ps(x, fi)));
+    const __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+
+    __m128 p = _mm_set1_ps(0.00187623294f);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.00899258405f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0558236044f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.240154530f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.693152968f));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.999999927f));
+
+    const __m128i e = _mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+// x^e for x >= 0, 0 for the other values
+static inline __m128 pow_ps(__m128 x, float e)
+{
+    const __m128 positive = _mm_cmpgt_ps(x, _mm_set1_ps(1e-30f));
+    const __m128 y = exp2_ps(_mm_mul_ps(log2_ps(_mm_max_ps(x, _mm_set1_ps(1e-30f))), _mm_set1_ps(e)));
+    return _mm_and_ps(y, positive);
+}
+
+static inline __m128 tonemap_ps(ToneMapType type, __m128 x)
+{
+    const float inv_gamma = 1.0f / 2.2f;
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    switch (type)
+    {
+        case ToneMapType::GAMMA:
+            return pow_ps(x, inv_gamma);
+
+        case ToneMapType::REINHARD:
+            x = _mm_max_ps(x, _mm_setzero_ps());
+            return pow_ps(_mm_div_ps(x, _mm_add_ps(one, x)), inv_gamma);
+
+        case ToneMapType::FILMIC: {
+            x = _mm_max_ps(_mm_sub_ps(x, _mm_set1_ps(0.004f)), _mm_setzero_ps());
+            const __m128 x62 = _mm_mul_ps(x, _mm_set1_ps(6.2f));
+            const __m128 num = _mm_mul_ps(x, _mm_add_ps(x62, _mm_set1_ps(0.5f)));
+            const __m128 den = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(x62, _mm_set1_ps(1.7f))), _mm_set1_ps(0.06f));
+            return _mm_div_ps(num, den);
+        }
+
+        case ToneMapType::LINEAR:
+        default:
+            return x;
+    }
+}
+
+void tonemap(ToneMapType type, const float* r, const float* g, const float* b, Vec3f* out, uint32 n)
+{
+    ALIGN(16) float tr[4];
+    ALIGN(16) float tg[4];
+    ALIGN(16) float tb[4];
+
+    uint32 i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_store_ps(tr, tonemap_ps(type, _mm_loadu_ps(r + i)));
+        _mm_store_ps(tg, tonemap_ps(type, _mm_loadu_ps(g + i)));
+        _mm_store_ps(tb, tonemap_ps(type, _mm_loadu_ps(b + i)));
+        for (uint32 k = 0; k < 4; ++k)
+            out[i + k] = Vec3f(tr[k], tg[k], tb[k]);
+    }
+
+    // The last colors are padded to a full SSE vector
+    if (i < n)
+    {
+        ALIGN(16) float pr[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        ALIGN(16) float pg[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        ALIGN(16) float pb[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (uint32 k = 0; i + k < n; ++k)
+        {
+            pr[k] = r[i + k];
+            pg[k] = g[i + k];
+            pb[k] = b[i + k];
+        }
+        _mm_store_ps(tr, tonemap_ps(type, _mm_load_ps(pr)));
+        _mm_store_ps(tg, tonemap_ps(type, _mm_load_ps(pg)));
+        _mm_store_ps(tb, tonemap_ps(type, _mm_load_ps(pb)));
+        for (uint32 k = 0; i + k < n; ++k)
+            out[i + k] = Vec3f(tr[k], tg[k], tb[k]);
+    }
+}
+
 } // namespace hop
@@ -16,6 +16,10 @@ enum class ToneMapType
 
 ToneMapType tonemap_from_string(const char* str);
 
+// Tonemap n colors given as separate red, green and blue arrays, four
+// colors at a time with SSE
+void tonemap(ToneMapType type, const float* r, const float* g, const float* b, Vec3f* out, uint32 n);
+
 inline Vec3f tonemap(ToneMapType type, const Spectrum& color)
 {
     static float inv_gamma = rcp(2.2f);
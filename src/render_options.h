@@ -3,6 +3,10 @@
 #include "types.h"
 #include "math/vec2.h"
 #include "render/tonemap.h"
+#include "render/filter.h"
+#include "sampler/sampler.h"
+
+#include <string>
 
 namespace hop {
 
@@ -19,8 +23,14 @@ public:
     float adaptive_exponent;
     float firefly_threshold;
     ToneMapType tonemap;
+    SamplerType sampler;
+    uint32 seed;
+    FilterType filter;
+    float filter_radius; // 0 uses the filter's default radius
     bool preview;
     float ray_epsilon;
+    uint32 num_threads; // 0 uses all the cores but one
+    bool pin_threads;
 
     RenderOptions()
         : frame_size(512, 512)
@@ -28,8 +38,26 @@ public:
         , spp(10), preview_spp(1), adaptive_spp(0), firefly_spp(0)
         , adaptive_threshold(1.0), adaptive_exponent(1.0), firefly_threshold(1.0)
         , tonemap(ToneMapType::GAMMA)
+        , sampler(SamplerType::OWEN_SOBOL), seed(0)
+        , filter(FilterType::GAUSSIAN), filter_radius(0.0f)
         , preview(true)
         , ray_epsilon(1e-4f)
+        , num_threads(0), pin_threads(false)
+    {
+    }
+};
+
+// Settings of a render without a window
+class BatchOptions
+{
+public:
+    std::string output;         // exr, pfm, png or ppm file
+    uint32 spp;                 // 0 renders until the time budget is spent
+    double time_budget;         // in seconds, 0 for no limit
+    double checkpoint_interval; // write the output every this many seconds, 0 for never
+
+    BatchOptions()
+        : output("hop.exr"), spp(0), time_budget(0.0), checkpoint_interval(0.0)
     {
     }
 };
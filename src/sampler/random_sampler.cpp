@@ -0,0 +1,38 @@
+#include "sampler/random_sampler.h"
+#include "math/hash.h"
+
+namespace hop {
+
+RandomSampler::RandomSampler(uint32 samples_per_pixel, uint32 seed)
+    : Sampler(samples_per_pixel, seed)
+{
+}
+
+void RandomSampler::start_pixel_sample(const Vec2u& pixel, uint32 index, uint32 dimension)
+{
+    Sampler::start_pixel_sample(pixel, index, dimension);
+
+    // One sequence per pixel, 2^16 dimensions per sample
+    m_rng.set_sequence(hash(pixel.x, pixel.y, m_seed, 0));
+    m_rng.advance((int64)index * 65536 + dimension);
+}
+
+float RandomSampler::get_1d()
+{
+    ++m_dimension;
+    return m_rng.next_float();
+}
+
+Vec2f RandomSampler::get_2d()
+{
+    m_dimension += 2;
+    const float u = m_rng.next_float();
+    return Vec2f(u, m_rng.next_float());
+}
+
+std::unique_ptr<Sampler> RandomSampler::clone() const
+{
+    return std::unique_ptr<Sampler>(new RandomSampler(*this));
+}
+
+} // namespace hop
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "sampler/sampler.h"
+#include "math/pcg32.h"
+
+namespace hop {
+
+// Independent uniform samples from a PCG32 stream per pixel
+class RandomSampler : public Sampler
+{
+public:
+    RandomSampler(uint32 samples_per_pixel, uint32 seed);
+
+    void start_pixel_sample(const Vec2u& pixel, uint32 index, uint32 dimension = 0) override;
+
+    float get_1d() override;
+    Vec2f get_2d() override;
+
+    std::unique_ptr<Sampler> clone() const override;
+
+private:
+    PCG32 m_rng;
+};
+
+} // namespace hop
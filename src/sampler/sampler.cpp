@@ -0,0 +1,43 @@
+#include "sampler/sampler.h"
+#include "sampler/random_sampler.h"
+#include "sampler/stratified_sampler.h"
+#include "sampler/sobol_sampler.h"
+#include "util/string_util.h"
+
+#include <string>
+#include <memory>
+
+namespace hop {
+
+SamplerType sampler_from_string(const char* s)
+{
+    const std::string str = to_lower(s);
+
+    if (str == "random")
+        return SamplerType::RANDOM;
+    else if (str == "stratified")
+        return SamplerType::STRATIFIED;
+    else if (str == "sobol")
+        return SamplerType::SOBOL;
+    else if (str == "owen" || str == "owen_sobol")
+        return SamplerType::OWEN_SOBOL;
+    return SamplerType::OWEN_SOBOL;
+}
+
+std::unique_ptr<Sampler> make_sampler(SamplerType type, uint32 samples_per_pixel, uint32 seed)
+{
+    switch (type)
+    {
+        case SamplerType::RANDOM:
+            return std::unique_ptr<Sampler>(new RandomSampler(samples_per_pixel, seed));
+        case SamplerType::STRATIFIED:
+            return std::unique_ptr<Sampler>(new StratifiedSampler(samples_per_pixel, seed));
+        case SamplerType::SOBOL:
+            return std::unique_ptr<Sampler>(new SobolSampler(samples_per_pixel, seed, SobolSampler::XOR));
+        case SamplerType::OWEN_SOBOL:
+        default:
+            return std::unique_ptr<Sampler>(new SobolSampler(samples_per_pixel, seed, SobolSampler::OWEN));
+    }
+}
+
+} // namespace hop
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "types.h"
+#include "math/vec2.h"
+
+#include <memory>
+
+namespace hop {
+
+// Largest float below 1, samples are clamped to [0, 1)
+static constexpr float ONE_MINUS_EPSILON = 0.99999994f;
+
+enum class SamplerType
+{
+    RANDOM,
+    STRATIFIED,
+    SOBOL,
+    OWEN_SOBOL
+};
+
+SamplerType sampler_from_string(const char* str);
+
+// Identifies the sample of a pixel that generated a camera ray
+class PixelSample
+{
+public:
+    Vec2u pixel;
+    uint32 index;
+    uint32 dimension;
+};
+
+// Samplers generate the random numbers used by the camera and the integrators.
+// A sample is addressed by (pixel, sample index, dimension) so that the same
+// values are produced whatever thread or order the samples are taken in.
+// A sampler has per-thread state, each render thread owns its own clone.
+class Sampler
+{
+public:
+    Sampler(uint32 samples_per_pixel, uint32 seed)
+        : m_samples_per_pixel(samples_per_pixel), m_seed(seed) { }
+    virtual ~Sampler() { }
+
+    // Start generating the dimensions of a new pixel sample
+    virtual void start_pixel_sample(const Vec2u& pixel, uint32 index, uint32 dimension = 0)
+    {
+        m_pixel = pixel;
+        m_sample_index = index;
+        m_dimension = dimension;
+    }
+
+    void start_pixel_sample(const PixelSample& sample)
+    {
+        start_pixel_sample(sample.pixel, sample.index, sample.dimension);
+    }
+
+    virtual float get_1d() = 0;
+    virtual Vec2f get_2d() = 0;
+
+    virtual std::unique_ptr<Sampler> clone() const = 0;
+
+    // Current pixel sample, to restart the sampler where it was later on
+    PixelSample get_pixel_sample() const { return { m_pixel, m_sample_index, m_dimension }; }
+
+    uint32 get_dimension() const { return m_dimension; }
+    uint32 get_samples_per_pixel() const { return m_samples_per_pixel; }
+
+protected:
+    uint32 m_samples_per_pixel;
+    uint32 m_seed;
+
+    Vec2u m_pixel;
+    uint32 m_sample_index = 0;
+    uint32 m_dimension = 0;
+};
+
+std::unique_ptr<Sampler> make_sampler(SamplerType type, uint32 samples_per_pixel, uint32 seed);
+
+} // namespace hop
@@ -0,0 +1,85 @@
+#include "sampler/sobol_sampler.h"
+#include "math/hash.h"
+#include "math/math.h"
+
+namespace hop {
+
+// First dimension of Sobol' (the van der Corput sequence)
+static inline uint32 sobol_dim0(uint32 index)
+{
+    return reverse_bits(index);
+}
+
+// Second dimension of Sobol'
+static inline uint32 sobol_dim1(uint32 index)
+{
+    uint32 result = 0;
+    for (uint32 v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            result ^= v;
+    return result;
+}
+
+// Random permutation of the bits that only depends on the higher bits,
+// applied to reversed bits it gives a nested uniform (Owen) scramble
+static inline uint32 laine_karras_permutation(uint32 x, uint32 seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+static inline uint32 nested_uniform_scramble(uint32 x, uint32 seed)
+{
+    x = reverse_bits(x);
+    x = laine_karras_permutation(x, seed);
+    return reverse_bits(x);
+}
+
+static inline float to_float(uint32 v)
+{
+    return min(v * 2.32830644e-10f, ONE_MINUS_EPSILON);
+}
+
+SobolSampler::SobolSampler(uint32 samples_per_pixel, uint32 seed, Scramble scramble)
+    : Sampler(samples_per_pixel, seed), m_scramble(scramble)
+{
+}
+
+uint32 SobolSampler::scramble(uint32 v, uint32 seed) const
+{
+    if (m_scramble == OWEN)
+        return nested_uniform_scramble(v, seed);
+    return v ^ seed;
+}
+
+float SobolSampler::get_1d()
+{
+    const uint64 h = hash(m_pixel.x, m_pixel.y, m_dimension, m_seed);
+    ++m_dimension;
+
+    const uint32 index = nested_uniform_scramble(m_sample_index, (uint32)h);
+    return to_float(scramble(sobol_dim0(index), (uint32)(h >> 32)));
+}
+
+Vec2f SobolSampler::get_2d()
+{
+    const uint64 h = hash(m_pixel.x, m_pixel.y, m_dimension, m_seed);
+    m_dimension += 2;
+
+    // Both dimensions use the same shuffled index so the pair stays a (0,2)-sequence
+    const uint32 index = nested_uniform_scramble(m_sample_index, (uint32)h);
+    const uint64 h2 = mix_bits(h);
+    return Vec2f(to_float(scramble(sobol_dim0(index), (uint32)(h >> 32))),
+                 to_float(scramble(sobol_dim1(index), (uint32)(h2 >> 32))));
+}
+
+std::unique_ptr<Sampler> SobolSampler::clone() const
+{
+    return std::unique_ptr<Sampler>(new SobolSampler(*this));
+}
+
+} // namespace hop
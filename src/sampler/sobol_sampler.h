@@ -0,0 +1,35 @@
+#pragma once
+
+#include "sampler/sampler.h"
+
+namespace hop {
+
+// Padded (0,2)-sequence: each pair of dimensions uses the first two
+// dimensions of Sobol', with the sample index shuffled independently per
+// pixel and dimension pair so the dimensions are decorrelated. The points
+// are randomized either with a random XOR (Cranley-Patterson style digital
+// shift) or with a hash based Owen scrambling.
+// See Burley, Practical Hash-based Owen Scrambling, JCGT 2020.
+class SobolSampler : public Sampler
+{
+public:
+    enum Scramble
+    {
+        XOR,
+        OWEN
+    };
+
+    SobolSampler(uint32 samples_per_pixel, uint32 seed, Scramble scramble);
+
+    float get_1d() override;
+    Vec2f get_2d() override;
+
+    std::unique_ptr<Sampler> clone() const override;
+
+private:
+    uint32 scramble(uint32 v, uint32 seed) const;
+
+    Scramble m_scramble;
+};
+
+} // namespace hop
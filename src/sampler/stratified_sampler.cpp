@@ -0,0 +1,98 @@
+#include "sampler/stratified_sampler.h"
+#include "math/hash.h"
+#include "math/math.h"
+
+#include <cmath>
+
+namespace hop {
+
+// Element i of a random permutation of [0, n) selected by p,
+// without storing the permutation (Kensler, Correlated Multi-Jittered Sampling)
+static uint32 permutation_element(uint32 i, uint32 n, uint32 p)
+{
+    uint32 w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + p) % n;
+}
+
+StratifiedSampler::StratifiedSampler(uint32 samples_per_pixel, uint32 seed)
+    : Sampler(max(samples_per_pixel, 1u), seed)
+{
+    // Largest divisor of the sample count not larger than its square root
+    m_y_strata = (uint32)std::sqrt((double)m_samples_per_pixel);
+    while (m_samples_per_pixel % m_y_strata)
+        --m_y_strata;
+    m_x_strata = m_samples_per_pixel / m_y_strata;
+}
+
+void StratifiedSampler::start_pixel_sample(const Vec2u& pixel, uint32 index, uint32 dimension)
+{
+    Sampler::start_pixel_sample(pixel, index, dimension);
+
+    m_rng.set_sequence(hash(pixel.x, pixel.y, m_seed, 1));
+    m_rng.advance((int64)index * 65536 + dimension);
+}
+
+uint32 StratifiedSampler::get_stratum(uint32 num_strata, uint64 dim_hash) const
+{
+    // The pass index selects a new permutation once all the strata are used
+    const uint32 pass = m_sample_index / m_samples_per_pixel;
+    const uint32 p = (uint32)mix_bits(dim_hash ^ ((uint64)pass << 32));
+    return permutation_element(m_sample_index % m_samples_per_pixel, num_strata, p);
+}
+
+float StratifiedSampler::get_1d()
+{
+    const uint64 h = hash(m_pixel.x, m_pixel.y, m_dimension, m_seed);
+    const uint32 stratum = get_stratum(m_samples_per_pixel, h);
+    ++m_dimension;
+
+    const float u = (stratum + m_rng.next_float()) / m_samples_per_pixel;
+    return min(u, ONE_MINUS_EPSILON);
+}
+
+Vec2f StratifiedSampler::get_2d()
+{
+    const uint64 h = hash(m_pixel.x, m_pixel.y, m_dimension, m_seed);
+    const uint32 stratum = get_stratum(m_samples_per_pixel, h);
+    m_dimension += 2;
+
+    const uint32 x = stratum % m_x_strata;
+    const uint32 y = stratum / m_x_strata;
+    const float dx = m_rng.next_float();
+    const float dy = m_rng.next_float();
+    return Vec2f(min((x + dx) / m_x_strata, ONE_MINUS_EPSILON),
+                 min((y + dy) / m_y_strata, ONE_MINUS_EPSILON));
+}
+
+std::unique_ptr<Sampler> StratifiedSampler::clone() const
+{
+    return std::unique_ptr<Sampler>(new StratifiedSampler(*this));
+}
+
+} // namespace hop
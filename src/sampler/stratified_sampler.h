@@ -0,0 +1,32 @@
+#pragma once
+
+#include "sampler/sampler.h"
+#include "math/pcg32.h"
+
+namespace hop {
+
+// Jittered stratified samples. Each dimension is split in samples_per_pixel
+// strata (a grid close to square in 2D) and the strata are visited in a
+// different random order for each pixel and dimension, so the dimensions
+// are decorrelated. Past samples_per_pixel samples a new set of strata is used.
+class StratifiedSampler : public Sampler
+{
+public:
+    StratifiedSampler(uint32 samples_per_pixel, uint32 seed);
+
+    void start_pixel_sample(const Vec2u& pixel, uint32 index, uint32 dimension = 0) override;
+
+    float get_1d() override;
+    Vec2f get_2d() override;
+
+    std::unique_ptr<Sampler> clone() const override;
+
+private:
+    uint32 get_stratum(uint32 num_strata, uint64 dim_hash) const;
+
+    uint32 m_x_strata;
+    uint32 m_y_strata;
+    PCG32 m_rng;
+};
+
+} // namespace hop
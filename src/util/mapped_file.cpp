@@ -0,0 +1,50 @@
+#include "util/mapped_file.h"
+#include "util/file_util.h"
+
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace hop {
+
+MappedFile::MappedFile(const std::string& filename)
+    : m_data(nullptr), m_size(0)
+{
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw IOError("Can't open file: " + filename);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw IOError("Can't stat file: " + filename);
+    }
+
+    m_size = (size_t)st.st_size;
+    if (m_size > 0)
+    {
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            throw IOError("Can't map file: " + filename);
+        }
+        // The file is read front to back
+        madvise(data, m_size, MADV_SEQUENTIAL);
+        m_data = (const char*)data;
+    }
+
+    // The mapping stays valid after the file is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+        munmap((void*)m_data, m_size);
+}
+
+} // namespace hop
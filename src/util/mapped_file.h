@@ -0,0 +1,29 @@
+#pragma once
+
+#include "types.h"
+
+#include <string>
+#include <cstddef>
+
+namespace hop {
+
+// Read-only memory mapping of a whole file. The file is paged in on demand
+// by the OS, nothing is copied. Throws an IOError if the file can't be mapped.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char* m_data;
+    size_t m_size;
+};
+
+} // namespace hop
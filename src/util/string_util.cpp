@@ -1,5 +1,7 @@
 #include "util/string_util.h"
 
+#include <algorithm>
+#include <cctype>
 #include <vector>
 #include <string>
 
@@ -29,4 +31,11 @@ std::vector<std::string> split_string(const std::string& s, char sep)
     return tokens;
 }
 
+std::string to_lower(const char* str)
+{
+    std::string out(str);
+    std::transform(out.begin(), out.end(), out.begin(), ::tolower);
+    return out;
+}
+
 } // namespace hop
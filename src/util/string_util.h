@@ -1,3 +1,5 @@
+#pragma once
+
 #include <vector>
 #include <string>
 #include <sstream>
@@ -6,6 +8,8 @@ namespace hop {
 
 std::vector<std::string> split_string(const std::string& s, char sep = ' ');
 
+std::string to_lower(const char* str);
+
 template <typename T>
 std::string to_string(const std::vector<T>& vec, const std::string& sep = "")
 {
@@ -0,0 +1,88 @@
+#include "util/thread_util.h"
+#include "math/math.h"
+
+#include <mutex>
+#include <thread>
+
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+namespace hop {
+
+uint32 get_num_worker_threads(uint32 requested)
+{
+    if (requested > 0)
+        return requested;
+    const uint32 num_cores = std::thread::hardware_concurrency();
+    return max(num_cores, 2u) - 1;
+}
+
+bool pin_thread_to_core(std::thread& thread, uint32 core)
+{
+#ifdef __linux__
+    const uint32 num_cores = max(std::thread::hardware_concurrency(), 1u);
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(core % num_cores, &cpuset);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset) == 0;
+#else
+    (void)thread;
+    (void)core;
+    return false;
+#endif
+}
+
+void SharedMutex::lock()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [this]() { return !m_writer; });
+
+    // New readers back off from here, wait for the ones holding the lock
+    m_writer = true;
+    m_cond.wait(lock, [this]() { return m_readers == 0; });
+}
+
+void SharedMutex::unlock()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_writer = false;
+    }
+    m_cond.notify_all();
+}
+
+void SharedMutex::lock_shared()
+{
+    for (;;)
+    {
+        // Both the reader and a writer check the other after announcing
+        // themselves, with sequentially consistent atomics one of them sees it
+        if (likely(!m_writer))
+        {
+            ++m_readers;
+            if (likely(!m_writer))
+                return;
+            unlock_shared();
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() { return !m_writer; });
+    }
+}
+
+void SharedMutex::unlock_shared()
+{
+    if (--m_readers == 0 && m_writer)
+    {
+        // Take the mutex so the writer is either waiting or yet to check
+        // the readers count
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+        m_cond.notify_all();
+    }
+}
+
+} // namespace hop
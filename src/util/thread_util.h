@@ -0,0 +1,41 @@
+#pragma once
+
+#include "types.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace hop {
+
+// Number of worker threads to use, 0 means all the cores but one
+uint32 get_num_worker_threads(uint32 requested);
+
+// Restrict a thread to run on a single core.
+// Returns false if the platform doesn't support it or the call failed.
+bool pin_thread_to_core(std::thread& thread, uint32 core);
+
+// Readers-writer lock that lets a waiting writer in before new readers, so
+// threads that keep taking it shared can't starve the writer. Works with
+// std::unique_lock and std::shared_lock.
+// Readers only touch atomics while no writer is around, the mutex is taken
+// when a writer is waiting or holds the lock.
+class SharedMutex
+{
+public:
+    SharedMutex() : m_readers(0), m_writer(false) { }
+
+    void lock();
+    void unlock();
+    void lock_shared();
+    void unlock_shared();
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::atomic<uint32> m_readers;
+    std::atomic<bool> m_writer; // a writer is waiting for the readers or holds the lock
+};
+
+} // namespace hop